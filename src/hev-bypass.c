@@ -0,0 +1,268 @@
+/*
+ ============================================================================
+ Name        : hev-bypass.c
+ Author      : hev <r@hev.cc>
+ Copyright   : Copyright (c) 2025 hev
+ Description : Bypass
+ ============================================================================
+ */
+
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include <hev-task.h>
+#include <hev-task-io-socket.h>
+#include <hev-memory-allocator.h>
+
+#include "hev-utils.h"
+#include "hev-config.h"
+#include "hev-logger.h"
+#include "hev-prefix-trie.h"
+#include "hev-config-const.h"
+
+#include "hev-bypass.h"
+
+typedef struct _HevBypassTable HevBypassTable;
+
+struct _HevBypassTable
+{
+    HevPrefixTrie *v4;
+    HevPrefixTrie *v6;
+};
+
+static unsigned int mark;
+static HevBypassTable *table;
+static _Atomic (HevBypassTable *) pending;
+
+static void
+hev_bypass_table_destroy (HevBypassTable *self)
+{
+    if (self->v4)
+        hev_prefix_trie_destroy (self->v4);
+    if (self->v6)
+        hev_prefix_trie_destroy (self->v6);
+    hev_free (self);
+}
+
+/*
+ * A rule is an address with an optional prefix length, a bare address is
+ * a host route. A leading '!' sends the range back through socks5.
+ */
+static int
+hev_bypass_table_add (HevBypassTable *self, const char *rule)
+{
+    HevPrefixTrie *trie;
+    unsigned char key[16];
+    const char *slash;
+    char addr[64];
+    int value = 1;
+    size_t len;
+    int bits;
+    int max;
+
+    if (rule[0] == '!') {
+        value = 0;
+        rule++;
+    }
+
+    slash = strchr (rule, '/');
+    len = slash ? slash - rule : strlen (rule);
+    if (len >= sizeof (addr))
+        return -1;
+
+    memcpy (addr, rule, len);
+    addr[len] = '\0';
+
+    if (inet_pton (AF_INET, addr, key) == 1) {
+        trie = self->v4;
+        max = 32;
+    } else if (inet_pton (AF_INET6, addr, key) == 1) {
+        trie = self->v6;
+        max = 128;
+    } else {
+        return -1;
+    }
+
+    bits = max;
+    if (slash) {
+        char *end;
+
+        bits = strtol (slash + 1, &end, 10);
+        if ((end == slash + 1) || *end || (bits < 0) || (bits > max))
+            return -1;
+    }
+
+    return hev_prefix_trie_insert (trie, key, bits, value);
+}
+
+static HevBypassTable *
+hev_bypass_table_new (const char **rules, int count)
+{
+    HevBypassTable *self;
+    int i;
+
+    self = hev_malloc0 (sizeof (HevBypassTable));
+    if (!self)
+        return NULL;
+
+    self->v4 = hev_prefix_trie_new ();
+    self->v6 = hev_prefix_trie_new ();
+    if (!self->v4 || !self->v6)
+        goto exit;
+
+    for (i = 0; i < count; i++) {
+        if (hev_bypass_table_add (self, rules[i]) < 0) {
+            LOG_E ("bypass rule %s", rules[i]);
+            goto exit;
+        }
+    }
+
+    return self;
+
+exit:
+    hev_bypass_table_destroy (self);
+    return NULL;
+}
+
+int
+hev_bypass_init (void)
+{
+    const char *rules[BYPASS_RULES_MAX];
+    int count;
+    int i;
+
+    LOG_D ("bypass init");
+
+    mark = hev_config_get_bypass_mark ();
+    count = hev_config_get_bypass_rule_count ();
+    if (!count)
+        return 0;
+
+    for (i = 0; i < count; i++)
+        rules[i] = hev_config_get_bypass_rule (i);
+
+    table = hev_bypass_table_new (rules, count);
+    if (!table)
+        return -1;
+
+    return 0;
+}
+
+void
+hev_bypass_fini (void)
+{
+    HevBypassTable *next;
+
+    LOG_D ("bypass fini");
+
+    next = atomic_exchange (&pending, NULL);
+    if (next)
+        hev_bypass_table_destroy (next);
+
+    if (table) {
+        hev_bypass_table_destroy (table);
+        table = NULL;
+    }
+}
+
+int
+hev_bypass_match (const ip_addr_t *addr)
+{
+    int value;
+
+    if (atomic_load_explicit (&pending, memory_order_relaxed)) {
+        HevBypassTable *next = atomic_exchange (&pending, NULL);
+
+        if (next) {
+            if (table)
+                hev_bypass_table_destroy (table);
+            table = next;
+            LOG_D ("bypass table swap");
+        }
+    }
+
+    if (!table)
+        return 0;
+
+    if (IP_IS_V4 (addr)) {
+        const void *key = &ip_2_ip4 (addr)->addr;
+        value = hev_prefix_trie_lookup (table->v4, key, 32);
+    } else {
+        const void *key = ip_2_ip6 (addr)->addr;
+        value = hev_prefix_trie_lookup (table->v6, key, 128);
+    }
+
+    return value > 0;
+}
+
+int
+hev_bypass_set_rules (const char **rules, int count)
+{
+    HevBypassTable *next;
+
+    next = hev_bypass_table_new (rules, count);
+    if (!next)
+        return -1;
+
+    next = atomic_exchange (&pending, next);
+    if (next)
+        hev_bypass_table_destroy (next);
+
+    return 0;
+}
+
+int
+hev_bypass_connect (const ip_addr_t *addr, u16_t port, int type,
+                    HevTaskIOYielder yielder, void *yielder_data)
+{
+    struct sockaddr_in6 saddr = { 0 };
+    HevTask *task = hev_task_self ();
+    int zero = 0;
+    int res;
+    int fd;
+
+    saddr.sin6_family = AF_INET6;
+    saddr.sin6_port = htons (port);
+    if (IP_IS_V4 (addr)) {
+        saddr.sin6_addr.s6_addr[10] = 0xff;
+        saddr.sin6_addr.s6_addr[11] = 0xff;
+        memcpy (&saddr.sin6_addr.s6_addr[12], &ip_2_ip4 (addr)->addr, 4);
+    } else {
+        memcpy (&saddr.sin6_addr, ip_2_ip6 (addr)->addr, 16);
+    }
+
+    fd = hev_task_io_socket_socket (AF_INET6, type, 0);
+    if (fd < 0)
+        return -1;
+
+    setsockopt (fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof (zero));
+
+    if (mark) {
+        res = set_sock_mark (fd, mark);
+        if (res < 0)
+            goto exit;
+    }
+
+    res = hev_task_add_fd (task, fd, POLLIN | POLLOUT);
+    if (res < 0)
+        goto exit;
+
+    res = hev_task_io_socket_connect (fd, (struct sockaddr *)&saddr,
+                                      sizeof (saddr), yielder, yielder_data);
+    hev_task_del_fd (task, fd);
+    if (res < 0)
+        goto exit;
+
+    LOG_D ("bypass connect %d", fd);
+
+    return fd;
+
+exit:
+    close (fd);
+    return -1;
+}
@@ -0,0 +1,41 @@
+/*
+ ============================================================================
+ Name        : hev-bypass.h
+ Author      : hev <r@hev.cc>
+ Copyright   : Copyright (c) 2025 hev
+ Description : Bypass
+ ============================================================================
+ */
+
+#ifndef __HEV_BYPASS_H__
+#define __HEV_BYPASS_H__
+
+#include <lwip/ip_addr.h>
+
+#include <hev-task-io.h>
+
+int hev_bypass_init (void);
+void hev_bypass_fini (void);
+
+/*
+ * Longest prefix match of @addr against the rule table. Returns 1 if the
+ * flow goes straight to the destination, 0 if it goes through socks5.
+ * Called from the tunnel thread only.
+ */
+int hev_bypass_match (const ip_addr_t *addr);
+
+/*
+ * Compile @rules into a new table and publish it. The tunnel thread swaps
+ * it in on the next match and frees the old one there, so this is safe to
+ * call from any thread. Returns -1 if a rule is invalid.
+ */
+int hev_bypass_set_rules (const char **rules, int count);
+
+/*
+ * Connect a socket of @type, bound with the bypass mark, to @addr:@port.
+ * The returned socket is not registered with any task.
+ */
+int hev_bypass_connect (const ip_addr_t *addr, u16_t port, int type,
+                        HevTaskIOYielder yielder, void *yielder_data);
+
+#endif /* __HEV_BYPASS_H__ */
@@ -15,7 +15,9 @@
 #define MICRO_VERSION (0)
 
 static const int UDP_BUF_SIZE = 1500;
-static const int UDP_POOL_SIZE = 512;
+static const int UDP_HDR_SIZE = 262;
 static const int TASK_STACK_SIZE = 20480;
+#define SOCKS5_SERVERS_MAX (16)
+#define BYPASS_RULES_MAX (256)
 
 #endif /* __HEV_CONFIG_CONST_H__ */
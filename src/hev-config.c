@@ -28,13 +28,33 @@ static char tun_ipv6_address[64];
 static char tun_post_up_script[1024];
 static char tun_pre_down_script[1024];
 
-static HevConfigServer srv;
+static HevConfigServer srvs[SOCKS5_SERVERS_MAX];
+static char srv_users[SOCKS5_SERVERS_MAX][256];
+static char srv_passes[SOCKS5_SERVERS_MAX][256];
+static int srv_count;
+static int srv_balance;
 
 static int mapdns_address;
 static int mapdns_port;
 static int mapdns_network;
 static int mapdns_netmask;
 static int mapdns_cache_size;
+static int mapdns_ttl;
+static unsigned char mapdns_address6[16];
+static unsigned char mapdns_network6[16];
+static int mapdns_address6_set;
+static int mapdns_network6_set;
+static char mapdns_cache_file[1024];
+static char mapdns_rules_file[1024];
+static char mapdns_hash_key[256];
+static int mapdns_mode;
+static char mapdns_forward_address[256];
+static int mapdns_forward_port;
+static int mapdns_forward_cache_size;
+
+static char bypass_rules[BYPASS_RULES_MAX][64];
+static int bypass_rule_count;
+static unsigned int bypass_mark;
 
 static char log_file[1024];
 static char pid_file[1024];
@@ -42,8 +62,19 @@ static int max_session_count;
 static int task_stack_size;
 static int tcp_buffer_size;
 static int udp_recv_buffer_size;
+static int udp_buffer_size;
 static int udp_copy_buffer_nums;
+static int udp_session_queue_size;
+static int udp_total_queue_size;
+static int udp_queue_target_delay;
 static int connect_timeout;
+static int tcp_syn_connect;
+static int negative_cache_ttl;
+static unsigned int session_rate;
+static unsigned int session_burst;
+static unsigned int session_source_rate;
+static unsigned int session_source_burst;
+static int session_limit_action;
 static int tcp_read_write_timeout;
 static int udp_read_write_timeout;
 static int limit_nofile;
@@ -171,20 +202,26 @@ hev_config_parse_tunnel (yaml_document_t *doc, yaml_node_t *base)
 }
 
 static int
-hev_config_parse_socks5 (yaml_document_t *doc, yaml_node_t *base)
+hev_config_parse_server (yaml_document_t *doc, yaml_node_t *base, int index)
 {
+    HevConfigServer *srv = &srvs[index];
     yaml_node_pair_t *pair;
-    static char _user[256];
-    static char _pass[256];
     const char *addr = NULL;
     const char *port = NULL;
+    const char *attl = NULL;
+    const char *hint = NULL;
+    const char *hfal = NULL;
     const char *udpm = NULL;
     const char *udpa = NULL;
+    const char *udps = NULL;
+    const char *udpp = NULL;
+    const char *tcpp = NULL;
     const char *user = NULL;
     const char *pass = NULL;
     const char *mark = NULL;
     const char *pipe = NULL;
     const char *tfso = NULL;
+    const char *optd = NULL;
 
     if (!base || YAML_MAPPING_NODE != base->type)
         return -1;
@@ -204,17 +241,29 @@ hev_config_parse_socks5 (yaml_document_t *doc, yaml_node_t *base)
 
         node = yaml_document_get_node (doc, pair->value);
         if (!node || YAML_SCALAR_NODE != node->type)
-            break;
+            continue;
         value = (const char *)node->data.scalar.value;
 
         if (0 == strcmp (key, "port"))
             port = value;
         else if (0 == strcmp (key, "address"))
             addr = value;
+        else if (0 == strcmp (key, "address-ttl"))
+            attl = value;
+        else if (0 == strcmp (key, "health-check-interval"))
+            hint = value;
+        else if (0 == strcmp (key, "health-check-failures"))
+            hfal = value;
         else if (0 == strcmp (key, "udp"))
             udpm = value;
         else if (0 == strcmp (key, "udp-address"))
             udpa = value;
+        else if (0 == strcmp (key, "udp-shared"))
+            udps = value;
+        else if (0 == strcmp (key, "udp-pool-size"))
+            udpp = value;
+        else if (0 == strcmp (key, "tcp-pool-size"))
+            tcpp = value;
         else if (0 == strcmp (key, "pipeline"))
             pipe = value;
         else if (0 == strcmp (key, "username"))
@@ -225,6 +274,8 @@ hev_config_parse_socks5 (yaml_document_t *doc, yaml_node_t *base)
             mark = value;
         else if (0 == strcmp (key, "tcp-fastopen"))
             tfso = value;
+        else if (0 == strcmp (key, "optimistic-data"))
+            optd = value;
     }
 
     if (!port) {
@@ -242,30 +293,140 @@ hev_config_parse_socks5 (yaml_document_t *doc, yaml_node_t *base)
         return -1;
     }
 
-    strncpy (srv.addr, addr, 256 - 1);
-    srv.port = strtoul (port, NULL, 10);
+    strncpy (srv->addr, addr, 256 - 1);
+    srv->port = strtoul (port, NULL, 10);
+
+    srv->addr_ttl = 300;
+    if (attl)
+        srv->addr_ttl = strtoul (attl, NULL, 10);
+
+    if (hint)
+        srv->health_interval = strtoul (hint, NULL, 10);
+
+    srv->health_failures = 3;
+    if (hfal)
+        srv->health_failures = strtoul (hfal, NULL, 10);
+    if (!srv->health_failures)
+        srv->health_failures = 1;
 
     if (pipe && (strcasecmp (pipe, "true") == 0))
-        srv.pipeline = 1;
+        srv->pipeline = 1;
 
     if (udpm && (strcasecmp (udpm, "udp") == 0))
-        srv.udp_in_udp = 1;
+        srv->udp_in_udp = 1;
 
     if (udpa)
-        strncpy (srv.udp_addr, udpa, 256 - 1);
+        strncpy (srv->udp_addr, udpa, 256 - 1);
+
+    if (udps && (strcasecmp (udps, "true") == 0))
+        srv->udp_shared = 1;
+
+    if (udpp)
+        srv->udp_pool = strtoul (udpp, NULL, 10);
+
+    if (tcpp)
+        srv->tcp_pool = strtoul (tcpp, NULL, 10);
 
     if (user && pass) {
-        strncpy (_user, user, 256 - 1);
-        strncpy (_pass, pass, 256 - 1);
-        srv.user = _user;
-        srv.pass = _pass;
+        strncpy (srv_users[index], user, 256 - 1);
+        strncpy (srv_passes[index], pass, 256 - 1);
+        srv->user = srv_users[index];
+        srv->pass = srv_passes[index];
     }
 
     if (mark)
-        srv.mark = strtoul (mark, NULL, 0);
+        srv->mark = strtoul (mark, NULL, 0);
 
     if (tfso)
-        srv.fastopen = (0 == strcasecmp (tfso, "true")) ? 1 : 0;
+        srv->fastopen = (0 == strcasecmp (tfso, "true")) ? 1 : 0;
+
+    if (optd && (strcasecmp (optd, "true") == 0))
+        srv->optimistic = 1;
+
+    return 0;
+}
+
+static int
+hev_config_parse_socks5 (yaml_document_t *doc, yaml_node_t *base)
+{
+    yaml_node_pair_t *pair;
+    yaml_node_t *servers = NULL;
+    const char *addr = NULL;
+    const char *bal = NULL;
+    yaml_node_item_t *item;
+
+    if (!base || YAML_MAPPING_NODE != base->type)
+        return -1;
+
+    for (pair = base->data.mapping.pairs.start;
+         pair < base->data.mapping.pairs.top; pair++) {
+        yaml_node_t *node;
+        const char *key, *value;
+
+        if (!pair->key || !pair->value)
+            break;
+
+        node = yaml_document_get_node (doc, pair->key);
+        if (!node || YAML_SCALAR_NODE != node->type)
+            break;
+        key = (const char *)node->data.scalar.value;
+
+        node = yaml_document_get_node (doc, pair->value);
+        if (node && (0 == strcmp (key, "servers"))) {
+            servers = node;
+            continue;
+        }
+
+        if (!node || YAML_SCALAR_NODE != node->type)
+            break;
+        value = (const char *)node->data.scalar.value;
+
+        if (0 == strcmp (key, "address"))
+            addr = value;
+        else if (0 == strcmp (key, "balance"))
+            bal = value;
+    }
+
+    /* The socks5 section itself is the first server unless only a list. */
+    if (addr || !servers) {
+        if (hev_config_parse_server (doc, base, srv_count) < 0)
+            return -1;
+        srv_count++;
+    }
+
+    if (servers) {
+        if (YAML_SEQUENCE_NODE != servers->type) {
+            fprintf (stderr, "Invalid socks5.servers!\n");
+            return -1;
+        }
+
+        for (item = servers->data.sequence.items.start;
+             item < servers->data.sequence.items.top; item++) {
+            yaml_node_t *node = yaml_document_get_node (doc, *item);
+
+            if (srv_count >= SOCKS5_SERVERS_MAX) {
+                fprintf (stderr, "Too many socks5 servers!\n");
+                return -1;
+            }
+
+            if (hev_config_parse_server (doc, node, srv_count) < 0)
+                return -1;
+            srv_count++;
+        }
+    }
+
+    if (!bal || (0 == strcmp (bal, "round-robin")))
+        srv_balance = HEV_CONFIG_BALANCE_ROUND_ROBIN;
+    else if (0 == strcmp (bal, "least-sessions"))
+        srv_balance = HEV_CONFIG_BALANCE_LEAST_SESSIONS;
+    else if (0 == strcmp (bal, "latency"))
+        srv_balance = HEV_CONFIG_BALANCE_LATENCY;
+    else if (0 == strcmp (bal, "flow-hash"))
+        srv_balance = HEV_CONFIG_BALANCE_FLOW_HASH;
+    else {
+        fprintf (stderr, "Invalid socks5.balance: %s!\n", bal);
+        return -1;
+    }
 
     return 0;
 }
@@ -274,6 +435,7 @@ static int
 hev_config_parse_mapdns (yaml_document_t *doc, yaml_node_t *base)
 {
     yaml_node_pair_t *pair;
+    const char *mode = NULL;
 
     if (!base || YAML_MAPPING_NODE != base->type)
         return -1;
@@ -306,6 +468,37 @@ hev_config_parse_mapdns (yaml_document_t *doc, yaml_node_t *base)
             inet_pton (AF_INET, value, &mapdns_netmask);
         else if (0 == strcmp (key, "cache-size"))
             mapdns_cache_size = strtoul (value, NULL, 10);
+        else if (0 == strcmp (key, "ttl"))
+            mapdns_ttl = strtoul (value, NULL, 10);
+        else if (0 == strcmp (key, "cache-file"))
+            strncpy (mapdns_cache_file, value, 1024 - 1);
+        else if (0 == strcmp (key, "rules-file"))
+            strncpy (mapdns_rules_file, value, 1024 - 1);
+        else if (0 == strcmp (key, "address6"))
+            mapdns_address6_set =
+                inet_pton (AF_INET6, value, mapdns_address6) == 1;
+        else if (0 == strcmp (key, "network6"))
+            mapdns_network6_set =
+                inet_pton (AF_INET6, value, mapdns_network6) == 1;
+        else if (0 == strcmp (key, "mode"))
+            mode = value;
+        else if (0 == strcmp (key, "hash-key"))
+            strncpy (mapdns_hash_key, value, 256 - 1);
+        else if (0 == strcmp (key, "forward-address"))
+            strncpy (mapdns_forward_address, value, 256 - 1);
+        else if (0 == strcmp (key, "forward-port"))
+            mapdns_forward_port = strtoul (value, NULL, 10);
+        else if (0 == strcmp (key, "forward-cache-size"))
+            mapdns_forward_cache_size = strtoul (value, NULL, 10);
+    }
+
+    if (!mode || (0 == strcmp (mode, "sequential")))
+        mapdns_mode = HEV_CONFIG_MAPDNS_MODE_SEQUENTIAL;
+    else if (0 == strcmp (mode, "hash"))
+        mapdns_mode = HEV_CONFIG_MAPDNS_MODE_HASH;
+    else {
+        fprintf (stderr, "Invalid mapdns.mode: %s!\n", mode);
+        return -1;
     }
 
     mapdns_network = ntohl (mapdns_network);
@@ -314,6 +507,68 @@ hev_config_parse_mapdns (yaml_document_t *doc, yaml_node_t *base)
     return 0;
 }
 
+static int
+hev_config_parse_bypass (yaml_document_t *doc, yaml_node_t *base)
+{
+    yaml_node_pair_t *pair;
+    yaml_node_item_t *item;
+
+    if (!base || YAML_MAPPING_NODE != base->type)
+        return -1;
+
+    for (pair = base->data.mapping.pairs.start;
+         pair < base->data.mapping.pairs.top; pair++) {
+        yaml_node_t *node;
+        const char *key, *value;
+
+        if (!pair->key || !pair->value)
+            break;
+
+        node = yaml_document_get_node (doc, pair->key);
+        if (!node || YAML_SCALAR_NODE != node->type)
+            break;
+        key = (const char *)node->data.scalar.value;
+
+        node = yaml_document_get_node (doc, pair->value);
+        if (!node)
+            break;
+
+        if (0 == strcmp (key, "rules")) {
+            if (YAML_SEQUENCE_NODE != node->type) {
+                fprintf (stderr, "Invalid bypass.rules!\n");
+                return -1;
+            }
+
+            for (item = node->data.sequence.items.start;
+                 item < node->data.sequence.items.top; item++) {
+                yaml_node_t *rule = yaml_document_get_node (doc, *item);
+                char *dst;
+
+                if (!rule || YAML_SCALAR_NODE != rule->type)
+                    continue;
+
+                if (bypass_rule_count >= BYPASS_RULES_MAX) {
+                    fprintf (stderr, "Too many bypass rules!\n");
+                    return -1;
+                }
+
+                dst = bypass_rules[bypass_rule_count++];
+                strncpy (dst, (const char *)rule->data.scalar.value, 64 - 1);
+            }
+            continue;
+        }
+
+        if (YAML_SCALAR_NODE != node->type)
+            break;
+        value = (const char *)node->data.scalar.value;
+
+        if (0 == strcmp (key, "mark"))
+            bypass_mark = strtoul (value, NULL, 0);
+    }
+
+    return 0;
+}
+
 static int
 hev_config_parse_log_level (const char *value)
 {
@@ -334,6 +589,8 @@ hev_config_parse_misc (yaml_document_t *doc, yaml_node_t *base)
     int tcp_rw_timeout = -1;
     int udp_rw_timeout = -1;
     int rw_timeout = -1;
+    const char *syn = NULL;
+    const char *act = NULL;
 
     if (!base || YAML_MAPPING_NODE != base->type)
         return -1;
@@ -364,10 +621,30 @@ hev_config_parse_misc (yaml_document_t *doc, yaml_node_t *base)
             udp_recv_buffer_size = strtoul (value, NULL, 10);
         else if (0 == strcmp (key, "udp-copy-buffer-nums"))
             udp_copy_buffer_nums = strtoul (value, NULL, 10);
+        else if (0 == strcmp (key, "udp-session-queue-size"))
+            udp_session_queue_size = strtoul (value, NULL, 10);
+        else if (0 == strcmp (key, "udp-total-queue-size"))
+            udp_total_queue_size = strtoul (value, NULL, 10);
+        else if (0 == strcmp (key, "udp-queue-target-delay"))
+            udp_queue_target_delay = strtoul (value, NULL, 10);
         else if (0 == strcmp (key, "max-session-count"))
             max_session_count = strtoul (value, NULL, 10);
         else if (0 == strcmp (key, "connect-timeout"))
             connect_timeout = strtoul (value, NULL, 10);
+        else if (0 == strcmp (key, "tcp-syn-connect"))
+            syn = value;
+        else if (0 == strcmp (key, "negative-cache-ttl"))
+            negative_cache_ttl = strtoul (value, NULL, 10);
+        else if (0 == strcmp (key, "session-rate"))
+            session_rate = strtoul (value, NULL, 10);
+        else if (0 == strcmp (key, "session-burst"))
+            session_burst = strtoul (value, NULL, 10);
+        else if (0 == strcmp (key, "session-source-rate"))
+            session_source_rate = strtoul (value, NULL, 10);
+        else if (0 == strcmp (key, "session-source-burst"))
+            session_source_burst = strtoul (value, NULL, 10);
+        else if (0 == strcmp (key, "session-limit-action"))
+            act = value;
         else if (0 == strcmp (key, "read-write-timeout"))
             rw_timeout = strtoul (value, NULL, 10);
         else if (0 == strcmp (key, "tcp-read-write-timeout"))
@@ -394,6 +671,28 @@ hev_config_parse_misc (yaml_document_t *doc, yaml_node_t *base)
     if (udp_rw_timeout > 0)
         udp_read_write_timeout = udp_rw_timeout;
 
+    if (!syn || (strcasecmp (syn, "false") == 0)) {
+        tcp_syn_connect = HEV_CONFIG_TCP_SYN_CONNECT_OFF;
+    } else if (strcasecmp (syn, "true") == 0) {
+        tcp_syn_connect = HEV_CONFIG_TCP_SYN_CONNECT_ON;
+    } else if (strcasecmp (syn, "hold") == 0) {
+        tcp_syn_connect = HEV_CONFIG_TCP_SYN_CONNECT_HOLD;
+    } else {
+        fprintf (stderr, "Invalid misc.tcp-syn-connect: %s!\n", syn);
+        return -1;
+    }
+
+    if (!act || (strcasecmp (act, "rst") == 0)) {
+        session_limit_action = HEV_CONFIG_ADMISSION_ACTION_RST;
+    } else if (strcasecmp (act, "icmp") == 0) {
+        session_limit_action = HEV_CONFIG_ADMISSION_ACTION_ICMP;
+    } else if (strcasecmp (act, "drop") == 0) {
+        session_limit_action = HEV_CONFIG_ADMISSION_ACTION_DROP;
+    } else {
+        fprintf (stderr, "Invalid misc.session-limit-action: %s!\n", act);
+        return -1;
+    }
+
     return 0;
 }
 
@@ -403,7 +702,6 @@ hev_config_parse_doc (yaml_document_t *doc)
     yaml_node_t *root;
     yaml_node_pair_t *pair;
     int min_task_stack_size;
-    int udp_buffer_size;
 
     root = yaml_document_get_root_node (doc);
     if (!root || YAML_MAPPING_NODE != root->type)
@@ -431,6 +729,8 @@ hev_config_parse_doc (yaml_document_t *doc)
             res = hev_config_parse_socks5 (doc, node);
         else if (0 == strcmp (key, "mapdns"))
             res = hev_config_parse_mapdns (doc, node);
+        else if (0 == strcmp (key, "bypass"))
+            res = hev_config_parse_bypass (doc, node);
         else if (0 == strcmp (key, "misc"))
             res = hev_config_parse_misc (doc, node);
 
@@ -438,15 +738,24 @@ hev_config_parse_doc (yaml_document_t *doc)
             return -1;
     }
 
+    if (!srv_count) {
+        fprintf (stderr, "Can't found socks5 server!\n");
+        return -1;
+    }
+
+    if (!bypass_mark)
+        bypass_mark = srvs[0].mark;
+
     if (tcp_buffer_size > TCP_SND_BUF)
         tcp_buffer_size = TCP_SND_BUF;
 
-    udp_buffer_size = UDP_BUF_SIZE * udp_copy_buffer_nums;
+    udp_buffer_size = tun_mtu + UDP_HDR_SIZE;
+    if (udp_buffer_size < UDP_BUF_SIZE)
+        udp_buffer_size = UDP_BUF_SIZE;
+    else if (udp_buffer_size > 65535)
+        udp_buffer_size = 65535;
 
-    if (tcp_buffer_size > udp_buffer_size)
-        min_task_stack_size = TASK_STACK_SIZE + tcp_buffer_size;
-    else
-        min_task_stack_size = TASK_STACK_SIZE + udp_buffer_size;
+    min_task_stack_size = TASK_STACK_SIZE + tcp_buffer_size;
 
     if (task_stack_size < min_task_stack_size)
         task_stack_size = min_task_stack_size;
@@ -464,7 +773,9 @@ hev_config_reset (void)
     memset (tun_name, 0, sizeof (tun_name));
     memset (log_file, 0, sizeof (log_file));
     memset (pid_file, 0, sizeof (pid_file));
-    memset (&srv, 0, sizeof (srv));
+    memset (srvs, 0, sizeof (srvs));
+    srv_count = 0;
+    srv_balance = HEV_CONFIG_BALANCE_ROUND_ROBIN;
 
     tun_mtu = 8500;
     multi_queue = 0;
@@ -475,13 +786,37 @@ hev_config_reset (void)
     mapdns_network = 0;
     mapdns_netmask = 0;
     mapdns_cache_size = 0;
+    mapdns_ttl = 1;
+    mapdns_address6_set = 0;
+    mapdns_network6_set = 0;
+    memset (mapdns_cache_file, 0, sizeof (mapdns_cache_file));
+    memset (mapdns_rules_file, 0, sizeof (mapdns_rules_file));
+    memset (mapdns_hash_key, 0, sizeof (mapdns_hash_key));
+    mapdns_mode = HEV_CONFIG_MAPDNS_MODE_SEQUENTIAL;
+    memset (mapdns_forward_address, 0, sizeof (mapdns_forward_address));
+    mapdns_forward_port = 53;
+    mapdns_forward_cache_size = 1024;
+
+    memset (bypass_rules, 0, sizeof (bypass_rules));
+    bypass_rule_count = 0;
+    bypass_mark = 0;
 
     max_session_count = 0;
     task_stack_size = 86016;
     tcp_buffer_size = 65536;
     udp_recv_buffer_size = 524288;
     udp_copy_buffer_nums = 10;
+    udp_session_queue_size = 262144;
+    udp_total_queue_size = 16777216;
+    udp_queue_target_delay = 0;
     connect_timeout = 10000;
+    tcp_syn_connect = HEV_CONFIG_TCP_SYN_CONNECT_OFF;
+    negative_cache_ttl = 0;
+    session_rate = 0;
+    session_burst = 0;
+    session_source_rate = 0;
+    session_source_burst = 0;
+    session_limit_action = HEV_CONFIG_ADMISSION_ACTION_RST;
     tcp_read_write_timeout = 300000;
     udp_read_write_timeout = 60000;
     limit_nofile = 65535;
@@ -616,9 +951,16 @@ hev_config_get_tunnel_pre_down_script (void)
 }
 
 HevConfigServer *
-hev_config_get_socks5_server (void)
+hev_config_get_socks5_servers (int *count)
+{
+    *count = srv_count;
+    return srvs;
+}
+
+int
+hev_config_get_socks5_balance (void)
 {
-    return &srv;
+    return srv_balance;
 }
 
 int
@@ -651,6 +993,99 @@ hev_config_get_mapdns_cache_size (void)
     return mapdns_cache_size;
 }
 
+int
+hev_config_get_mapdns_ttl (void)
+{
+    return mapdns_ttl;
+}
+
+const char *
+hev_config_get_mapdns_cache_file (void)
+{
+    if (!mapdns_cache_file[0])
+        return NULL;
+
+    return mapdns_cache_file;
+}
+
+const char *
+hev_config_get_mapdns_rules_file (void)
+{
+    if (!mapdns_rules_file[0])
+        return NULL;
+
+    return mapdns_rules_file;
+}
+
+const unsigned char *
+hev_config_get_mapdns_address6 (void)
+{
+    if (!mapdns_address6_set)
+        return NULL;
+
+    return mapdns_address6;
+}
+
+const unsigned char *
+hev_config_get_mapdns_network6 (void)
+{
+    if (!mapdns_network6_set)
+        return NULL;
+
+    return mapdns_network6;
+}
+
+int
+hev_config_get_mapdns_mode (void)
+{
+    return mapdns_mode;
+}
+
+const char *
+hev_config_get_mapdns_hash_key (void)
+{
+    return mapdns_hash_key;
+}
+
+const char *
+hev_config_get_mapdns_forward_address (void)
+{
+    if (!mapdns_forward_address[0])
+        return NULL;
+
+    return mapdns_forward_address;
+}
+
+int
+hev_config_get_mapdns_forward_port (void)
+{
+    return mapdns_forward_port;
+}
+
+int
+hev_config_get_mapdns_forward_cache_size (void)
+{
+    return mapdns_forward_cache_size;
+}
+
+int
+hev_config_get_bypass_rule_count (void)
+{
+    return bypass_rule_count;
+}
+
+const char *
+hev_config_get_bypass_rule (int index)
+{
+    return bypass_rules[index];
+}
+
+unsigned int
+hev_config_get_bypass_mark (void)
+{
+    return bypass_mark;
+}
+
 int
 hev_config_get_misc_task_stack_size (void)
 {
@@ -669,12 +1104,36 @@ hev_config_get_misc_udp_recv_buffer_size (void)
     return udp_recv_buffer_size;
 }
 
+int
+hev_config_get_misc_udp_buffer_size (void)
+{
+    return udp_buffer_size;
+}
+
 int
 hev_config_get_misc_udp_copy_buffer_nums (void)
 {
     return udp_copy_buffer_nums;
 }
 
+int
+hev_config_get_misc_udp_session_queue_size (void)
+{
+    return udp_session_queue_size;
+}
+
+int
+hev_config_get_misc_udp_total_queue_size (void)
+{
+    return udp_total_queue_size;
+}
+
+int
+hev_config_get_misc_udp_queue_target_delay (void)
+{
+    return udp_queue_target_delay;
+}
+
 int
 hev_config_get_misc_max_session_count (void)
 {
@@ -687,6 +1146,48 @@ hev_config_get_misc_connect_timeout (void)
     return connect_timeout;
 }
 
+int
+hev_config_get_misc_tcp_syn_connect (void)
+{
+    return tcp_syn_connect;
+}
+
+int
+hev_config_get_misc_negative_cache_ttl (void)
+{
+    return negative_cache_ttl;
+}
+
+unsigned int
+hev_config_get_misc_session_rate (void)
+{
+    return session_rate;
+}
+
+unsigned int
+hev_config_get_misc_session_burst (void)
+{
+    return session_burst;
+}
+
+unsigned int
+hev_config_get_misc_session_source_rate (void)
+{
+    return session_source_rate;
+}
+
+unsigned int
+hev_config_get_misc_session_source_burst (void)
+{
+    return session_source_burst;
+}
+
+int
+hev_config_get_misc_session_limit_action (void)
+{
+    return session_limit_action;
+}
+
 int
 hev_config_get_misc_tcp_read_write_timeout (void)
 {
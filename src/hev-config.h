@@ -12,15 +12,50 @@
 
 typedef struct _HevConfigServer HevConfigServer;
 
+enum
+{
+    HEV_CONFIG_BALANCE_ROUND_ROBIN,
+    HEV_CONFIG_BALANCE_LEAST_SESSIONS,
+    HEV_CONFIG_BALANCE_LATENCY,
+    HEV_CONFIG_BALANCE_FLOW_HASH,
+};
+
+enum
+{
+    HEV_CONFIG_TCP_SYN_CONNECT_OFF,
+    HEV_CONFIG_TCP_SYN_CONNECT_ON,
+    HEV_CONFIG_TCP_SYN_CONNECT_HOLD,
+};
+
+enum
+{
+    HEV_CONFIG_ADMISSION_ACTION_RST,
+    HEV_CONFIG_ADMISSION_ACTION_ICMP,
+    HEV_CONFIG_ADMISSION_ACTION_DROP,
+};
+
+enum
+{
+    HEV_CONFIG_MAPDNS_MODE_SEQUENTIAL,
+    HEV_CONFIG_MAPDNS_MODE_HASH,
+};
+
 struct _HevConfigServer
 {
     const char *user;
     const char *pass;
     unsigned int mark;
+    unsigned int addr_ttl;
+    unsigned int health_interval;
+    unsigned int health_failures;
     short udp_in_udp;
     unsigned short port;
+    unsigned short udp_pool;
+    unsigned short tcp_pool;
     unsigned char pipeline;
     unsigned char fastopen;
+    unsigned char optimistic;
+    unsigned char udp_shared;
     char udp_addr[256];
     char addr[256];
 };
@@ -40,20 +75,46 @@ const char *hev_config_get_tunnel_ipv6_address (void);
 const char *hev_config_get_tunnel_post_up_script (void);
 const char *hev_config_get_tunnel_pre_down_script (void);
 
-HevConfigServer *hev_config_get_socks5_server (void);
+HevConfigServer *hev_config_get_socks5_servers (int *count);
+int hev_config_get_socks5_balance (void);
 
 int hev_config_get_mapdns_address (void);
 int hev_config_get_mapdns_port (void);
 int hev_config_get_mapdns_network (void);
 int hev_config_get_mapdns_netmask (void);
 int hev_config_get_mapdns_cache_size (void);
+int hev_config_get_mapdns_ttl (void);
+const char *hev_config_get_mapdns_cache_file (void);
+const char *hev_config_get_mapdns_rules_file (void);
+const unsigned char *hev_config_get_mapdns_address6 (void);
+const unsigned char *hev_config_get_mapdns_network6 (void);
+int hev_config_get_mapdns_mode (void);
+const char *hev_config_get_mapdns_hash_key (void);
+const char *hev_config_get_mapdns_forward_address (void);
+int hev_config_get_mapdns_forward_port (void);
+int hev_config_get_mapdns_forward_cache_size (void);
+
+int hev_config_get_bypass_rule_count (void);
+const char *hev_config_get_bypass_rule (int index);
+unsigned int hev_config_get_bypass_mark (void);
 
 int hev_config_get_misc_task_stack_size (void);
 int hev_config_get_misc_tcp_buffer_size (void);
 int hev_config_get_misc_udp_recv_buffer_size (void);
+int hev_config_get_misc_udp_buffer_size (void);
 int hev_config_get_misc_udp_copy_buffer_nums (void);
+int hev_config_get_misc_udp_session_queue_size (void);
+int hev_config_get_misc_udp_total_queue_size (void);
+int hev_config_get_misc_udp_queue_target_delay (void);
 int hev_config_get_misc_max_session_count (void);
 int hev_config_get_misc_connect_timeout (void);
+int hev_config_get_misc_tcp_syn_connect (void);
+int hev_config_get_misc_negative_cache_ttl (void);
+unsigned int hev_config_get_misc_session_rate (void);
+unsigned int hev_config_get_misc_session_burst (void);
+unsigned int hev_config_get_misc_session_source_rate (void);
+unsigned int hev_config_get_misc_session_source_burst (void);
+int hev_config_get_misc_session_limit_action (void);
 int hev_config_get_misc_tcp_read_write_timeout (void);
 int hev_config_get_misc_udp_read_write_timeout (void);
 int hev_config_get_misc_limit_nofile (void);
@@ -0,0 +1,798 @@
+/*
+ ============================================================================
+ Name        : hev-dns-forwarder.c
+ Author      : hev <r@hev.cc>
+ Copyright   : Copyright (c) 2025 hev
+ Description : DNS Forwarder
+ ============================================================================
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+
+#include <hev-list.h>
+#include <hev-task.h>
+#include <hev-task-io.h>
+#include <hev-task-mutex.h>
+#include <hev-compiler.h>
+#include <hev-socks5-misc.h>
+#include <hev-socks5-client-tcp.h>
+#include <hev-memory-allocator.h>
+
+#include "hev-utils.h"
+#include "hev-config.h"
+#include "hev-logger.h"
+#include "hev-socks5-handshake.h"
+#include "hev-socks5-upstream.h"
+
+#include "hev-dns-forwarder.h"
+
+#define HDR_SIZE (12)
+#define KEY_SIZE (255 + 4)
+#define MSG_SIZE (65535)
+#define PENDING_MAX (256)
+#define WAITERS_MAX (32)
+#define TTL_MAX (86400)
+#define TYPE_OPT (41)
+
+#define FORWARD_TIMEOUT (5000)
+#define FORWARD_CHECK_INTERVAL (1000)
+#define FORWARD_RETRY_INTERVAL (1000)
+
+typedef struct _HevDNSForwarderEntry HevDNSForwarderEntry;
+typedef struct _HevDNSForwarderWaiter HevDNSForwarderWaiter;
+
+/*
+ * One per question, keyed by its wire form with the name lowercased. An
+ * entry holds the query and its waiters while pending, then the response
+ * until the smallest TTL in it runs out.
+ */
+struct _HevDNSForwarderEntry
+{
+    HevDNSForwarderEntry *next;
+    HevDNSForwarderWaiter *waiters;
+    HevListNode list;
+
+    unsigned long long stamp;
+    unsigned long long expire;
+    unsigned int hash;
+    unsigned short id;
+    unsigned short klen;
+    int pending;
+    int nwaiters;
+    size_t sent;
+    size_t len;
+    uint8_t *data;
+    uint8_t key[];
+};
+
+/* The question is kept as asked, clients may check the case of it. */
+struct _HevDNSForwarderWaiter
+{
+    HevDNSForwarderWaiter *next;
+    HevDNSForwarderPeer peer;
+    unsigned short id;
+    uint8_t question[];
+};
+
+static int fd = -1;
+static int running;
+static HevTask *task;
+static HevSocks5Addr addr;
+static HevSocks5Upstream *upstream;
+static HevTaskMutex *mutex;
+static HevDNSForwarderHandler handler;
+static size_t reply_size;
+
+static HevDNSForwarderEntry **table;
+static unsigned int table_mask;
+static HevList cache_list;
+static HevList pending_list;
+static int cache_count;
+static int cache_size;
+static int pending_count;
+static unsigned short next_id;
+
+static uint8_t *scratch;
+static uint8_t *rbuf;
+static size_t rlen;
+
+static inline unsigned int
+read_u16 (const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static inline uint32_t
+read_u32 (const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static inline void
+write_u32 (uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+/* Length of the only question in @buf, its name must not be compressed. */
+static int
+hev_dns_forwarder_question (const uint8_t *buf, size_t len)
+{
+    size_t off = HDR_SIZE;
+
+    if ((len < HDR_SIZE) || (read_u16 (&buf[4]) != 1))
+        return -1;
+
+    while ((off < len) && buf[off]) {
+        if (buf[off] & 0xc0)
+            return -1;
+        off += 1 + buf[off];
+    }
+
+    off += 5;
+    if ((off > len) || ((off - HDR_SIZE) > KEY_SIZE))
+        return -1;
+
+    return off - HDR_SIZE;
+}
+
+static unsigned int
+hev_dns_forwarder_key (uint8_t *key, const uint8_t *question, int qlen)
+{
+    unsigned int hash = 2166136261u;
+    int i;
+
+    /* Length bytes never fall in 'A'..'Z', type and class are left alone. */
+    for (i = 0; i < qlen; i++) {
+        uint8_t c = question[i];
+
+        if ((i < (qlen - 4)) && (c >= 'A') && (c <= 'Z'))
+            c += 'a' - 'A';
+
+        key[i] = c;
+        hash ^= c;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static size_t
+hev_dns_forwarder_skip_name (const uint8_t *buf, size_t len, size_t off)
+{
+    while (off < len) {
+        uint8_t c = buf[off];
+
+        if (!c)
+            return off + 1;
+        if ((c & 0xc0) == 0xc0)
+            return off + 2;
+        if (c & 0xc0)
+            break;
+
+        off += 1 + c;
+    }
+
+    return len + 1;
+}
+
+/*
+ * Visit the TTL of every record outside the question and the OPT pseudo
+ * record: take @age seconds off it, and return the smallest one seen.
+ * Returns -1 if the message is malformed.
+ */
+static int64_t
+hev_dns_forwarder_ttls (uint8_t *buf, size_t len, unsigned int age)
+{
+    int64_t min = TTL_MAX;
+    size_t off = HDR_SIZE;
+    int count;
+    int i;
+
+    count = read_u16 (&buf[4]);
+    for (i = 0; i < count; i++) {
+        off = hev_dns_forwarder_skip_name (buf, len, off) + 4;
+        if (off > len)
+            return -1;
+    }
+
+    count = read_u16 (&buf[6]) + read_u16 (&buf[8]) + read_u16 (&buf[10]);
+    for (i = 0; i < count; i++) {
+        uint32_t ttl;
+
+        off = hev_dns_forwarder_skip_name (buf, len, off);
+        if ((off + 10) > len)
+            return -1;
+
+        if (read_u16 (&buf[off]) != TYPE_OPT) {
+            ttl = read_u32 (&buf[off + 4]);
+            if (ttl < min)
+                min = ttl;
+            if (age)
+                write_u32 (&buf[off + 4], (ttl > age) ? ttl - age : 0);
+        }
+
+        off += 10 + read_u16 (&buf[off + 8]);
+        if (off > len)
+            return -1;
+    }
+
+    return min;
+}
+
+static void
+hev_dns_forwarder_send (const HevDNSForwarderPeer *peer, unsigned short id,
+                        const uint8_t *question, int qlen,
+                        const uint8_t *msg, size_t len, unsigned int age)
+{
+    uint8_t *buf = scratch;
+
+    memcpy (buf, msg, len);
+    if (age)
+        hev_dns_forwarder_ttls (buf, len, age);
+
+    buf[0] = id >> 8;
+    buf[1] = id;
+    memcpy (&buf[HDR_SIZE], question, qlen);
+
+    if (!peer->tcp && (len > reply_size)) {
+        len = HDR_SIZE + qlen;
+        buf[2] |= 0x02;
+        memset (&buf[6], 0, 6);
+    }
+
+    handler (peer, buf, len);
+}
+
+static HevDNSForwarderEntry *
+hev_dns_forwarder_find (const uint8_t *key, int klen, unsigned int hash)
+{
+    HevDNSForwarderEntry *entry;
+
+    entry = table[hash & table_mask];
+    for (; entry; entry = entry->next) {
+        if ((entry->hash == hash) && (entry->klen == klen) &&
+            !memcmp (entry->key, key, klen))
+            return entry;
+    }
+
+    return NULL;
+}
+
+static void
+hev_dns_forwarder_free (HevDNSForwarderEntry *entry)
+{
+    HevDNSForwarderEntry **prev;
+
+    prev = &table[entry->hash & table_mask];
+    for (; *prev != entry; prev = &(*prev)->next)
+        ;
+    *prev = entry->next;
+
+    if (entry->pending) {
+        hev_list_del (&pending_list, &entry->list);
+        pending_count--;
+    } else {
+        hev_list_del (&cache_list, &entry->list);
+        cache_count--;
+    }
+
+    while (entry->waiters) {
+        HevDNSForwarderWaiter *waiter = entry->waiters;
+
+        entry->waiters = waiter->next;
+        hev_free (waiter);
+    }
+
+    hev_free (entry->data);
+    hev_free (entry);
+}
+
+static int
+hev_dns_forwarder_wait (HevDNSForwarderEntry *entry,
+                        const HevDNSForwarderPeer *peer, const uint8_t *req)
+{
+    HevDNSForwarderWaiter *waiter;
+
+    if (entry->nwaiters >= WAITERS_MAX)
+        return -1;
+
+    waiter = hev_malloc (sizeof (HevDNSForwarderWaiter) + entry->klen);
+    if (!waiter)
+        return -1;
+
+    waiter->peer = *peer;
+    waiter->id = read_u16 (req);
+    memcpy (waiter->question, &req[HDR_SIZE], entry->klen);
+
+    waiter->next = entry->waiters;
+    entry->waiters = waiter;
+    entry->nwaiters++;
+
+    return 0;
+}
+
+static HevDNSForwarderEntry *
+hev_dns_forwarder_add (const uint8_t *key, int klen, unsigned int hash,
+                       const uint8_t *req, size_t len)
+{
+    HevDNSForwarderEntry *entry;
+    unsigned int idx;
+
+    entry = hev_malloc0 (sizeof (HevDNSForwarderEntry) + klen);
+    if (!entry)
+        return NULL;
+
+    entry->data = hev_malloc (len);
+    if (!entry->data) {
+        hev_free (entry);
+        return NULL;
+    }
+
+    memcpy (entry->data, req, len);
+    entry->data[0] = next_id >> 8;
+    entry->data[1] = next_id;
+    entry->id = next_id++;
+    entry->len = len;
+    entry->klen = klen;
+    entry->hash = hash;
+    entry->pending = 1;
+    entry->stamp = get_time_msec ();
+    memcpy (entry->key, key, klen);
+
+    idx = hash & table_mask;
+    entry->next = table[idx];
+    table[idx] = entry;
+
+    hev_list_add_tail (&pending_list, &entry->list);
+    pending_count++;
+
+    return entry;
+}
+
+int
+hev_dns_forwarder_query (const HevDNSForwarderPeer *peer, const void *req,
+                         size_t len)
+{
+    HevDNSForwarderEntry *entry;
+    uint8_t key[KEY_SIZE];
+    const uint8_t *q = req;
+    unsigned long long now;
+    unsigned int hash;
+    int qlen;
+
+    if (!running)
+        return -1;
+
+    /* Standard queries only, no response or other opcode. */
+    qlen = hev_dns_forwarder_question (q, len);
+    if ((qlen < 0) || (q[2] & 0xf8))
+        return -1;
+
+    hash = hev_dns_forwarder_key (key, &q[HDR_SIZE], qlen);
+    entry = hev_dns_forwarder_find (key, qlen, hash);
+    now = get_time_msec ();
+
+    if (entry && !entry->pending) {
+        if (now < entry->expire) {
+            unsigned int age = (now - entry->stamp) / 1000;
+
+            hev_list_del (&cache_list, &entry->list);
+            hev_list_add_tail (&cache_list, &entry->list);
+
+            LOG_D ("dns forwarder hit");
+            hev_dns_forwarder_send (peer, read_u16 (q), &q[HDR_SIZE], qlen,
+                                    entry->data, entry->len, age);
+            return 0;
+        }
+
+        hev_dns_forwarder_free (entry);
+        entry = NULL;
+    }
+
+    if (!entry) {
+        if (pending_count >= PENDING_MAX)
+            return -1;
+
+        entry = hev_dns_forwarder_add (key, qlen, hash, q, len);
+        if (!entry)
+            return -1;
+
+        LOG_D ("dns forwarder miss %u", entry->id);
+        hev_task_wakeup (task);
+    }
+
+    return hev_dns_forwarder_wait (entry, peer, q);
+}
+
+static void
+hev_dns_forwarder_answer (uint8_t *msg, size_t len)
+{
+    HevDNSForwarderEntry *entry = NULL;
+    HevDNSForwarderWaiter *waiter;
+    uint8_t key[KEY_SIZE];
+    HevListNode *n;
+    unsigned int id;
+    int64_t ttl;
+    int qlen;
+
+    qlen = hev_dns_forwarder_question (msg, len);
+    if (qlen < 0)
+        return;
+
+    id = read_u16 (msg);
+    n = hev_list_first (&pending_list);
+    for (; n; n = hev_list_node_next (n)) {
+        entry = container_of (n, HevDNSForwarderEntry, list);
+        if (entry->id == id)
+            break;
+    }
+
+    if (!n)
+        return;
+
+    hev_dns_forwarder_key (key, &msg[HDR_SIZE], qlen);
+    if ((qlen != entry->klen) || memcmp (key, entry->key, qlen))
+        return;
+
+    if (mutex)
+        hev_task_mutex_lock (mutex);
+    for (waiter = entry->waiters; waiter; waiter = waiter->next)
+        hev_dns_forwarder_send (&waiter->peer, waiter->id, waiter->question,
+                                qlen, msg, len, 0);
+    if (mutex)
+        hev_task_mutex_unlock (mutex);
+
+    /* Keep answers and names that do not exist, unless truncated. */
+    ttl = hev_dns_forwarder_ttls (msg, len, 0);
+    if ((ttl <= 0) || (msg[2] & 0x02) ||
+        (((msg[3] & 0x0f) != 0) && ((msg[3] & 0x0f) != 3)) ||
+        !(read_u16 (&msg[6]) + read_u16 (&msg[8]))) {
+        hev_dns_forwarder_free (entry);
+        return;
+    }
+
+    hev_free (entry->data);
+    entry->data = hev_malloc (len);
+    if (!entry->data) {
+        hev_dns_forwarder_free (entry);
+        return;
+    }
+
+    while (entry->waiters) {
+        waiter = entry->waiters;
+        entry->waiters = waiter->next;
+        hev_free (waiter);
+    }
+
+    memcpy (entry->data, msg, len);
+    entry->len = len;
+    entry->pending = 0;
+    entry->stamp = get_time_msec ();
+    entry->expire = entry->stamp + ttl * 1000;
+
+    hev_list_del (&pending_list, &entry->list);
+    pending_count--;
+    hev_list_add_tail (&cache_list, &entry->list);
+    cache_count++;
+
+    while (cache_count > cache_size) {
+        n = hev_list_first (&cache_list);
+        hev_dns_forwarder_free (container_of (n, HevDNSForwarderEntry, list));
+    }
+}
+
+static void
+hev_dns_forwarder_expire (void)
+{
+    unsigned long long now = get_time_msec ();
+    HevListNode *n;
+
+    while ((n = hev_list_first (&pending_list))) {
+        HevDNSForwarderEntry *entry;
+
+        entry = container_of (n, HevDNSForwarderEntry, list);
+        if ((now - entry->stamp) < FORWARD_TIMEOUT)
+            break;
+
+        LOG_D ("dns forwarder timeout %u", entry->id);
+        hev_dns_forwarder_free (entry);
+    }
+}
+
+static void
+hev_dns_forwarder_close (void)
+{
+    HevListNode *n;
+
+    hev_task_del_fd (task, fd);
+    close (fd);
+    fd = -1;
+    rlen = 0;
+
+    hev_socks5_upstream_release (upstream);
+    upstream = NULL;
+
+    /* Queries in flight are asked again on the next connection. */
+    n = hev_list_first (&pending_list);
+    for (; n; n = hev_list_node_next (n)) {
+        HevDNSForwarderEntry *entry;
+
+        entry = container_of (n, HevDNSForwarderEntry, list);
+        entry->sent = 0;
+    }
+}
+
+static int
+hev_dns_forwarder_connect (void)
+{
+    HevSocks5ClientTCP *client;
+    HevSocks5UpstreamWait wait;
+    int res;
+
+    client = hev_malloc0 (sizeof (HevSocks5ClientTCP));
+    if (!client)
+        return -1;
+
+    res = hev_socks5_client_tcp_construct (client, &addr);
+    if (res < 0) {
+        hev_free (client);
+        return -1;
+    }
+
+    upstream = hev_socks5_upstream_select (0);
+    hev_socks5_upstream_wait_init (&wait, &running, NULL);
+
+    fd = hev_socks5_upstream_connect (upstream, hev_socks5_upstream_yielder,
+                                      &wait);
+    if (fd < 0) {
+        LOG_D ("dns forwarder connect");
+        goto exit;
+    }
+
+    res = hev_socks5_handshake_client (HEV_SOCKS5_CLIENT (client), fd,
+                                       upstream->srv);
+    hev_object_unref (HEV_OBJECT (client));
+    if (res < 0) {
+        LOG_D ("dns forwarder handshake");
+        hev_dns_forwarder_close ();
+        return -1;
+    }
+
+    hev_socks5_upstream_report (upstream, 1);
+    LOG_D ("dns forwarder connect %d", fd);
+
+    return 0;
+
+exit:
+    hev_object_unref (HEV_OBJECT (client));
+    hev_socks5_upstream_release (upstream);
+    upstream = NULL;
+    return -1;
+}
+
+/* Queries go out in order, each behind its 16-bit length. */
+static int
+hev_dns_forwarder_flush (void)
+{
+    HevListNode *n;
+
+    n = hev_list_first (&pending_list);
+    for (; n; n = hev_list_node_next (n)) {
+        HevDNSForwarderEntry *entry;
+
+        entry = container_of (n, HevDNSForwarderEntry, list);
+        while (entry->sent < (entry->len + 2)) {
+            uint8_t hdr[2] = { entry->len >> 8, entry->len };
+            struct iovec iov[2];
+            int iovc = 0;
+            ssize_t s;
+
+            if (entry->sent < 2) {
+                iov[iovc].iov_base = &hdr[entry->sent];
+                iov[iovc].iov_len = 2 - entry->sent;
+                iovc++;
+                iov[iovc].iov_base = entry->data;
+                iov[iovc].iov_len = entry->len;
+                iovc++;
+            } else {
+                iov[iovc].iov_base = &entry->data[entry->sent - 2];
+                iov[iovc].iov_len = entry->len + 2 - entry->sent;
+                iovc++;
+            }
+
+            s = writev (fd, iov, iovc);
+            if (s < 0) {
+                if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                    return 0;
+                return -1;
+            }
+
+            entry->sent += s;
+        }
+    }
+
+    return 0;
+}
+
+static int
+hev_dns_forwarder_recv (void)
+{
+    for (;;) {
+        size_t off = 0;
+        ssize_t s;
+
+        s = recv (fd, &rbuf[rlen], MSG_SIZE + 2 - rlen, 0);
+        if (s == 0)
+            return -1;
+        if (s < 0) {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                return 0;
+            return -1;
+        }
+
+        rlen += s;
+        while ((rlen - off) >= 2) {
+            size_t len = read_u16 (&rbuf[off]);
+
+            if ((rlen - off - 2) < len)
+                break;
+
+            hev_dns_forwarder_answer (&rbuf[off + 2], len);
+            off += 2 + len;
+        }
+
+        rlen -= off;
+        memmove (rbuf, &rbuf[off], rlen);
+    }
+}
+
+static void
+hev_dns_forwarder_task_entry (void *data)
+{
+    unsigned long long retry = 0;
+
+    LOG_D ("dns forwarder task run");
+
+    while (running) {
+        hev_dns_forwarder_expire ();
+
+        if ((fd < 0) && pending_count && (get_time_msec () >= retry)) {
+            if (hev_dns_forwarder_connect () < 0)
+                retry = get_time_msec () + FORWARD_RETRY_INTERVAL;
+            continue;
+        }
+
+        if (fd >= 0) {
+            if ((hev_dns_forwarder_flush () < 0) ||
+                (hev_dns_forwarder_recv () < 0)) {
+                LOG_D ("dns forwarder close %d", fd);
+                hev_dns_forwarder_close ();
+                continue;
+            }
+        }
+
+        hev_task_sleep (FORWARD_CHECK_INTERVAL);
+    }
+
+    if (fd >= 0)
+        hev_dns_forwarder_close ();
+}
+
+int
+hev_dns_forwarder_init (HevDNSForwarderHandler _handler, HevTaskMutex *_mutex,
+                        size_t size)
+{
+    unsigned char ip[16];
+    const char *name;
+    unsigned int slots;
+    int stack_size;
+    int port;
+
+    LOG_D ("dns forwarder init");
+
+    name = hev_config_get_mapdns_forward_address ();
+    if (!name)
+        return 0;
+
+    port = htons (hev_config_get_mapdns_forward_port ());
+    if (inet_pton (AF_INET, name, ip) == 1)
+        hev_socks5_addr_from_ipv4 (&addr, ip, port);
+    else if (inet_pton (AF_INET6, name, ip) == 1)
+        hev_socks5_addr_from_ipv6 (&addr, ip, port);
+    else
+        hev_socks5_addr_from_name (&addr, name, port);
+
+    handler = _handler;
+    mutex = _mutex;
+    reply_size = size;
+    cache_size = hev_config_get_mapdns_forward_cache_size ();
+
+    slots = 1;
+    while (slots < (cache_size + PENDING_MAX))
+        slots <<= 1;
+    table_mask = slots - 1;
+
+    table = hev_calloc (slots, sizeof (HevDNSForwarderEntry *));
+    scratch = hev_malloc (MSG_SIZE);
+    rbuf = hev_malloc (MSG_SIZE + 2);
+    if (!table || !scratch || !rbuf) {
+        LOG_E ("dns forwarder buffers");
+        goto exit;
+    }
+
+    stack_size = hev_config_get_misc_task_stack_size ();
+    task = hev_task_new (stack_size);
+    if (!task) {
+        LOG_E ("dns forwarder task");
+        goto exit;
+    }
+
+    return 0;
+
+exit:
+    hev_dns_forwarder_fini ();
+    return -1;
+}
+
+void
+hev_dns_forwarder_fini (void)
+{
+    HevListNode *n;
+
+    LOG_D ("dns forwarder fini");
+
+    if (task) {
+        hev_task_unref (task);
+        task = NULL;
+    }
+
+    while ((n = hev_list_first (&pending_list)))
+        hev_dns_forwarder_free (container_of (n, HevDNSForwarderEntry, list));
+    while ((n = hev_list_first (&cache_list)))
+        hev_dns_forwarder_free (container_of (n, HevDNSForwarderEntry, list));
+
+    if (table) {
+        hev_free (table);
+        table = NULL;
+    }
+    if (scratch) {
+        hev_free (scratch);
+        scratch = NULL;
+    }
+    if (rbuf) {
+        hev_free (rbuf);
+        rbuf = NULL;
+    }
+}
+
+void
+hev_dns_forwarder_run (void)
+{
+    if (!task)
+        return;
+
+    running = 1;
+    task = hev_task_ref (task);
+    hev_task_run (task, hev_dns_forwarder_task_entry, NULL);
+}
+
+void
+hev_dns_forwarder_stop (void)
+{
+    if (!task || !running)
+        return;
+
+    running = 0;
+    hev_task_wakeup (task);
+    hev_task_join (task);
+}
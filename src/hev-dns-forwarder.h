@@ -0,0 +1,52 @@
+/*
+ ============================================================================
+ Name        : hev-dns-forwarder.h
+ Author      : hev <r@hev.cc>
+ Copyright   : Copyright (c) 2025 hev
+ Description : DNS Forwarder
+ ============================================================================
+ */
+
+#ifndef __HEV_DNS_FORWARDER_H__
+#define __HEV_DNS_FORWARDER_H__
+
+#include <stddef.h>
+
+#include <hev-task-mutex.h>
+
+typedef struct _HevDNSForwarderPeer HevDNSForwarderPeer;
+typedef void (*HevDNSForwarderHandler) (const HevDNSForwarderPeer *peer,
+                                        void *buf, size_t len);
+
+/* Endpoints of a query as seen on the TUN, in network byte order. */
+struct _HevDNSForwarderPeer
+{
+    unsigned char saddr[16];
+    unsigned char daddr[16];
+    unsigned short sport;
+    unsigned short dport;
+    unsigned char ipv6;
+    unsigned char tcp;
+};
+
+/*
+ * @handler sends a response back to @peer, @size is the largest one it can
+ * carry over UDP. Longer responses are cut down to the question with TC
+ * set, TCP peers get them whole. Responses from the resolver are handled
+ * with @mutex held, cached ones within hev_dns_forwarder_query.
+ */
+int hev_dns_forwarder_init (HevDNSForwarderHandler handler,
+                            HevTaskMutex *mutex, size_t size);
+void hev_dns_forwarder_fini (void);
+
+void hev_dns_forwarder_run (void);
+void hev_dns_forwarder_stop (void);
+
+/*
+ * Answer @req from the cache, join an identical query in flight, or send
+ * it to the resolver. Returns -1 if the query was not taken.
+ */
+int hev_dns_forwarder_query (const HevDNSForwarderPeer *peer, const void *req,
+                             size_t len);
+
+#endif /* __HEV_DNS_FORWARDER_H__ */
@@ -83,6 +83,103 @@ void hev_socks5_tunnel_quit (void);
 void hev_socks5_tunnel_stats (size_t *tx_packets, size_t *tx_bytes,
                               size_t *rx_packets, size_t *rx_bytes);
 
+/**
+ * hev_socks5_tunnel_udp_stats:
+ * @queued_bytes (out): bytes queued towards the socks5 server
+ * @drop_packets (out): dropped datagrams
+ * @drop_bytes (out): dropped bytes
+ *
+ * Retrieve UDP queue statistics.
+ *
+ * Since: 2.17.0
+ */
+void hev_socks5_tunnel_udp_stats (size_t *queued_bytes, size_t *drop_packets,
+                                  size_t *drop_bytes);
+
+/**
+ * hev_socks5_tunnel_udp_pool_stats:
+ * @hits (out): sessions served from the UDP associate pool
+ * @misses (out): sessions that found the pool empty
+ * @saved_msec (out): handshake time saved by pool hits (ms)
+ *
+ * Retrieve UDP associate pool statistics.
+ *
+ * Since: 2.17.0
+ */
+void hev_socks5_tunnel_udp_pool_stats (size_t *hits, size_t *misses,
+                                       size_t *saved_msec);
+
+/**
+ * hev_socks5_tunnel_upstream_stats:
+ * @index: socks5 server index, in config order
+ * @sessions (out): active sessions on the server
+ * @latency (out): smoothed connect latency (ms)
+ *
+ * Retrieve per socks5 server statistics.
+ *
+ * Returns: returns zero on successful, otherwise returns -1 if @index is out
+ * of range.
+ *
+ * Since: 2.17.0
+ */
+int hev_socks5_tunnel_upstream_stats (int index, size_t *sessions,
+                                      size_t *latency);
+
+/**
+ * hev_socks5_tunnel_negative_cache_stats:
+ * @hits (out): SYNs answered locally from the negative cache
+ * @entries (out): destinations currently cached
+ *
+ * Retrieve negative cache statistics.
+ *
+ * Since: 2.17.0
+ */
+void hev_socks5_tunnel_negative_cache_stats (size_t *hits, size_t *entries);
+
+/**
+ * hev_socks5_tunnel_admission_stats:
+ * @tcp_rejects (out): TCP flows refused by the session rate limits
+ * @udp_rejects (out): UDP flows refused by the session rate limits
+ *
+ * Retrieve session admission statistics.
+ *
+ * Since: 2.17.0
+ */
+void hev_socks5_tunnel_admission_stats (size_t *tcp_rejects,
+                                       size_t *udp_rejects);
+
+/**
+ * hev_socks5_tunnel_set_bypass:
+ * @rules: CIDR rules in the bypass.rules format
+ * @count: number of @rules
+ *
+ * Replace the bypass rule table. The new table is compiled here and
+ * takes effect for sessions created after the call, safe to call from
+ * any thread.
+ *
+ * Returns: returns zero on successful, otherwise returns -1 if a rule is
+ * invalid, and the current table is kept.
+ *
+ * Since: 2.17.0
+ */
+int hev_socks5_tunnel_set_bypass (const char **rules, int count);
+
+/**
+ * hev_socks5_tunnel_set_mapdns_rules:
+ * @rules: domain rules in the mapdns.rules-file format, one per entry
+ * @count: number of @rules, zero maps every name again
+ *
+ * Replace the rules deciding which names get mapped addresses. The new
+ * rules are compiled here and swapped in without holding up queries, safe
+ * to call from any thread.
+ *
+ * Returns: returns zero on successful, otherwise returns -1 if a rule is
+ * invalid, and the current rules are kept.
+ *
+ * Since: 2.17.0
+ */
+int hev_socks5_tunnel_set_mapdns_rules (const char **rules, int count);
+
 #ifdef __cplusplus
 }
 #endif
@@ -7,19 +7,30 @@
  ============================================================================
  */
 
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
 #include <stdint.h>
-#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <arpa/inet.h>
 
 #include <hev-compiler.h>
 #include <hev-memory-allocator.h>
 
+#include "hev-utils.h"
 #include "hev-logger.h"
+#include "hev-domain-trie.h"
 
 #include "hev-mapped-dns.h"
 
-static HevMappedDNS *singleton;
+static _Atomic (HevMappedDNS *) singleton;
+static _Atomic (HevDomainTrie *) rules;
+static atomic_int rule_readers;
+static atomic_uint rule_gen;
 
 typedef struct _DNSHdr DNSHdr;
 
@@ -33,25 +44,132 @@ struct _DNSHdr
     uint16_t ar;
 };
 
+/* A name is at most 255 bytes on the wire, one less as text. */
+#define NAME_SIZE (256)
+#define FILE_MAGIC (0x31444d48) /* "HMD1" */
+#define FNV_BASIS (2166136261u)
+/* Slots a name may take in hash mode, starting from its home slot. */
+#define PROBE_LEN (8)
+/*
+ * Shards double up to SHARDS_MAX only while each keeps at least SHARD_MIN
+ * records, so small tables use fewer shards and large ones hold many more
+ * than SHARD_MIN records per shard.
+ */
+#define SHARDS_MAX (16)
+#define SHARD_MIN (256)
+/* Arena bytes per record, a name and its header average well below. */
+#define RECORD_ARENA (64)
+/* Record index and length in front of each name in an arena. */
+#define ENTRY_HDR (5)
+/* Answer cache entries, the records one may name and its query + reply. */
+#define ANSWERS (256)
+#define ANSWER_IDX (2)
+#define ANSWER_DATA (384)
+
+enum
+{
+    TYPE_A = 1,
+    TYPE_AAAA = 28,
+};
+
+typedef struct _HevMappedDNSFileHdr HevMappedDNSFileHdr;
+
+/*
+ * Snapshot layout, host byte order: the header, then one record per name
+ * in index order, each a 32-bit index, an 8-bit length and the name
+ * without its terminator.
+ */
+struct _HevMappedDNSFileHdr
+{
+    uint32_t magic;
+    uint32_t count;
+    uint32_t max;
+    uint32_t net;
+    uint32_t mask;
+    uint32_t hashed;
+    uint32_t seed;
+};
+
+/*
+ * Records are read without a lock: a writer makes seq odd while it changes
+ * the record, a reader copies the name out and retries if seq moved. The
+ * reference bit is the only thing a reader writes, and only when clear.
+ * A record is not given up before expire, when the TTL it was last
+ * answered with runs out.
+ */
 struct _HevMappedDNSNode
 {
-    HevRBTreeNode tree;
-    HevListNode list;
-    char *name;
+    atomic_uint seq;
+    atomic_uchar ref;
+    unsigned char len;
+    unsigned int hash;
+    unsigned int off;
+    unsigned int expire;
+};
+
+/*
+ * A shard owns a fixed range of indexes, with its own lock, CLOCK hand and
+ * name index. A name's shard comes from its hash, so writers of different
+ * names rarely meet. Its names sit back to back in an arena allocated with
+ * it, each behind the index of its record, -1 once given up, and its
+ * length. A full arena is compacted in place, moved records bumping their
+ * seq, and a name that still does not fit is refused.
+ */
+struct _HevMappedDNSShard
+{
+    atomic_flag lock;
+    int base;
+    int size;
+    int use;
+    int hand;
+    unsigned int full;
+    unsigned int used;
+    unsigned int dead;
+    unsigned int slot_mask;
+    unsigned int arena_size;
+    HevMappedDNSSlot *slots;
+    char *arena;
+};
+
+/*
+ * A whole reply by the exact query bytes after the ID. It stays good while
+ * the records it names keep the seq they had and the rules are the same,
+ * a hit renews those records like a full lookup would.
+ */
+struct _HevMappedDNSAnswer
+{
+    atomic_flag lock;
+    unsigned int hash;
+    unsigned int gen;
+    unsigned short qlen;
+    unsigned short rlen;
+    int count;
+    int idx[ANSWER_IDX];
+    unsigned int seq[ANSWER_IDX];
+    uint8_t data[ANSWER_DATA];
+};
+
+/*
+ * Open addressing with linear probing. The hash sits next to the index so
+ * a probe only touches the slot array until the hashes match.
+ */
+struct _HevMappedDNSSlot
+{
+    unsigned int hash;
     int idx;
 };
 
 HevMappedDNS *
-hev_mapped_dns_new (int net, int mask, int max)
+hev_mapped_dns_new (int net, int mask, int max, const char *key)
 {
     HevMappedDNS *self;
     int res;
 
-    self = hev_malloc0 (sizeof (HevMappedDNS) + sizeof (void *) * max);
+    self = hev_malloc0 (sizeof (HevMappedDNS));
     if (!self)
         return NULL;
 
-    res = hev_mapped_dns_construct (self, net, mask, max);
+    res = hev_mapped_dns_construct (self, net, mask, max, key);
     if (res < 0) {
         hev_free (self);
         return NULL;
@@ -65,92 +183,515 @@ hev_mapped_dns_new (int net, int mask, int max)
 HevMappedDNS *
 hev_mapped_dns_get (void)
 {
-    return singleton;
+    return atomic_load_explicit (&singleton, memory_order_acquire);
 }
 
 void
 hev_mapped_dns_put (HevMappedDNS *self)
 {
-    singleton = self;
+    atomic_store_explicit (&singleton, self, memory_order_release);
 }
 
-static HevMappedDNSNode *
-hev_mapped_dns_node_alloc (const char *name)
+static unsigned int
+hev_mapped_dns_hash (unsigned int hash, const void *data, int len)
 {
-    HevMappedDNSNode *node;
+    const uint8_t *p = data;
+    int i;
 
-    node = hev_malloc0 (sizeof (HevMappedDNSNode));
-    if (!node)
-        return NULL;
+    for (i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 16777619u;
+    }
 
-    node->name = strdup (name);
-    if (!node->name) {
-        free (node);
-        return NULL;
+    return hash;
+}
+
+static inline char *
+hev_mapped_dns_name (HevMappedDNSShard *shard, HevMappedDNSNode *node)
+{
+    return &shard->arena[node->off];
+}
+
+static inline HevMappedDNSShard *
+hev_mapped_dns_shard (HevMappedDNS *self, unsigned int hash)
+{
+    /* High bits, the low ones pick the slot or home within the shard. */
+    return &self->shards[(hash >> 24) % self->nshards];
+}
+
+static inline HevMappedDNSShard *
+hev_mapped_dns_shard_of (HevMappedDNS *self, int idx)
+{
+    int s;
+
+    for (s = 0; (s + 1) < self->nshards; s++)
+        if (idx < self->shards[s + 1].base)
+            break;
+
+    return &self->shards[s];
+}
+
+static inline void
+hev_mapped_dns_lock (HevMappedDNSShard *shard)
+{
+    while (atomic_flag_test_and_set_explicit (&shard->lock,
+                                              memory_order_acquire))
+        ;
+}
+
+static inline void
+hev_mapped_dns_unlock (HevMappedDNSShard *shard)
+{
+    atomic_flag_clear_explicit (&shard->lock, memory_order_release);
+}
+
+static inline void
+hev_mapped_dns_touch (HevMappedDNSNode *node)
+{
+    if (!atomic_load_explicit (&node->ref, memory_order_relaxed))
+        atomic_store_explicit (&node->ref, 1, memory_order_relaxed);
+}
+
+static inline unsigned int
+hev_mapped_dns_now (void)
+{
+    return get_time_msec () / 1000;
+}
+
+/*
+ * When a record answered at @now may be given up. @now is floored to the
+ * second, one more keeps it for at least the whole TTL.
+ */
+static inline unsigned int
+hev_mapped_dns_expire (HevMappedDNS *self, unsigned int now)
+{
+    return now + self->ttl + 1;
+}
+
+static inline int
+hev_mapped_dns_pinned (HevMappedDNSNode *node, unsigned int now)
+{
+    return (int)(node->expire - now) > 0;
+}
+
+static void
+hev_mapped_dns_slot_del (HevMappedDNSShard *shard, unsigned int hash, int idx)
+{
+    HevMappedDNSSlot *slots = shard->slots;
+    unsigned int mask = shard->slot_mask;
+    unsigned int i, j;
+
+    for (i = hash & mask; slots[i].idx != idx; i = (i + 1) & mask)
+        ;
+
+    /* Shift the rest of the run back so no probe ever stops short. */
+    for (j = (i + 1) & mask; slots[j].idx >= 0; j = (j + 1) & mask) {
+        unsigned int k = slots[j].hash & mask;
+
+        if (((j > i) && ((k <= i) || (k > j))) ||
+            ((j < i) && ((k <= i) && (k > j)))) {
+            slots[i] = slots[j];
+            i = j;
+        }
+    }
+
+    slots[i].idx = -1;
+}
+
+static void
+hev_mapped_dns_compact (HevMappedDNS *self, HevMappedDNSShard *shard)
+{
+    unsigned int p, q = 0;
+
+    for (p = 0; p < shard->used;) {
+        char *entry = &shard->arena[p];
+        int len = (uint8_t)entry[4];
+        int idx;
+
+        memcpy (&idx, entry, 4);
+        if (idx >= 0) {
+            if (p != q) {
+                HevMappedDNSNode *node = &self->records[idx];
+                unsigned int seq;
+
+                seq = atomic_load_explicit (&node->seq, memory_order_relaxed);
+                atomic_store_explicit (&node->seq, seq + 1,
+                                       memory_order_relaxed);
+                atomic_thread_fence (memory_order_release);
+
+                memmove (&shard->arena[q], entry, ENTRY_HDR + len);
+                node->off = q + ENTRY_HDR;
+
+                atomic_store_explicit (&node->seq, seq + 2,
+                                       memory_order_release);
+            }
+            q += ENTRY_HDR + len;
+        }
+        p += ENTRY_HDR + len;
+    }
+
+    shard->used = q;
+    shard->dead = 0;
+}
+
+/* Room for @need bytes in the arena of @shard, compacting it if full. */
+static int
+hev_mapped_dns_alloc (HevMappedDNS *self, HevMappedDNSShard *shard, int need)
+{
+    int off;
+
+    if ((shard->used + need) > shard->arena_size)
+        hev_mapped_dns_compact (self, shard);
+
+    off = shard->used;
+    shard->used += need;
+
+    return off;
+}
+
+static int
+hev_mapped_dns_set (HevMappedDNS *self, HevMappedDNSShard *shard, int idx,
+                    const char *name, int len, unsigned int hash)
+{
+    HevMappedDNSNode *node = &self->records[idx];
+    unsigned int mask = shard->slot_mask;
+    unsigned int need = ENTRY_HDR + len;
+    unsigned int live;
+    unsigned int seq;
+    unsigned int i;
+    int off;
+
+    /* What stays live once the old name of the record is let go. */
+    live = shard->used - shard->dead;
+    if (node->len)
+        live -= ENTRY_HDR + node->len;
+    if ((live + need) > shard->arena_size)
+        return -1;
+
+    if (!self->hashed && node->len)
+        hev_mapped_dns_slot_del (shard, node->hash, idx);
+
+    seq = atomic_load_explicit (&node->seq, memory_order_relaxed);
+    atomic_store_explicit (&node->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence (memory_order_release);
+
+    if (node->len) {
+        static const int dead = -1;
+
+        memcpy (&shard->arena[node->off - ENTRY_HDR], &dead, 4);
+        shard->dead += ENTRY_HDR + node->len;
     }
 
-    return node;
+    off = hev_mapped_dns_alloc (self, shard, need);
+    memcpy (&shard->arena[off], &idx, 4);
+    shard->arena[off + 4] = len;
+    memcpy (&shard->arena[off + ENTRY_HDR], name, len);
+
+    node->hash = hash;
+    node->len = len;
+    node->off = off + ENTRY_HDR;
+
+    atomic_store_explicit (&node->seq, seq + 2, memory_order_release);
+    atomic_store_explicit (&node->ref, 0, memory_order_relaxed);
+
+    if (self->hashed)
+        return 0;
+
+    for (i = hash & mask; shard->slots[i].idx >= 0; i = (i + 1) & mask)
+        ;
+
+    shard->slots[i].hash = hash;
+    shard->slots[i].idx = idx;
+
+    return 0;
 }
 
 static void
-hev_mapped_dns_node_free (HevMappedDNSNode *node)
+hev_mapped_dns_clear (HevMappedDNS *self)
 {
-    free (node->name);
-    hev_free (node);
+    unsigned int i;
+    int s;
+
+    memset (self->records, 0, sizeof (HevMappedDNSNode) * self->max);
+    for (s = 0; s < self->nshards; s++) {
+        HevMappedDNSShard *shard = &self->shards[s];
+
+        for (i = 0; shard->slots && (i <= shard->slot_mask); i++)
+            shard->slots[i].idx = -1;
+        shard->use = 0;
+        shard->hand = 0;
+        shard->full = 0;
+        shard->used = 0;
+        shard->dead = 0;
+    }
+}
+
+static inline int
+hev_mapped_dns_probes (HevMappedDNSShard *shard)
+{
+    return (shard->size < PROBE_LEN) ? shard->size : PROBE_LEN;
 }
 
+/*
+ * Hash mode: a name lives within PROBE_LEN slots of its home, hash % size
+ * inside its shard. Slots are never emptied, only reused, so the first
+ * empty slot ends the search. A full window gives up a slot by second
+ * chance over the reference bits, never one that is still pinned.
+ */
 static int
-hev_mapped_dns_find (HevMappedDNS *self, const char *name)
+hev_mapped_dns_probe (HevMappedDNS *self, HevMappedDNSShard *shard,
+                      const char *name, int len, unsigned int hash,
+                      unsigned int now)
 {
-    HevRBTreeNode **new = &self->tree.root, *parent = NULL;
+    int probes = hev_mapped_dns_probes (shard);
+    int home = hash % shard->size;
     HevMappedDNSNode *node;
-    int idx = self->use;
+    int idx;
+    int i;
 
-    while (*new) {
-        int res;
+    for (i = 0; i < probes; i++) {
+        idx = shard->base + (home + i) % shard->size;
+        node = &self->records[idx];
 
-        node = container_of (*new, HevMappedDNSNode, tree);
-        res = strcmp (node->name, name);
-        parent = *new;
+        if (!node->len) {
+            if (hev_mapped_dns_set (self, shard, idx, name, len, hash) < 0)
+                return -1;
+            shard->use++;
+            return idx;
+        }
 
-        if (res < 0) {
-            new = &((*new)->left);
-        } else if (res > 0) {
-            new = &((*new)->right);
-        } else {
-            hev_list_del (&self->list, &node->list);
-            hev_list_add_tail (&self->list, &node->list);
-            return node->idx;
+        if ((node->hash == hash) && (node->len == len) &&
+            !memcmp (hev_mapped_dns_name (shard, node), name, len)) {
+            hev_mapped_dns_touch (node);
+            return idx;
         }
     }
 
-    node = hev_mapped_dns_node_alloc (name);
-    if (!node)
+    idx = -1;
+    for (i = 0; i < probes; i++) {
+        node = &self->records[shard->base + (home + i) % shard->size];
+        if (hev_mapped_dns_pinned (node, now))
+            continue;
+
+        if (!atomic_exchange_explicit (&node->ref, 0, memory_order_relaxed)) {
+            idx = node - self->records;
+            break;
+        }
+
+        if (idx < 0)
+            idx = node - self->records;
+    }
+
+    if (idx < 0)
         return -1;
 
-    hev_rbtree_node_link (&node->tree, parent, new);
-    hev_rbtree_insert_color (&self->tree, &node->tree);
-    hev_list_add_tail (&self->list, &node->list);
+    if (hev_mapped_dns_set (self, shard, idx, name, len, hash) < 0)
+        return -1;
 
-    if (self->use < self->max) {
-        self->use++;
-    } else {
-        HevMappedDNSNode *nf;
-        HevListNode *nl;
+    return idx;
+}
 
-        nl = hev_list_first (&self->list);
-        nf = container_of (nl, HevMappedDNSNode, list);
+/*
+ * Sequential mode: indexes of a shard are handed out in order, then taken
+ * back by the CLOCK hand, which skips over referenced records once and
+ * over pinned ones always. A sweep that finds them all pinned notes when
+ * the first is let go, nothing can be taken before that.
+ */
+static int
+hev_mapped_dns_insert (HevMappedDNS *self, HevMappedDNSShard *shard,
+                       const char *name, int len, unsigned int hash,
+                       unsigned int now)
+{
+    unsigned int mask = shard->slot_mask;
+    HevMappedDNSNode *node;
+    unsigned int full;
+    unsigned int i;
+    int idx;
+
+    for (i = hash & mask; shard->slots[i].idx >= 0; i = (i + 1) & mask) {
+        if (shard->slots[i].hash != hash)
+            continue;
+
+        idx = shard->slots[i].idx;
+        node = &self->records[idx];
+        if ((node->len == len) &&
+            !memcmp (hev_mapped_dns_name (shard, node), name, len)) {
+            hev_mapped_dns_touch (node);
+            return idx;
+        }
+    }
+
+    if (shard->use < shard->size) {
+        idx = shard->base + shard->use;
+        if (hev_mapped_dns_set (self, shard, idx, name, len, hash) < 0)
+            return -1;
+        shard->use++;
+        return idx;
+    }
+
+    if ((int)(shard->full - now) > 0)
+        return -1;
+
+    full = hev_mapped_dns_expire (self, now);
+    for (i = 0; i < (shard->size * 2); i++) {
+        idx = shard->base + shard->hand;
+        shard->hand = (shard->hand + 1) % shard->size;
+
+        node = &self->records[idx];
+        if (hev_mapped_dns_pinned (node, now)) {
+            if ((int)(node->expire - full) < 0)
+                full = node->expire;
+            continue;
+        }
+
+        if (!atomic_exchange_explicit (&node->ref, 0, memory_order_relaxed))
+            goto set;
+    }
+
+    shard->full = full;
+    return -1;
+
+set:
+    if (hev_mapped_dns_set (self, shard, idx, name, len, hash) < 0)
+        return -1;
+
+    return idx;
+}
+
+/*
+ * The index of @name, inserting it if needed, pinned for another TTL from
+ * @now. -1 if every record it could take is still pinned. @seq is set to
+ * the version of the record it was found as.
+ */
+static int
+hev_mapped_dns_find (HevMappedDNS *self, const char *name, int len,
+                     unsigned int now, unsigned int *seq)
+{
+    HevMappedDNSShard *shard;
+    unsigned int hash;
+    int idx;
+
+    if ((len <= 0) || (len >= NAME_SIZE))
+        return -1;
+
+    hash = hev_mapped_dns_hash (self->seed, name, len);
+    shard = hev_mapped_dns_shard (self, hash);
 
-        idx = nf->idx;
-        hev_rbtree_erase (&self->tree, &nf->tree);
-        hev_list_del (&self->list, &nf->list);
-        hev_mapped_dns_node_free (nf);
+    hev_mapped_dns_lock (shard);
+    if (self->hashed)
+        idx = hev_mapped_dns_probe (self, shard, name, len, hash, now);
+    else
+        idx = hev_mapped_dns_insert (self, shard, name, len, hash, now);
+
+    if (idx >= 0) {
+        HevMappedDNSNode *node = &self->records[idx];
+
+        node->expire = hev_mapped_dns_expire (self, now);
+        *seq = atomic_load_explicit (&node->seq, memory_order_relaxed);
     }
+    hev_mapped_dns_unlock (shard);
+
+    return idx;
+}
+
+/* Pin @idx for another TTL if it still is the record seen as @seq. */
+static int
+hev_mapped_dns_renew (HevMappedDNS *self, int idx, unsigned int seq,
+                      unsigned int now)
+{
+    HevMappedDNSShard *shard = hev_mapped_dns_shard_of (self, idx);
+    HevMappedDNSNode *node = &self->records[idx];
+    int res = -1;
+
+    hev_mapped_dns_lock (shard);
+    if (atomic_load_explicit (&node->seq, memory_order_relaxed) == seq) {
+        node->expire = hev_mapped_dns_expire (self, now);
+        hev_mapped_dns_touch (node);
+        res = 0;
+    }
+    hev_mapped_dns_unlock (shard);
+
+    return res;
+}
+
+static int
+hev_mapped_dns_answer_get (HevMappedDNS *self, const uint8_t *req, int qlen,
+                           uint8_t *res, int slen, unsigned int hash,
+                           unsigned int now)
+{
+    HevMappedDNSAnswer *answer = &self->answers[hash % ANSWERS];
+    int rlen = -1;
+    int i;
+
+    while (atomic_flag_test_and_set_explicit (&answer->lock,
+                                              memory_order_acquire))
+        ;
+
+    if ((answer->hash != hash) || (answer->qlen != qlen) ||
+        (answer->gen != atomic_load (&rule_gen)) || (answer->rlen > slen) ||
+        memcmp (&answer->data[2], &req[2], qlen - 2))
+        goto exit;
+
+    for (i = 0; i < answer->count; i++)
+        if (hev_mapped_dns_renew (self, answer->idx[i], answer->seq[i],
+                                  now) < 0)
+            goto exit;
 
-    self->records[idx] = node;
-    node->idx = idx;
+    rlen = answer->rlen;
+    memcpy (res, &answer->data[qlen], rlen);
+    memcpy (res, req, 2);
 
-    return node->idx;
+exit:
+    atomic_flag_clear_explicit (&answer->lock, memory_order_release);
+    return rlen;
+}
+
+static void
+hev_mapped_dns_answer_put (HevMappedDNS *self, const uint8_t *req, int qlen,
+                           const uint8_t *res, int rlen, unsigned int hash,
+                           const int *idx, const unsigned int *seq, int count,
+                           unsigned int gen)
+{
+    HevMappedDNSAnswer *answer = &self->answers[hash % ANSWERS];
+
+    while (atomic_flag_test_and_set_explicit (&answer->lock,
+                                              memory_order_acquire))
+        ;
+
+    answer->hash = hash;
+    answer->gen = gen;
+    answer->qlen = qlen;
+    answer->rlen = rlen;
+    answer->count = count;
+    memcpy (answer->idx, idx, sizeof (int) * count);
+    memcpy (answer->seq, seq, sizeof (unsigned int) * count);
+    memcpy (answer->data, req, qlen);
+    memcpy (&answer->data[qlen], res, rlen);
+
+    atomic_flag_clear_explicit (&answer->lock, memory_order_release);
+}
+
+/*
+ * Whether @name may get a mapped address. Readers only count themselves
+ * in, a new rule table is swapped in under them and the old one is freed
+ * once none is left walking it.
+ */
+static int
+hev_mapped_dns_wanted (const char *name, int len)
+{
+    HevDomainTrie *trie;
+    int value = -1;
+
+    if (!atomic_load_explicit (&rules, memory_order_relaxed))
+        return 1;
+
+    atomic_fetch_add (&rule_readers, 1);
+    trie = atomic_load (&rules);
+    if (trie)
+        value = hev_domain_trie_lookup (trie, name, len);
+    atomic_fetch_sub (&rule_readers, 1);
+
+    return value != 0;
 }
 
 static inline uint16_t
@@ -179,12 +720,20 @@ int
 hev_mapped_dns_handle (HevMappedDNS *self, void *req, int qlen, void *res,
                        int slen)
 {
+    uint8_t query[ANSWER_DATA];
     DNSHdr *qhdr = req;
     DNSHdr *shdr = res;
     uint8_t *rb = req;
     uint8_t *sb = res;
+    unsigned int ipq[32];
+    unsigned int hash;
+    unsigned int now;
+    unsigned int gen;
+    int failed = 0;
+    int cached;
     int ips[32];
     int ipo[32];
+    int ipt[32];
     int ipn = 0;
     int off;
     int i;
@@ -194,6 +743,18 @@ hev_mapped_dns_handle (HevMappedDNS *self, void *req, int qlen, void *res,
     if (qlen < sizeof (DNSHdr))
         return -1;
 
+    now = hev_mapped_dns_now ();
+    hash = hev_mapped_dns_hash (FNV_BASIS, &rb[2], qlen - 2);
+    off = hev_mapped_dns_answer_get (self, rb, qlen, sb, slen, hash, now);
+    if (off >= 0)
+        return off;
+
+    /* The query is taken apart below, keep it whole for the cache. */
+    gen = atomic_load (&rule_gen);
+    cached = qlen < sizeof (query);
+    if (cached)
+        memcpy (query, req, qlen);
+
     memcpy (res, req, qlen);
     qhdr->qd = ntohs (qhdr->qd);
     shdr->fl = ntohs (shdr->fl);
@@ -206,6 +767,10 @@ hev_mapped_dns_handle (HevMappedDNS *self, void *req, int qlen, void *res,
 
     off = sizeof (DNSHdr);
     for (i = 0; i < qhdr->qd; i++) {
+        char *name;
+        int type;
+        int len;
+
         ipo[ipn] = off;
 
         if (off >= qlen)
@@ -221,17 +786,25 @@ hev_mapped_dns_handle (HevMappedDNS *self, void *req, int qlen, void *res,
             rb[poff] = '.';
         }
 
+        len = off - ipo[ipn] - 1;
         off++;
         if ((off + 3) >= qlen)
             return -1;
 
-        if ((read_u16 (&rb[off + 0]) == 1) && (read_u16 (&rb[off + 2]) == 1)) {
+        name = (char *)&rb[ipo[ipn] + 1];
+        type = read_u16 (&rb[off + 0]);
+        if (((type == TYPE_A) || ((type == TYPE_AAAA) && self->has_net6)) &&
+            (read_u16 (&rb[off + 2]) == 1) &&
+            hev_mapped_dns_wanted (name, len)) {
             int idx;
 
-            idx = hev_mapped_dns_find (self, (char *)&rb[ipo[ipn] + 1]);
+            idx = hev_mapped_dns_find (self, name, len, now, &ipq[ipn]);
             if (idx >= 0) {
-                ips[ipn] = self->net | idx;
+                ips[ipn] = idx;
+                ipt[ipn] = type;
                 ipn++;
+            } else {
+                failed = 1;
             }
         }
 
@@ -239,50 +812,483 @@ hev_mapped_dns_handle (HevMappedDNS *self, void *req, int qlen, void *res,
     }
 
     for (i = 0; i < ipn; i++) {
-        if ((off + 15) >= slen)
+        int dlen = (ipt[i] == TYPE_A) ? 4 : 16;
+
+        if ((off + 11 + dlen) >= slen)
             return -1;
 
         sb[off + 0] = 0xc0;
         sb[off + 1] = ipo[i];
-        write_u16 (&sb[off + 2], 1);
+        write_u16 (&sb[off + 2], ipt[i]);
         write_u16 (&sb[off + 4], 1);
-        write_u32 (&sb[off + 6], 1);
-        write_u16 (&sb[off + 10], 4);
-        write_u32 (&sb[off + 12], ips[i]);
+        write_u32 (&sb[off + 6], self->ttl);
+        write_u16 (&sb[off + 10], dlen);
+        if (ipt[i] == TYPE_A) {
+            write_u32 (&sb[off + 12], self->net | ips[i]);
+        } else {
+            memcpy (&sb[off + 12], self->net6, 12);
+            write_u32 (&sb[off + 24], ips[i]);
+        }
 
-        off += 16;
+        off += 12 + dlen;
     }
 
     shdr->fl = htons (shdr->fl | 0x8000 | ((shdr->fl & 0x100) >> 1));
     shdr->an = htons (ipn);
 
+    /* An answer short of a record it should have is not kept. */
+    if (cached && !failed && (ipn <= ANSWER_IDX) &&
+        ((qlen + off) <= ANSWER_DATA))
+        hev_mapped_dns_answer_put (self, query, qlen, sb, off, hash, ips, ipq,
+                                   ipn, gen);
+
     return off;
 }
 
-const char *
-hev_mapped_dns_lookup (HevMappedDNS *self, int ip)
+int
+hev_mapped_dns_error (const void *req, int qlen, void *res, int slen,
+                      int rcode)
+{
+    DNSHdr *shdr = res;
+    unsigned int fl;
+
+    if ((qlen < sizeof (DNSHdr)) || (slen < sizeof (DNSHdr)))
+        return -1;
+
+    /* Keep the ID, opcode and RD, as for an answer. */
+    memcpy (res, req, sizeof (DNSHdr));
+    fl = ntohs (shdr->fl) & 0x7900;
+    shdr->fl = htons (fl | 0x8000 | ((fl & 0x100) >> 1) | rcode);
+    shdr->qd = 0;
+    shdr->an = 0;
+    shdr->ns = 0;
+    shdr->ar = 0;
+
+    return sizeof (DNSHdr);
+}
+
+int
+hev_mapped_dns_maps (HevMappedDNS *self, const void *req, int qlen)
+{
+    const uint8_t *rb = req;
+    int off = sizeof (DNSHdr);
+    int qd;
+    int i;
+
+    if (qlen < sizeof (DNSHdr))
+        return 0;
+
+    qd = read_u16 (&rb[4]);
+    for (i = 0; i < qd; i++) {
+        char name[NAME_SIZE];
+        int len = 0;
+        int type;
+
+        while ((off < qlen) && rb[off]) {
+            int n = rb[off];
+
+            if (((off + 1 + n) > qlen) || ((len + 1 + n) >= NAME_SIZE))
+                return 0;
+
+            if (len)
+                name[len++] = '.';
+            memcpy (&name[len], &rb[off + 1], n);
+            len += n;
+            off += 1 + n;
+        }
+
+        off++;
+        if ((off + 4) > qlen)
+            return 0;
+
+        type = read_u16 (&rb[off + 0]);
+        if (((type == TYPE_A) || ((type == TYPE_AAAA) && self->has_net6)) &&
+            (read_u16 (&rb[off + 2]) == 1) && hev_mapped_dns_wanted (name, len))
+            return 1;
+
+        off += 4;
+    }
+
+    return 0;
+}
+
+/*
+ * "name" covers the name and all below it, "*.name" only the names below
+ * it and "*" every name. A leading '!' keeps the names it covers out.
+ */
+static int
+hev_mapped_dns_rule_add (HevDomainTrie *trie, const char *rule, int len,
+                         int *includes)
+{
+    int flags = HEV_DOMAIN_TRIE_EXACT | HEV_DOMAIN_TRIE_BELOW;
+    int value = 1;
+
+    if ((len > 0) && (rule[0] == '!')) {
+        value = 0;
+        rule++;
+        len--;
+    }
+
+    if ((len == 1) && (rule[0] == '*'))
+        return hev_domain_trie_insert (trie, "", 0, value, flags);
+
+    if ((len > 2) && (rule[0] == '*') && (rule[1] == '.')) {
+        flags = HEV_DOMAIN_TRIE_BELOW;
+        rule += 2;
+        len -= 2;
+    }
+
+    if ((len <= 0) || (len >= NAME_SIZE) || (rule[0] == '.'))
+        return -1;
+
+    *includes += value;
+
+    return hev_domain_trie_insert (trie, rule, len, value, flags);
+}
+
+/*
+ * Swap @trie in and free the table it replaces. Once anything is included
+ * explicitly, names no rule covers are left unmapped unless "*" says
+ * otherwise.
+ */
+static void
+hev_mapped_dns_rules_publish (HevDomainTrie *trie, int includes)
+{
+    HevDomainTrie *old;
+
+    if (trie && includes && (hev_domain_trie_lookup (trie, "", 0) < 0))
+        hev_domain_trie_insert (trie, "", 0, 0, HEV_DOMAIN_TRIE_BELOW);
+
+    old = atomic_exchange (&rules, trie);
+    atomic_fetch_add (&rule_gen, 1);
+    if (!old)
+        return;
+
+    while (atomic_load (&rule_readers))
+        sched_yield ();
+
+    hev_domain_trie_destroy (old);
+}
+
+int
+hev_mapped_dns_set_rules (const char **list, int count)
+{
+    HevDomainTrie *trie = NULL;
+    int includes = 0;
+    int i;
+
+    if (count) {
+        trie = hev_domain_trie_new ();
+        if (!trie)
+            return -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (hev_mapped_dns_rule_add (trie, list[i], strlen (list[i]),
+                                     &includes) < 0) {
+            LOG_E ("mapped dns rule %s", list[i]);
+            hev_domain_trie_destroy (trie);
+            return -1;
+        }
+    }
+
+    hev_mapped_dns_rules_publish (trie, includes);
+
+    return 0;
+}
+
+int
+hev_mapped_dns_load_rules (const char *path)
 {
+    HevDomainTrie *trie;
+    char line[1024];
+    int includes = 0;
+    int lineno = 0;
+    FILE *fp;
+
+    fp = fopen (path, "r");
+    if (!fp) {
+        LOG_E ("mapped dns rules %s", path);
+        return -1;
+    }
+
+    trie = hev_domain_trie_new ();
+    if (!trie)
+        goto exit;
+
+    while (fgets (line, sizeof (line), fp)) {
+        char *rule = line;
+        int len;
+
+        lineno++;
+        while ((*rule == ' ') || (*rule == '\t'))
+            rule++;
+
+        len = strcspn (rule, " \t\r\n#");
+        if (!len)
+            continue;
+
+        if (hev_mapped_dns_rule_add (trie, rule, len, &includes) < 0) {
+            LOG_E ("mapped dns rules %s:%d", path, lineno);
+            goto free;
+        }
+    }
+
+    fclose (fp);
+    hev_mapped_dns_rules_publish (trie, includes);
+
+    return 0;
+
+free:
+    hev_domain_trie_destroy (trie);
+exit:
+    fclose (fp);
+    return -1;
+}
+
+static int
+hev_mapped_dns_record (HevMappedDNS *self, int idx, char *name, int size)
+{
+    HevMappedDNSShard *shard;
     HevMappedDNSNode *node;
+    unsigned int seq;
+    int len;
+
+    if ((idx < 0) || (idx >= self->max))
+        return -1;
+
+    shard = hev_mapped_dns_shard_of (self, idx);
+    node = &self->records[idx];
+    for (;;) {
+        unsigned int off;
+
+        seq = atomic_load_explicit (&node->seq, memory_order_acquire);
+        if (seq & 1)
+            continue;
+
+        len = node->len;
+        off = node->off;
+        if (len && (len < size) && ((off + len) <= shard->arena_size))
+            memcpy (name, &shard->arena[off], len);
+
+        atomic_thread_fence (memory_order_acquire);
+        if (atomic_load_explicit (&node->seq, memory_order_relaxed) == seq)
+            break;
+    }
+
+    if (!len || (len >= size))
+        return -1;
+
+    name[len] = '\0';
+    hev_mapped_dns_touch (node);
+
+    return len;
+}
+
+int
+hev_mapped_dns_lookup (HevMappedDNS *self, int ip, char *name, int size)
+{
+    if ((ip & self->mask) != self->net)
+        return -1;
+
+    return hev_mapped_dns_record (self, ip & ~self->mask, name, size);
+}
+
+void
+hev_mapped_dns_set_ttl (HevMappedDNS *self, unsigned int ttl)
+{
+    self->ttl = ttl;
+}
+
+void
+hev_mapped_dns_set_net6 (HevMappedDNS *self, const void *net6)
+{
+    memcpy (self->net6, net6, 12);
+    memset (&self->net6[12], 0, 4);
+    self->has_net6 = 1;
+}
+
+int
+hev_mapped_dns_lookup6 (HevMappedDNS *self, const void *ip6, char *name,
+                        int size)
+{
+    const uint8_t *p = ip6;
     int idx;
 
-    idx = ip & ~self->mask;
-    if (idx >= self->max)
-        return NULL;
+    if (!self->has_net6 || memcmp (p, self->net6, 12))
+        return -1;
 
-    node = self->records[idx];
-    if (!node)
-        return NULL;
+    idx = ((uint32_t)p[12] << 24) | (p[13] << 16) | (p[14] << 8) | p[15];
+
+    return hev_mapped_dns_record (self, idx, name, size);
+}
+
+int
+hev_mapped_dns_save (HevMappedDNS *self, const char *path)
+{
+    HevMappedDNSFileHdr hdr;
+    char tmp[1100];
+    uint32_t idx;
+    FILE *fp;
+    int res;
+
+    snprintf (tmp, sizeof (tmp), "%s.tmp", path);
+    fp = fopen (tmp, "wb");
+    if (!fp)
+        return -1;
+
+    hdr.magic = FILE_MAGIC;
+    hdr.count = 0;
+    hdr.max = self->max;
+    hdr.net = self->net;
+    hdr.mask = self->mask;
+    hdr.hashed = self->hashed;
+    hdr.seed = self->seed;
+    fwrite (&hdr, sizeof (hdr), 1, fp);
+
+    for (idx = 0; idx < self->max; idx++) {
+        HevMappedDNSNode *node = &self->records[idx];
+
+        if (!node->len)
+            continue;
+
+        fwrite (&idx, sizeof (idx), 1, fp);
+        fputc (node->len, fp);
+        fwrite (hev_mapped_dns_name (hev_mapped_dns_shard_of (self, idx), node),
+                node->len, 1, fp);
+        hdr.count++;
+    }
+
+    /* The count is only known at the end. */
+    fseek (fp, 0, SEEK_SET);
+    fwrite (&hdr, sizeof (hdr), 1, fp);
+
+    res = ferror (fp);
+    if ((fclose (fp) != 0) || res || (rename (tmp, path) < 0)) {
+        unlink (tmp);
+        return -1;
+    }
+
+    LOG_D ("%p mapped dns save %u", self, hdr.count);
+
+    return 0;
+}
+
+int
+hev_mapped_dns_load (HevMappedDNS *self, const char *path)
+{
+    const HevMappedDNSFileHdr *hdr;
+    const uint8_t *p, *end;
+    unsigned int now;
+    struct stat st;
+    uint32_t i;
+    void *map;
+    int res = -1;
+    int fd;
+
+    fd = open (path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    if ((fstat (fd, &st) < 0) || (st.st_size < sizeof (HevMappedDNSFileHdr)))
+        goto exit;
+
+    map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        goto exit;
+
+    /* Fake addresses are only meaningful under the same mapping. */
+    hdr = map;
+    if ((hdr->magic != FILE_MAGIC) || (hdr->max != self->max) ||
+        (hdr->net != self->net) || (hdr->mask != self->mask) ||
+        (hdr->hashed != self->hashed) || (hdr->seed != self->seed))
+        goto unmap;
+
+    p = (const uint8_t *)(hdr + 1);
+    end = (const uint8_t *)map + st.st_size;
+    now = hev_mapped_dns_now ();
+    for (i = 0; i < hdr->count; i++) {
+        HevMappedDNSShard *shard;
+        unsigned int hash;
+        uint32_t idx;
+        int local;
+        int len;
+
+        if ((end - p) < 5)
+            break;
+
+        memcpy (&idx, p, 4);
+        len = p[4];
+        p += 5;
+
+        if (!len || ((end - p) < len) || (idx >= self->max) ||
+            self->records[idx].len)
+            break;
+
+        /* A name out of its shard or probe window could not be found. */
+        hash = hev_mapped_dns_hash (self->seed, p, len);
+        shard = hev_mapped_dns_shard (self, hash);
+        local = (int)idx - shard->base;
+        if ((local < 0) || (local >= shard->size))
+            break;
+
+        if (self->hashed) {
+            local -= hash % shard->size;
+            if (local < 0)
+                local += shard->size;
+            if (local >= hev_mapped_dns_probes (shard))
+                break;
+            shard->use++;
+        } else if (local >= shard->use) {
+            shard->use = local + 1;
+        }
+
+        /* Clients may still hold answers given before the restart. */
+        if (hev_mapped_dns_set (self, shard, idx, (const char *)p, len,
+                                hash) < 0)
+            break;
+        self->records[idx].expire = hev_mapped_dns_expire (self, now);
+        p += len;
+    }
 
-    hev_list_del (&self->list, &node->list);
-    hev_list_add_tail (&self->list, &node->list);
+    if (i != hdr->count) {
+        hev_mapped_dns_clear (self);
+        goto unmap;
+    }
+
+    LOG_D ("%p mapped dns load %u", self, i);
+    res = 0;
 
-    return node->name;
+unmap:
+    munmap (map, st.st_size);
+exit:
+    close (fd);
+    return res;
+}
+
+static void
+hev_mapped_dns_free (HevMappedDNS *self)
+{
+    int s;
+
+    for (s = 0; self->shards && (s < self->nshards); s++) {
+        HevMappedDNSShard *shard = &self->shards[s];
+
+        hev_free (shard->arena);
+        hev_free (shard->slots);
+    }
+
+    hev_free (self->shards);
+    hev_free (self->records);
+    hev_free (self->answers);
 }
 
 int
-hev_mapped_dns_construct (HevMappedDNS *self, int net, int mask, int max)
+hev_mapped_dns_construct (HevMappedDNS *self, int net, int mask, int max,
+                          const char *key)
 {
     int res;
+    int s;
 
     res = hev_object_construct (&self->base);
     if (res < 0)
@@ -292,32 +1298,81 @@ hev_mapped_dns_construct (HevMappedDNS *self, int net, int mask, int max)
 
     HEV_OBJECT (self)->klass = HEV_MAPPED_DNS_TYPE;
 
-    if (max > ~mask)
+    if ((max <= 0) || (max > ~mask))
         return -1;
 
     self->max = max;
     self->net = net;
     self->mask = mask;
+    self->ttl = 1;
+    self->seed = FNV_BASIS;
+
+    if (key) {
+        self->hashed = 1;
+        self->seed = hev_mapped_dns_hash (FNV_BASIS, key, strlen (key));
+    }
+
+    /* Derived from the size alone, so equal configs shard alike. */
+    self->nshards = 1;
+    while ((self->nshards < SHARDS_MAX) &&
+           ((max / (self->nshards * 2)) >= SHARD_MIN))
+        self->nshards <<= 1;
+
+    self->shards = hev_calloc (self->nshards, sizeof (HevMappedDNSShard));
+    self->records = hev_malloc0 (sizeof (HevMappedDNSNode) * max);
+    self->answers = hev_calloc (ANSWERS, sizeof (HevMappedDNSAnswer));
+    if (!self->shards || !self->records || !self->answers)
+        goto exit;
+
+    for (s = 0; s < self->nshards; s++) {
+        HevMappedDNSShard *shard = &self->shards[s];
+        unsigned int slots;
+        unsigned int i;
+
+        shard->base = (long long)max * s / self->nshards;
+        shard->size = (long long)max * (s + 1) / self->nshards - shard->base;
+
+        /* Whatever the budget, the longest name must fit. */
+        shard->arena_size = shard->size * RECORD_ARENA;
+        if (shard->arena_size < (ENTRY_HDR + NAME_SIZE))
+            shard->arena_size = ENTRY_HDR + NAME_SIZE;
+
+        shard->arena = hev_malloc (shard->arena_size);
+        if (!shard->arena)
+            goto exit;
+
+        if (self->hashed)
+            continue;
+
+        /* Keep the index at most half full so probe runs stay short. */
+        slots = 1;
+        while (slots < (shard->size * 2))
+            slots <<= 1;
+
+        shard->slots = hev_malloc (sizeof (HevMappedDNSSlot) * slots);
+        if (!shard->slots)
+            goto exit;
+
+        for (i = 0; i < slots; i++)
+            shard->slots[i].idx = -1;
+        shard->slot_mask = slots - 1;
+    }
 
     return 0;
+
+exit:
+    hev_mapped_dns_free (self);
+    return -1;
 }
 
 static void
 hev_mapped_dns_destruct (HevObject *base)
 {
     HevMappedDNS *self = HEV_MAPPED_DNS (base);
-    HevListNode *n;
 
     LOG_D ("%p mapped dns destruct", self);
 
-    n = hev_list_first (&self->list);
-    while (n) {
-        HevMappedDNSNode *t;
-
-        t = container_of (n, HevMappedDNSNode, list);
-        n = hev_list_node_next (n);
-        hev_mapped_dns_node_free (t);
-    }
+    hev_mapped_dns_free (self);
 
     HEV_OBJECT_TYPE->destruct (base);
     hev_free (base);
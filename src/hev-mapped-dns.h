@@ -11,7 +11,6 @@
 #define __HEV_MAPPED_DNS_H__
 
 #include <hev-list.h>
-#include <hev-rbtree.h>
 #include <hev-object.h>
 
 #ifdef __cplusplus
@@ -22,22 +21,37 @@ extern "C" {
 #define HEV_MAPPED_DNS_CLASS(p) ((HevMappedDNSClass *)p)
 #define HEV_MAPPED_DNS_TYPE (hev_mapped_dns_class ())
 
+enum
+{
+    HEV_MAPPED_DNS_RCODE_FORMERR = 1,
+    HEV_MAPPED_DNS_RCODE_SERVFAIL = 2,
+    HEV_MAPPED_DNS_RCODE_REFUSED = 5,
+};
+
 typedef struct _HevMappedDNS HevMappedDNS;
 typedef struct _HevMappedDNSClass HevMappedDNSClass;
 typedef struct _HevMappedDNSNode HevMappedDNSNode;
+typedef struct _HevMappedDNSSlot HevMappedDNSSlot;
+typedef struct _HevMappedDNSShard HevMappedDNSShard;
+typedef struct _HevMappedDNSAnswer HevMappedDNSAnswer;
 
 struct _HevMappedDNS
 {
     HevObject base;
 
-    int use;
     int max;
     int net;
     int mask;
-
-    HevList list;
-    HevRBTree tree;
-    HevMappedDNSNode *records[0];
+    int nshards;
+    unsigned int seed;
+    int hashed;
+    unsigned int ttl;
+    int has_net6;
+    unsigned char net6[16];
+
+    HevMappedDNSShard *shards;
+    HevMappedDNSNode *records;
+    HevMappedDNSAnswer *answers;
 };
 
 struct _HevMappedDNSClass
@@ -47,16 +61,69 @@ struct _HevMappedDNSClass
 
 HevObjectClass *hev_mapped_dns_class (void);
 
-int hev_mapped_dns_construct (HevMappedDNS *self, int net, int mask, int max);
+/*
+ * With a @key the index of a name is derived from a keyed hash of it, so
+ * instances sharing the key, network and size hand out the same addresses
+ * for most names. Without one indexes are handed out in order.
+ */
+int hev_mapped_dns_construct (HevMappedDNS *self, int net, int mask, int max,
+                              const char *key);
 
-HevMappedDNS *hev_mapped_dns_new (int net, int mask, int max);
+HevMappedDNS *hev_mapped_dns_new (int net, int mask, int max, const char *key);
 
+/*
+ * Lookups may run on any thread alongside handle, which locks only the
+ * shard of the name it inserts. The table itself must outlive them all.
+ */
 HevMappedDNS *hev_mapped_dns_get (void);
 void hev_mapped_dns_put (HevMappedDNS *self);
 
 int hev_mapped_dns_handle (HevMappedDNS *self, void *req, int qlen, void *res,
                            int slen);
-const char *hev_mapped_dns_lookup (HevMappedDNS *self, int ip);
+/* Whether hev_mapped_dns_handle would answer any question of @req. */
+int hev_mapped_dns_maps (HevMappedDNS *self, const void *req, int qlen);
+/*
+ * Write a reply to @req with no records and the response code @rcode.
+ * Returns its length, or -1 if @req has no whole header.
+ */
+int hev_mapped_dns_error (const void *req, int qlen, void *res, int slen,
+                          int rcode);
+/* Copy the name behind @ip into @name, returns its length or -1. */
+int hev_mapped_dns_lookup (HevMappedDNS *self, int ip, char *name, int size);
+
+/*
+ * Replace the rules deciding which names get mapped, compiled here. A rule
+ * is "name", "*.name" or "*", optionally behind '!' to exclude. The most
+ * specific rule wins. With no rules every name is mapped, once any name
+ * is included the rest are not. Questions that are not mapped are left
+ * out of the answer and are not counted by hev_mapped_dns_maps. Queries
+ * are never blocked by a swap, so this is safe to call from any thread.
+ * Returns -1 if a rule is invalid, and the current rules are kept.
+ */
+int hev_mapped_dns_set_rules (const char **rules, int count);
+/* The same, one rule per line of @path, '#' starts a comment. */
+int hev_mapped_dns_load_rules (const char *path);
+
+/*
+ * Answer with @ttl seconds, 1 by default. A record stays bound to its name
+ * until the TTL it was last answered with runs out, questions that find no
+ * record free of that go unanswered.
+ */
+void hev_mapped_dns_set_ttl (HevMappedDNS *self, unsigned int ttl);
+
+/* Answer AAAA from the /96 @net6, the low 32 bits carry the index. */
+void hev_mapped_dns_set_net6 (HevMappedDNS *self, const void *net6);
+int hev_mapped_dns_lookup6 (HevMappedDNS *self, const void *ip6, char *name,
+                            int size);
+
+/*
+ * Write the index to name table to @path, replacing it atomically, and
+ * read it back into an empty table. A snapshot taken with another network,
+ * mask, cache size or hash key is refused, so handed out addresses keep
+ * their names.
+ */
+int hev_mapped_dns_save (HevMappedDNS *self, const char *path);
+int hev_mapped_dns_load (HevMappedDNS *self, const char *path);
 
 #ifdef __cplusplus
 }
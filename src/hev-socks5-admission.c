@@ -0,0 +1,228 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-admission.c
+ Author      : hev <r@hev.cc>
+ Copyright   : Copyright (c) 2025 hev
+ Description : Socks5 Session Admission
+ ============================================================================
+ */
+
+#include <string.h>
+
+#include <lwip/ip.h>
+#include <lwip/icmp.h>
+#include <lwip/priv/tcp_priv.h>
+
+#include "hev-utils.h"
+#include "hev-config.h"
+#include "hev-logger.h"
+
+#include "hev-socks5-admission.h"
+
+#define SOURCE_SETS (256)
+#define SOURCE_WAYS (4)
+#define MILLI (1000)
+
+typedef struct _HevSocks5AdmissionBucket HevSocks5AdmissionBucket;
+
+/* Tokens are kept in thousandths so a millisecond refills something. */
+struct _HevSocks5AdmissionBucket
+{
+    unsigned long long stamp;
+    unsigned long long tokens;
+    ip_addr_t src;
+};
+
+static int enabled;
+static int action;
+static HevTaskMutex *mutex;
+
+static unsigned int rate;
+static unsigned int burst;
+static unsigned int source_rate;
+static unsigned int source_burst;
+
+static HevSocks5AdmissionBucket global;
+static HevSocks5AdmissionBucket sources[SOURCE_SETS][SOURCE_WAYS];
+
+static size_t stat_tcp_rejects;
+static size_t stat_udp_rejects;
+
+static int
+hev_socks5_admission_refill (HevSocks5AdmissionBucket *bucket, unsigned int r,
+                             unsigned int b, unsigned long long now)
+{
+    unsigned long long max = (unsigned long long)b * MILLI;
+
+    bucket->tokens += (now - bucket->stamp) * r;
+    if (bucket->tokens > max)
+        bucket->tokens = max;
+    bucket->stamp = now;
+
+    return bucket->tokens >= MILLI;
+}
+
+static int
+hev_socks5_admission_source_equal (const ip_addr_t *a, const ip_addr_t *b)
+{
+    if (a->type != b->type)
+        return 0;
+
+    if (IP_IS_V4 (a))
+        return ip_2_ip4 (a)->addr == ip_2_ip4 (b)->addr;
+
+    return !memcmp (ip_2_ip6 (a)->addr, ip_2_ip6 (b)->addr, 16);
+}
+
+/*
+ * Sources hash to a set of a few slots, so a handful of colliding sources
+ * keep their own buckets. A new source takes the least recently used slot,
+ * which has most likely refilled already.
+ */
+static HevSocks5AdmissionBucket *
+hev_socks5_admission_source (const ip_addr_t *src, unsigned long long now)
+{
+    HevSocks5AdmissionBucket *set, *victim;
+    unsigned int hash;
+    int i;
+
+    hash = get_flow_hash (src, 0, src, 0, 0);
+    set = sources[hash % SOURCE_SETS];
+    victim = &set[0];
+
+    for (i = 0; i < SOURCE_WAYS; i++) {
+        HevSocks5AdmissionBucket *bucket = &set[i];
+
+        if (bucket->stamp &&
+            hev_socks5_admission_source_equal (&bucket->src, src))
+            return bucket;
+        if (bucket->stamp < victim->stamp)
+            victim = bucket;
+    }
+
+    victim->src = *src;
+    victim->stamp = now;
+    victim->tokens = (unsigned long long)source_burst * MILLI;
+
+    return victim;
+}
+
+/* Both buckets must have a token before either is charged. */
+static int
+hev_socks5_admission_check (const ip_addr_t *src)
+{
+    HevSocks5AdmissionBucket *bucket = NULL;
+    unsigned long long now;
+
+    now = get_time_msec ();
+
+    if (source_rate) {
+        bucket = hev_socks5_admission_source (src, now);
+        if (!hev_socks5_admission_refill (bucket, source_rate, source_burst,
+                                          now))
+            return -1;
+    }
+
+    if (rate) {
+        if (!hev_socks5_admission_refill (&global, rate, burst, now))
+            return -1;
+        global.tokens -= MILLI;
+    }
+
+    if (bucket)
+        bucket->tokens -= MILLI;
+
+    return 0;
+}
+
+int
+hev_socks5_admission_input (struct pbuf *p, const HevSocks5TCPSynKey *key)
+{
+    if (!enabled || (hev_socks5_admission_check (&key->src) == 0))
+        return 0;
+
+    LOG_D ("socks5 admission reject tcp");
+    stat_tcp_rejects++;
+
+    switch (action) {
+    case HEV_CONFIG_ADMISSION_ACTION_ICMP:
+        if (IP_IS_V4 (&key->src)) {
+            hev_task_mutex_lock (mutex);
+            icmp_dest_unreach (p, ICMP_DUR_PORT);
+            hev_task_mutex_unlock (mutex);
+            break;
+        }
+        /* No ICMPv6 outside the input path, reset instead. */
+    case HEV_CONFIG_ADMISSION_ACTION_RST:
+        hev_task_mutex_lock (mutex);
+        tcp_rst (NULL, 0, key->seqno + 1, &key->dst, &key->src, key->dport,
+                 key->sport);
+        hev_task_mutex_unlock (mutex);
+        break;
+    }
+
+    pbuf_free (p);
+
+    return 1;
+}
+
+int
+hev_socks5_admission_udp (const ip_addr_t *src)
+{
+    if (!enabled || (hev_socks5_admission_check (src) == 0))
+        return 0;
+
+    LOG_D ("socks5 admission reject udp");
+    stat_udp_rejects++;
+
+    return -1;
+}
+
+int
+hev_socks5_admission_enabled (void)
+{
+    return enabled;
+}
+
+int
+hev_socks5_admission_init (HevTaskMutex *_mutex)
+{
+    LOG_D ("socks5 admission init");
+
+    rate = hev_config_get_misc_session_rate ();
+    burst = hev_config_get_misc_session_burst ();
+    source_rate = hev_config_get_misc_session_source_rate ();
+    source_burst = hev_config_get_misc_session_source_burst ();
+    action = hev_config_get_misc_session_limit_action ();
+    mutex = _mutex;
+
+    if (rate && (burst < 1))
+        burst = rate;
+    if (source_rate && (source_burst < 1))
+        source_burst = source_rate;
+
+    global.stamp = get_time_msec ();
+    global.tokens = (unsigned long long)burst * MILLI;
+    enabled = rate || source_rate;
+
+    return 0;
+}
+
+void
+hev_socks5_admission_fini (void)
+{
+    LOG_D ("socks5 admission fini");
+
+    enabled = 0;
+    mutex = NULL;
+    memset (sources, 0, sizeof (sources));
+    stat_tcp_rejects = 0;
+    stat_udp_rejects = 0;
+}
+
+void
+hev_socks5_admission_stats (size_t *tcp_rejects, size_t *udp_rejects)
+{
+    *tcp_rejects = stat_tcp_rejects;
+    *udp_rejects = stat_udp_rejects;
+}
@@ -0,0 +1,36 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-admission.h
+ Author      : hev <r@hev.cc>
+ Copyright   : Copyright (c) 2025 hev
+ Description : Socks5 Session Admission
+ ============================================================================
+ */
+
+#ifndef __HEV_SOCKS5_ADMISSION_H__
+#define __HEV_SOCKS5_ADMISSION_H__
+
+#include <stddef.h>
+
+#include <hev-task-mutex.h>
+
+#include "hev-socks5-tcp-syn.h"
+
+int hev_socks5_admission_init (HevTaskMutex *mutex);
+void hev_socks5_admission_fini (void);
+
+int hev_socks5_admission_enabled (void);
+
+/*
+ * Take a token for the new TCP flow of the client SYN @p. Without one the
+ * SYN is answered with the configured action and taken: returns 1, else 0
+ * and the caller goes on.
+ */
+int hev_socks5_admission_input (struct pbuf *p, const HevSocks5TCPSynKey *key);
+
+/* Take a token for a new UDP flow from @src. Returns -1 if refused. */
+int hev_socks5_admission_udp (const ip_addr_t *src);
+
+void hev_socks5_admission_stats (size_t *tcp_rejects, size_t *udp_rejects);
+
+#endif /* __HEV_SOCKS5_ADMISSION_H__ */
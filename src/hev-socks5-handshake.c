@@ -0,0 +1,303 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-handshake.c
+ Author      : hev <r@hev.cc>
+ Copyright   : Copyright (c) 2025 hev
+ Description : Socks5 Handshake
+ ============================================================================
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <hev-task.h>
+#include <hev-task-io-socket.h>
+#include <hev-socks5-misc.h>
+
+#include "hev-logger.h"
+
+#include "hev-socks5-handshake.h"
+
+#define EARLY_IOV_MAX (64)
+
+static int
+hev_socks5_handshake_send (int fd, const void *buf, size_t len,
+                           HevTaskIOYielder yielder, void *yielder_data)
+{
+    ssize_t s;
+
+    s = hev_task_io_socket_send (fd, buf, len, 0, yielder, yielder_data);
+    if (s != len)
+        return -1;
+
+    return 0;
+}
+
+static int
+hev_socks5_handshake_recv (int fd, void *buf, size_t len,
+                           HevTaskIOYielder yielder, void *yielder_data)
+{
+    ssize_t s;
+
+    s = hev_task_io_socket_recv (fd, buf, len, MSG_WAITALL, yielder,
+                                 yielder_data);
+    if (s != len)
+        return -1;
+
+    return 0;
+}
+
+static int
+hev_socks5_handshake_closed (int fd)
+{
+    ssize_t s;
+    char b;
+
+    s = recv (fd, &b, sizeof (b), MSG_PEEK | MSG_DONTWAIT);
+    if (s == 0)
+        return 1;
+
+    return (s < 0) && ((errno == ECONNRESET) || (errno == EPIPE));
+}
+
+static int
+hev_socks5_handshake_write_auth (uint8_t *buf, const char *user,
+                                 const char *pass)
+{
+    int ulen, plen, off;
+
+    buf[0] = 5;
+    buf[1] = 1;
+    buf[2] = user ? 2 : 0;
+    if (!user)
+        return 3;
+
+    ulen = strlen (user);
+    plen = strlen (pass);
+
+    buf[3] = 1;
+    buf[4] = ulen;
+    memcpy (&buf[5], user, ulen);
+    off = 5 + ulen;
+    buf[off++] = plen;
+    memcpy (&buf[off], pass, plen);
+
+    return off + plen;
+}
+
+static int
+hev_socks5_handshake_write_request (uint8_t *buf, const HevSocks5Addr *addr)
+{
+    int len = hev_socks5_addr_len (addr);
+
+    buf[0] = 5;
+    buf[1] = HEV_SOCKS5_REQ_CMD_CONNECT;
+    buf[2] = 0;
+    memcpy (&buf[3], addr, len);
+
+    return 3 + len;
+}
+
+static int
+hev_socks5_handshake_read_auth (int fd, int auth, HevTaskIOYielder yielder,
+                                void *yielder_data)
+{
+    uint8_t buf[2];
+    int res;
+
+    res = hev_socks5_handshake_recv (fd, buf, 2, yielder, yielder_data);
+    if (res < 0)
+        return -1;
+
+    if ((buf[0] != 5) || (buf[1] != (auth ? 2 : 0))) {
+        LOG_D ("socks5 handshake method %u", buf[1]);
+        return -1;
+    }
+
+    if (!auth)
+        return 0;
+
+    res = hev_socks5_handshake_recv (fd, buf, 2, yielder, yielder_data);
+    if (res < 0)
+        return -1;
+
+    if ((buf[0] != 1) || (buf[1] != 0)) {
+        LOG_D ("socks5 handshake auth %u", buf[1]);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+hev_socks5_handshake_read_reply (int fd, HevTaskIOYielder yielder,
+                                 void *yielder_data)
+{
+    HevSocks5Addr addr;
+    uint8_t buf[4];
+    uint8_t *ptr;
+    int len, res;
+
+    res = hev_socks5_handshake_recv (fd, buf, 4, yielder, yielder_data);
+    if (res < 0)
+        return -1;
+
+    if (buf[0] != 5)
+        return -1;
+
+    if (buf[1] != 0) {
+        LOG_D ("socks5 handshake reply %u", buf[1]);
+        return buf[1];
+    }
+
+    addr.atype = buf[3];
+    switch (addr.atype) {
+    case HEV_SOCKS5_ADDR_TYPE_IPV4:
+        ptr = addr.ipv4.addr;
+        len = 6;
+        break;
+    case HEV_SOCKS5_ADDR_TYPE_IPV6:
+        ptr = addr.ipv6.addr;
+        len = 18;
+        break;
+    case HEV_SOCKS5_ADDR_TYPE_NAME:
+        res = hev_socks5_handshake_recv (fd, &addr.domain.len, 1, yielder,
+                                         yielder_data);
+        if (res < 0)
+            return -1;
+        ptr = addr.domain.addr;
+        len = addr.domain.len + 2;
+        break;
+    default:
+        return -1;
+    }
+
+    res = hev_socks5_handshake_recv (fd, ptr, len, yielder, yielder_data);
+    if (res < 0)
+        return -1;
+
+    return 0;
+}
+
+int
+hev_socks5_handshake_client (HevSocks5Client *client, int fd,
+                             HevConfigServer *srv)
+{
+    int res;
+
+    res = hev_socks5_client_connect_fd (client, fd);
+    if (res < 0)
+        return -1;
+
+    if (srv->user && srv->pass)
+        hev_socks5_client_set_auth (client, srv->user, srv->pass);
+
+    hev_socks5_set_timeout (HEV_SOCKS5 (client),
+                            hev_config_get_misc_connect_timeout ());
+    res = hev_socks5_client_handshake (client, srv->pipeline);
+
+    /* The socket outlives the client, keep it from being closed with it. */
+    HEV_SOCKS5 (client)->fd = -1;
+
+    return res;
+}
+
+int
+hev_socks5_handshake_greet (int fd, int auth, HevTaskIOYielder yielder,
+                            void *yielder_data)
+{
+    uint8_t buf[3];
+    int res;
+
+    buf[0] = 5;
+    buf[1] = 1;
+    buf[2] = auth ? 2 : 0;
+
+    res = hev_socks5_handshake_send (fd, buf, 3, yielder, yielder_data);
+    if (res < 0)
+        return -1;
+
+    res = hev_socks5_handshake_recv (fd, buf, 2, yielder, yielder_data);
+    if (res < 0)
+        return -1;
+
+    if ((buf[0] != 5) || (buf[1] != (auth ? 2 : 0)))
+        return -1;
+
+    return 0;
+}
+
+int
+hev_socks5_handshake_auth (int fd, const char *user, const char *pass,
+                           HevTaskIOYielder yielder, void *yielder_data)
+{
+    uint8_t buf[1024];
+    int len, res;
+
+    len = hev_socks5_handshake_write_auth (buf, user, pass);
+    res = hev_socks5_handshake_send (fd, buf, len, yielder, yielder_data);
+    if (res < 0)
+        return -1;
+
+    return hev_socks5_handshake_read_auth (fd, !!user, yielder, yielder_data);
+}
+
+ssize_t
+hev_socks5_handshake_connect_early (int fd, int auth, const char *user,
+                                    const char *pass, const HevSocks5Addr *addr,
+                                    const struct iovec *iov, int iovc,
+                                    int *rep, HevTaskIOYielder yielder,
+                                    void *yielder_data)
+{
+    struct iovec msg_iov[EARLY_IOV_MAX + 1];
+    struct msghdr msg = { 0 };
+    uint8_t buf[1536];
+    ssize_t s;
+    int len = 0;
+    int res;
+
+    *rep = -1;
+    if (auth)
+        len = hev_socks5_handshake_write_auth (buf, user, pass);
+    len += hev_socks5_handshake_write_request (&buf[len], addr);
+
+    if (iovc > EARLY_IOV_MAX)
+        iovc = EARLY_IOV_MAX;
+
+    msg_iov[0].iov_base = buf;
+    msg_iov[0].iov_len = len;
+    if (iovc > 0)
+        memcpy (&msg_iov[1], iov, sizeof (struct iovec) * iovc);
+    msg.msg_iov = msg_iov;
+    msg.msg_iovlen = iovc + 1;
+
+    /*
+     * A short write may stop anywhere in the early data; the caller keeps
+     * the unsent tail and splices it after the reply.
+     */
+    s = hev_task_io_socket_sendmsg (fd, &msg, MSG_NOSIGNAL, yielder,
+                                    yielder_data);
+    if (s < len)
+        goto fail;
+
+    if (auth) {
+        res = hev_socks5_handshake_read_auth (fd, !!user, yielder,
+                                              yielder_data);
+        if (res < 0)
+            goto fail;
+    }
+
+    *rep = hev_socks5_handshake_read_reply (fd, yielder, yielder_data);
+    if (*rep > 0)
+        return -1;
+    if (*rep < 0)
+        goto fail;
+
+    return s - len;
+
+fail:
+    if ((s <= len) && hev_socks5_handshake_closed (fd))
+        *rep = HEV_SOCKS5_HANDSHAKE_REP_CLOSED;
+    return -1;
+}
@@ -0,0 +1,58 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-handshake.h
+ Author      : hev <r@hev.cc>
+ Copyright   : Copyright (c) 2025 hev
+ Description : Socks5 Handshake
+ ============================================================================
+ */
+
+#ifndef __HEV_SOCKS5_HANDSHAKE_H__
+#define __HEV_SOCKS5_HANDSHAKE_H__
+
+#include <sys/uio.h>
+
+#include <hev-task-io.h>
+#include <hev-socks5-proto.h>
+#include <hev-socks5-client.h>
+
+#include "hev-config.h"
+
+#define HEV_SOCKS5_HANDSHAKE_REP_CLOSED (-2)
+
+/*
+ * Run the core client handshake of @client over @fd, already connected to
+ * the upstream of @srv, bounded by connect-timeout. The socket is handed
+ * back registered with the calling task whatever the outcome, BND.ADDR
+ * goes to the set_upstream_addr hook of @client.
+ */
+int hev_socks5_handshake_client (HevSocks5Client *client, int fd,
+                                 HevConfigServer *srv);
+
+/*
+ * The exchanges the core client has no entry point for: the method
+ * greeting alone for health probes, and greeting and auth without a
+ * request for pooled connections.
+ */
+int hev_socks5_handshake_greet (int fd, int auth, HevTaskIOYielder yielder,
+                                void *yielder_data);
+int hev_socks5_handshake_auth (int fd, const char *user, const char *pass,
+                               HevTaskIOYielder yielder, void *yielder_data);
+
+/*
+ * CONNECT to @addr with @iov written right behind the request in the same
+ * flight, before the reply is read. With @auth the method greeting and auth
+ * are prepended too (pipeline mode); without it the connection must already
+ * be authenticated. Returns how many bytes of @iov were sent, or -1 if the
+ * exchange failed or the server rejected the request. @rep receives the
+ * reply code, HEV_SOCKS5_HANDSHAKE_REP_CLOSED if the server closed or reset
+ * the connection before any byte of @iov was sent, or -1 otherwise.
+ */
+ssize_t hev_socks5_handshake_connect_early (int fd, int auth, const char *user,
+                                            const char *pass,
+                                            const HevSocks5Addr *addr,
+                                            const struct iovec *iov, int iovc,
+                                            int *rep, HevTaskIOYielder yielder,
+                                            void *yielder_data);
+
+#endif /* __HEV_SOCKS5_HANDSHAKE_H__ */
@@ -0,0 +1,241 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-negative-cache.c
+ Author      : hev <r@hev.cc>
+ Copyright   : Copyright (c) 2025 hev
+ Description : Socks5 Negative Cache
+ ============================================================================
+ */
+
+#include <string.h>
+
+#include <lwip/icmp.h>
+#include <lwip/priv/tcp_priv.h>
+
+#include <hev-memory-allocator.h>
+#include <hev-socks5-misc.h>
+
+#include "hev-list.h"
+#include "hev-utils.h"
+#include "hev-config.h"
+#include "hev-logger.h"
+#include "hev-compiler.h"
+
+#include "hev-socks5-negative-cache.h"
+
+#define CACHE_BUCKETS (1024)
+#define CACHE_MAX_ENTRIES (4096)
+
+enum
+{
+    REP_NOT_ALLOWED = 2,
+    REP_NET_UNREACH = 3,
+    REP_HOST_UNREACH = 4,
+    REP_REFUSED = 5,
+    REP_TTL_EXPIRED = 6,
+};
+
+typedef struct _HevSocks5NegativeCacheEntry HevSocks5NegativeCacheEntry;
+
+struct _HevSocks5NegativeCacheEntry
+{
+    HevListNode node;
+    HevListNode age_node;
+
+    HevSocks5Upstream *upstream;
+    unsigned long long expire;
+    unsigned int hash;
+    int rep;
+
+    HevSocks5Addr addr;
+};
+
+static int ttl;
+static int entry_count;
+static size_t stat_hits;
+static HevTaskMutex *mutex;
+
+static HevList ages;
+static HevList buckets[CACHE_BUCKETS];
+
+static unsigned int
+hev_socks5_negative_cache_hash (const HevSocks5Addr *addr, int len)
+{
+    const uint8_t *p = (const uint8_t *)addr;
+    unsigned int hash = 2166136261u;
+    int i;
+
+    for (i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static void
+hev_socks5_negative_cache_del (HevSocks5NegativeCacheEntry *entry)
+{
+    hev_list_del (&buckets[entry->hash % CACHE_BUCKETS], &entry->node);
+    hev_list_del (&ages, &entry->age_node);
+    hev_free (entry);
+    entry_count--;
+}
+
+/* Every entry lives for the same ttl, so the oldest expires first. */
+static void
+hev_socks5_negative_cache_expire (unsigned long long now)
+{
+    HevListNode *node;
+
+    while ((node = hev_list_first (&ages))) {
+        HevSocks5NegativeCacheEntry *entry;
+
+        entry = container_of (node, HevSocks5NegativeCacheEntry, age_node);
+        if ((entry_count < CACHE_MAX_ENTRIES) && (entry->expire > now))
+            break;
+
+        hev_socks5_negative_cache_del (entry);
+    }
+}
+
+static HevSocks5NegativeCacheEntry *
+hev_socks5_negative_cache_lookup (HevSocks5Upstream *upstream,
+                                  const HevSocks5Addr *addr, int len,
+                                  unsigned int hash)
+{
+    HevListNode *node;
+
+    node = hev_list_first (&buckets[hash % CACHE_BUCKETS]);
+    for (; node; node = hev_list_node_next (node)) {
+        HevSocks5NegativeCacheEntry *entry;
+
+        entry = container_of (node, HevSocks5NegativeCacheEntry, node);
+        if ((entry->hash == hash) && (entry->upstream == upstream) &&
+            !memcmp (&entry->addr, addr, len))
+            return entry;
+    }
+
+    return NULL;
+}
+
+void
+hev_socks5_negative_cache_add (HevSocks5Upstream *upstream,
+                               const HevSocks5Addr *addr, int rep)
+{
+    HevSocks5NegativeCacheEntry *entry;
+    unsigned long long now;
+    unsigned int hash;
+    int len;
+
+    if (!ttl || (rep < REP_NOT_ALLOWED) || (rep > REP_TTL_EXPIRED))
+        return;
+
+    now = get_time_msec ();
+    hev_socks5_negative_cache_expire (now);
+
+    len = hev_socks5_addr_len (addr);
+    hash = hev_socks5_negative_cache_hash (addr, len);
+    entry = hev_socks5_negative_cache_lookup (upstream, addr, len, hash);
+    if (entry) {
+        hev_list_del (&ages, &entry->age_node);
+    } else {
+        entry = hev_malloc (sizeof (HevSocks5NegativeCacheEntry));
+        if (!entry)
+            return;
+
+        memcpy (&entry->addr, addr, len);
+        entry->upstream = upstream;
+        entry->hash = hash;
+        hev_list_add_tail (&buckets[hash % CACHE_BUCKETS], &entry->node);
+        entry_count++;
+    }
+
+    entry->rep = rep;
+    entry->expire = now + ttl;
+    hev_list_add_tail (&ages, &entry->age_node);
+
+    LOG_D ("socks5 negative cache add %u", rep);
+}
+
+int
+hev_socks5_negative_cache_input (struct pbuf *p, const HevSocks5TCPSynKey *key)
+{
+    HevSocks5NegativeCacheEntry *entry;
+    HevSocks5Upstream *upstream;
+    HevSocks5Addr addr;
+    unsigned int hash;
+    int len;
+
+    if (!entry_count)
+        return 0;
+
+    hev_socks5_negative_cache_expire (get_time_msec ());
+
+    upstream = hev_socks5_upstream_get_only ();
+    if (!upstream)
+        return 0;
+
+    if (hev_socks5_addr_from_lwip (&addr, &key->dst, key->dport) < 0)
+        return 0;
+
+    len = hev_socks5_addr_len (&addr);
+    hash = hev_socks5_negative_cache_hash (&addr, len);
+    entry = hev_socks5_negative_cache_lookup (upstream, &addr, len, hash);
+    if (!entry)
+        return 0;
+
+    stat_hits++;
+
+    hev_task_mutex_lock (mutex);
+    if (IP_IS_V4 (&key->dst) && (entry->rep == REP_NET_UNREACH)) {
+        icmp_dest_unreach (p, ICMP_DUR_NET);
+    } else if (IP_IS_V4 (&key->dst) && (entry->rep == REP_HOST_UNREACH)) {
+        icmp_dest_unreach (p, ICMP_DUR_HOST);
+    } else {
+        tcp_rst (NULL, 0, key->seqno + 1, &key->dst, &key->src, key->dport,
+                 key->sport);
+    }
+    hev_task_mutex_unlock (mutex);
+
+    pbuf_free (p);
+
+    return 1;
+}
+
+int
+hev_socks5_negative_cache_init (HevTaskMutex *_mutex)
+{
+    LOG_D ("socks5 negative cache init");
+
+    ttl = hev_config_get_misc_negative_cache_ttl ();
+    mutex = _mutex;
+
+    return 0;
+}
+
+void
+hev_socks5_negative_cache_fini (void)
+{
+    HevListNode *node;
+
+    LOG_D ("socks5 negative cache fini");
+
+    while ((node = hev_list_first (&ages))) {
+        HevSocks5NegativeCacheEntry *entry;
+
+        entry = container_of (node, HevSocks5NegativeCacheEntry, age_node);
+        hev_socks5_negative_cache_del (entry);
+    }
+
+    ttl = 0;
+    stat_hits = 0;
+    mutex = NULL;
+}
+
+void
+hev_socks5_negative_cache_stats (size_t *hits, size_t *entries)
+{
+    *hits = stat_hits;
+    *entries = entry_count;
+}
@@ -0,0 +1,43 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-negative-cache.h
+ Author      : hev <r@hev.cc>
+ Copyright   : Copyright (c) 2025 hev
+ Description : Socks5 Negative Cache
+ ============================================================================
+ */
+
+#ifndef __HEV_SOCKS5_NEGATIVE_CACHE_H__
+#define __HEV_SOCKS5_NEGATIVE_CACHE_H__
+
+#include <stddef.h>
+
+#include <hev-task-mutex.h>
+#include <hev-socks5-proto.h>
+
+#include "hev-socks5-tcp-syn.h"
+#include "hev-socks5-upstream.h"
+
+int hev_socks5_negative_cache_init (HevTaskMutex *mutex);
+void hev_socks5_negative_cache_fini (void);
+
+/*
+ * Remember that @upstream answered a CONNECT to @addr with the reply code
+ * @rep. Only codes that will not change on a quick retry are kept.
+ */
+void hev_socks5_negative_cache_add (HevSocks5Upstream *upstream,
+                                    const HevSocks5Addr *addr, int rep);
+
+/*
+ * Answer the client SYN @p locally if its destination is cached: an ICMP
+ * unreachable for unreachable IPv4 destinations, a RST otherwise. Entries
+ * only apply while their upstream is the only one up, with several the
+ * flow may well land on another server. Returns 1 if the packet was taken,
+ * else 0 and the caller goes on.
+ */
+int hev_socks5_negative_cache_input (struct pbuf *p,
+                                     const HevSocks5TCPSynKey *key);
+
+void hev_socks5_negative_cache_stats (size_t *hits, size_t *entries);
+
+#endif /* __HEV_SOCKS5_NEGATIVE_CACHE_H__ */
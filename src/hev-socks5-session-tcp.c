@@ -9,6 +9,8 @@
 
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
 
 #include <lwip/tcp.h>
 
@@ -20,10 +22,14 @@
 #include <hev-socks5-misc.h>
 
 #include "hev-utils.h"
+#include "hev-bypass.h"
 #include "hev-config.h"
 #include "hev-logger.h"
 #include "hev-config-const.h"
 #include "hev-socks5-tunnel.h"
+#include "hev-socks5-tcp-pool.h"
+#include "hev-socks5-handshake.h"
+#include "hev-socks5-negative-cache.h"
 
 #include "hev-socks5-session-tcp.h"
 
@@ -41,19 +47,39 @@ task_io_yielder (HevTaskYieldType type, void *data)
     return res;
 }
 
+static int
+tcp_queue_iov (HevSocks5SessionTCP *self, struct iovec *iov, int max)
+{
+    struct pbuf *p;
+    int iovc = 0;
+
+    for (p = self->queue; p && (iovc < max); p = p->next, iovc++) {
+        iov[iovc].iov_base = p->payload;
+        iov[iovc].iov_len = p->len;
+    }
+
+    return iovc;
+}
+
+static void
+tcp_queue_consume (HevSocks5SessionTCP *self, size_t len)
+{
+    hev_task_mutex_lock (self->mutex);
+    self->queue = pbuf_free_header (self->queue, len);
+    if (self->pcb)
+        tcp_recved (self->pcb, len);
+    hev_task_mutex_unlock (self->mutex);
+}
+
 static int
 tcp_splice_f (HevSocks5SessionTCP *self)
 {
     struct iovec iov[64];
-    struct pbuf *p;
     int iovc = 0;
     int res = 1;
 
     if (self->queue) {
-        for (p = self->queue; p && (iovc < 64); p = p->next, iovc++) {
-            iov[iovc].iov_base = p->payload;
-            iov[iovc].iov_len = p->len;
-        }
+        iovc = tcp_queue_iov (self, iov, 64);
     } else if (self->pcb_eof) {
         res = -1;
     } else {
@@ -68,11 +94,7 @@ tcp_splice_f (HevSocks5SessionTCP *self)
             else
                 res = -1;
         } else {
-            hev_task_mutex_lock (self->mutex);
-            self->queue = pbuf_free_header (self->queue, s);
-            if (self->pcb)
-                tcp_recved (self->pcb, s);
-            hev_task_mutex_unlock (self->mutex);
+            tcp_queue_consume (self, s);
             res = 1;
         }
     } else if (res < 0) {
@@ -189,6 +211,124 @@ hev_socks5_session_tcp_new (struct tcp_pcb *pcb, HevTaskMutex *mutex)
     return self;
 }
 
+static int
+hev_socks5_session_tcp_connect (HevSocks5Session *base, HevConfigServer *srv)
+{
+    HevSocks5SessionTCP *self = HEV_SOCKS5_SESSION_TCP (base);
+    int fd;
+
+    if (self->data.direct) {
+        ip_addr_t addr;
+        u16_t port;
+
+        if (hev_socks5_addr_into_lwip (&self->addr, &addr, &port) < 0)
+            return -1;
+
+        fd = hev_bypass_connect (&addr, port, SOCK_STREAM, task_io_yielder,
+                                 self);
+        if (fd < 0)
+            return -1;
+
+        LOG_D ("%p socks5 session tcp direct %d", self, fd);
+        self->connected = 1;
+        return hev_socks5_client_connect_fd (HEV_SOCKS5_CLIENT (self), fd);
+    }
+
+    if (self->syn) {
+        fd = hev_socks5_tcp_syn_wait (self->syn, task_io_yielder, self);
+        hev_socks5_tcp_syn_release (self->syn);
+        self->syn = NULL;
+        if (fd < 0)
+            return -1;
+
+        LOG_D ("%p socks5 session tcp syn %d", self, fd);
+        self->connected = 1;
+        return hev_socks5_client_connect_fd (HEV_SOCKS5_CLIENT (self), fd);
+    }
+
+    fd = hev_socks5_tcp_pool_get (self->data.upstream);
+    if (fd >= 0) {
+        LOG_D ("%p socks5 session tcp pooled %d", self, fd);
+        self->pooled = 1;
+        return hev_socks5_client_connect_fd (HEV_SOCKS5_CLIENT (self), fd);
+    }
+
+    return hev_socks5_session_connect (base, srv);
+}
+
+static int
+hev_socks5_session_tcp_handshake (HevSocks5Session *base, HevConfigServer *srv)
+{
+    HevSocks5SessionTCP *self = HEV_SOCKS5_SESSION_TCP (base);
+    struct iovec iov[64];
+    int iovc = 0;
+    int timeout;
+    int auth;
+    int rep;
+    int fd;
+    ssize_t s;
+
+    if (self->connected)
+        goto exit;
+
+retry:
+    /* Method negotiation and auth of pooled connections were done. */
+    fd = HEV_SOCKS5 (self)->fd;
+    auth = !self->pooled;
+    if (auth && !srv->pipeline) {
+        if (hev_socks5_handshake_auth (fd, srv->user, srv->pass,
+                                       task_io_yielder, self) != 0)
+            return -1;
+        auth = 0;
+    }
+
+    /*
+     * The queue is only released once the reply accepts the request, so a
+     * rejected CONNECT never loses or repeats client data.
+     */
+    if (srv->optimistic)
+        iovc = tcp_queue_iov (self, iov, 64);
+
+    s = hev_socks5_handshake_connect_early (fd, auth, srv->user, srv->pass,
+                                            &self->addr, iov, iovc, &rep,
+                                            task_io_yielder, self);
+    if (s < 0) {
+        if (rep > 0)
+            hev_socks5_negative_cache_add (self->data.upstream, &self->addr,
+                                           rep);
+        if ((rep > 0) || !self->pooled)
+            return -1;
+
+        /*
+         * Start over on a fresh connection only if no client data can have
+         * reached the server: none was queued, or the idle pooled connection
+         * was closed before any of it went out.
+         */
+        if (iovc && (rep != HEV_SOCKS5_HANDSHAKE_REP_CLOSED))
+            return -1;
+
+        LOG_D ("%p socks5 session tcp pooled retry", self);
+        hev_task_del_fd (hev_task_self (), fd);
+        close (fd);
+        HEV_SOCKS5 (self)->fd = -1;
+        self->pooled = 0;
+        if (hev_socks5_session_connect (base, srv) < 0)
+            return -1;
+        goto retry;
+    }
+
+    if (s > 0) {
+        LOG_D ("%p socks5 session tcp early %zd", self, s);
+        tcp_queue_consume (self, s);
+    }
+
+exit:
+    timeout = hev_config_get_misc_tcp_read_write_timeout ();
+    hev_socks5_set_timeout (HEV_SOCKS5 (self), timeout);
+
+    return 0;
+}
+
 static void
 hev_socks5_session_tcp_splice (HevSocks5Session *base)
 {
@@ -264,6 +404,7 @@ hev_socks5_session_tcp_construct (HevSocks5SessionTCP *self,
                                   struct tcp_pcb *pcb, HevTaskMutex *mutex)
 {
     HevSocks5Addr addr;
+    unsigned int hash;
     int res;
 
     res = hev_socks5_addr_from_lwip (&addr, &pcb->local_ip, pcb->local_port);
@@ -274,6 +415,21 @@ hev_socks5_session_tcp_construct (HevSocks5SessionTCP *self,
     if (res < 0)
         return -1;
 
+    /* The upstream picked on SYN stays with the flow. */
+    self->syn = hev_socks5_tcp_syn_claim (pcb);
+    if (self->syn) {
+        self->data.upstream = self->syn->upstream;
+    } else if ((addr.atype != HEV_SOCKS5_ADDR_TYPE_NAME) &&
+               hev_bypass_match (&pcb->local_ip)) {
+        /* Only for the binder and config, not accounted as a session. */
+        self->data.upstream = hev_socks5_upstream_get (0);
+        self->data.direct = 1;
+    } else {
+        hash = get_flow_hash (&pcb->remote_ip, pcb->remote_port,
+                              &pcb->local_ip, pcb->local_port, IP_PROTO_TCP);
+        self->data.upstream = hev_socks5_upstream_select (hash);
+    }
+
     LOG_D ("%p socks5 session tcp construct", self);
 
     HEV_OBJECT (self)->klass = HEV_SOCKS5_SESSION_TCP_TYPE;
@@ -284,6 +440,7 @@ hev_socks5_session_tcp_construct (HevSocks5SessionTCP *self,
     tcp_err (pcb, tcp_err_handler);
 
     self->pcb = pcb;
+    self->addr = addr;
     self->mutex = mutex;
     self->data.self = self;
 
@@ -309,6 +466,11 @@ hev_socks5_session_tcp_destruct (HevObject *base)
         pbuf_free (self->queue);
     hev_task_mutex_unlock (self->mutex);
 
+    if (self->syn)
+        hev_socks5_tcp_syn_release (self->syn);
+    if (!self->data.direct)
+        hev_socks5_upstream_release (self->data.upstream);
+
     HEV_SOCKS5_CLIENT_TCP_TYPE->destruct (base);
 }
 
@@ -346,6 +508,8 @@ hev_socks5_session_tcp_class (void)
         skptr->binder = hev_socks5_session_bind;
 
         siptr = &kptr->session;
+        siptr->connector = hev_socks5_session_tcp_connect;
+        siptr->handshaker = hev_socks5_session_tcp_handshake;
         siptr->splicer = hev_socks5_session_tcp_splice;
         siptr->get_task = hev_socks5_session_tcp_get_task;
         siptr->set_task = hev_socks5_session_tcp_set_task;
@@ -14,6 +14,7 @@
 #include <hev-socks5-client-tcp.h>
 
 #include "hev-socks5-session.h"
+#include "hev-socks5-tcp-syn.h"
 
 #define HEV_SOCKS5_SESSION_TCP(p) ((HevSocks5SessionTCP *)p)
 #define HEV_SOCKS5_SESSION_TCP_CLASS(p) ((HevSocks5SessionTCPClass *)p)
@@ -32,7 +33,11 @@ struct _HevSocks5SessionTCP
     struct tcp_pcb *pcb;
     HevTaskMutex *mutex;
     HevRingBuffer *buffer;
+    HevSocks5TCPSyn *syn;
+    HevSocks5Addr addr;
     int pcb_eof;
+    int pooled;
+    int connected;
 };
 
 struct _HevSocks5SessionTCPClass
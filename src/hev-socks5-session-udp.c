@@ -9,6 +9,8 @@
 
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
 
 #include <lwip/udp.h>
 
@@ -21,11 +23,14 @@
 #include <hev-socks5-misc.h>
 
 #include "hev-utils.h"
+#include "hev-bypass.h"
 #include "hev-config.h"
+#include "hev-buffer-pool.h"
 #include "hev-logger.h"
 #include "hev-compiler.h"
 #include "hev-config-const.h"
 #include "hev-socks5-tunnel.h"
+#include "hev-socks5-udp-pool.h"
 
 #include "hev-socks5-session-udp.h"
 
@@ -36,33 +41,75 @@ struct _HevSocks5UDPFrame
     HevListNode node;
     HevSocks5Addr addr;
     struct pbuf *data;
+    unsigned long long stamp;
 };
 
+static HevBufferPool *buffer_pool;
+static size_t stat_queued_bytes;
+static size_t stat_drop_packets;
+static size_t stat_drop_bytes;
+
 static int
 task_io_yielder (HevTaskYieldType type, void *data)
 {
-    HevSocks5 *self = data;
+    HevSocks5Session *self = data;
     HevListNode *node;
     int res;
 
-    if (self->type == HEV_SOCKS5_TYPE_UDP_IN_UDP) {
-        ssize_t res;
-        char buf;
-
-        res = recv (self->fd, &buf, sizeof (buf), 0);
-        if ((res == 0) || ((res < 0) && (errno != EAGAIN))) {
-            hev_socks5_set_timeout (self, 0);
-            return -1;
-        }
-    }
-
     res = hev_socks5_task_io_yielder (type, data);
-    node = hev_socks5_session_get_node (HEV_SOCKS5_SESSION (self));
+    node = hev_socks5_session_get_node (self);
     hev_socks5_tunnel_update_session (node);
 
     return res;
 }
 
+static void
+hev_socks5_session_udp_frame_del (HevSocks5SessionUDP *self,
+                                  HevSocks5UDPFrame *frame)
+{
+    size_t len = frame->data->tot_len;
+
+    hev_list_del (&self->frame_list, &frame->node);
+    pbuf_free (frame->data);
+    hev_free (frame);
+
+    self->frames--;
+    self->frame_bytes -= len;
+    stat_queued_bytes -= len;
+}
+
+static void
+hev_socks5_session_udp_drop (HevSocks5SessionUDP *self, size_t len)
+{
+    self->drops++;
+    stat_drop_packets++;
+    stat_drop_bytes += len;
+}
+
+static void
+hev_socks5_session_udp_drop_stale (HevSocks5SessionUDP *self)
+{
+    unsigned long long now;
+    HevListNode *node;
+    int delay;
+
+    delay = hev_config_get_misc_udp_queue_target_delay ();
+    if (!delay)
+        return;
+
+    now = get_time_msec ();
+    while ((node = hev_list_first (&self->frame_list))) {
+        HevSocks5UDPFrame *frame;
+
+        frame = container_of (node, HevSocks5UDPFrame, node);
+        if ((now - frame->stamp) <= delay)
+            break;
+
+        hev_socks5_session_udp_drop (self, frame->data->tot_len);
+        hev_socks5_session_udp_frame_del (self, frame);
+    }
+}
+
 static int
 hev_socks5_session_udp_fwd_f (HevSocks5SessionUDP *self, unsigned int num)
 {
@@ -72,6 +119,8 @@ hev_socks5_session_udp_fwd_f (HevSocks5SessionUDP *self, unsigned int num)
     struct pbuf *buf;
     int i, res;
 
+    hev_socks5_session_udp_drop_stale (self);
+
     res = self->frames;
     if (res <= 0)
         return 0;
@@ -88,7 +137,14 @@ hev_socks5_session_udp_fwd_f (HevSocks5SessionUDP *self, unsigned int num)
         msgv[i].addr = &frame->addr;
     }
 
-    res = hev_socks5_udp_sendmmsg (HEV_SOCKS5_UDP (self), msgv, res);
+    if (self->shared) {
+        /* Full, the frames stay queued until the relay wakes us. */
+        res = hev_socks5_udp_relay_sendmmsg (&self->relay, msgv, res);
+        if (res == 0)
+            return 0;
+    } else {
+        res = hev_socks5_udp_sendmmsg (HEV_SOCKS5_UDP (self), msgv, res);
+    }
     if (res <= 0) {
         LOG_D ("%p socks5 session udp fwd f send", self);
         return -1;
@@ -97,73 +153,225 @@ hev_socks5_session_udp_fwd_f (HevSocks5SessionUDP *self, unsigned int num)
     for (i = 0; i < res; i++) {
         node = hev_list_first (&self->frame_list);
         frame = container_of (node, HevSocks5UDPFrame, node);
-        buf = frame->data;
-
-        hev_list_del (&self->frame_list, node);
-        hev_free (frame);
-        pbuf_free (buf);
-        self->frames--;
+        hev_socks5_session_udp_frame_del (self, frame);
     }
 
     return 1;
 }
 
+static int
+hev_socks5_session_udp_deliver (HevSocks5SessionUDP *self,
+                                const HevSocks5Addr *addr, void *buf,
+                                size_t len)
+{
+    ip_addr_t saddr;
+    struct pbuf *b;
+    uint16_t port;
+    err_t err;
+    int res;
+
+    if (self->addr && self->port) {
+        ip_2_ip4 (&saddr)->addr = self->addr;
+        port = self->port;
+    } else {
+        res = hev_socks5_addr_into_lwip (addr, &saddr, &port);
+        if (res < 0) {
+            LOG_D ("%p socks5 session udp fwd b addr", self);
+            return -1;
+        }
+    }
+
+    b = pbuf_alloc_reference (buf, len, PBUF_REF);
+    if (!b) {
+        LOG_D ("%p socks5 session udp fwd b buf", self);
+        return -1;
+    }
+
+    hev_task_mutex_lock (self->mutex);
+    err = udp_sendfrom (self->pcb, b, &saddr, port);
+    hev_task_mutex_unlock (self->mutex);
+
+    pbuf_free (b);
+    if (err != ERR_OK) {
+        LOG_D ("%p socks5 session udp fwd b send", self);
+        return -1;
+    }
+
+    return 0;
+}
+
 static int
 hev_socks5_session_udp_fwd_b (HevSocks5SessionUDP *self, unsigned int num)
 {
-    char buf[UDP_BUF_SIZE * num];
+    size_t size = hev_buffer_pool_get_size (buffer_pool);
     HevSocks5UDPMsg msgv[num];
+    void *bufs[num];
     int i, res;
 
     for (i = 0; i < num; i++) {
-        msgv[i].buf = buf + UDP_BUF_SIZE * i;
-        msgv[i].len = UDP_BUF_SIZE;
+        bufs[i] = hev_buffer_pool_alloc (buffer_pool);
+        if (!bufs[i])
+            break;
+
+        msgv[i].buf = bufs[i];
+        msgv[i].len = size;
+    }
+
+    num = i;
+    if (!num) {
+        LOG_D ("%p socks5 session udp fwd b alloc", self);
+        return -1;
     }
 
     res = hev_socks5_udp_recvmmsg (HEV_SOCKS5_UDP (self), msgv, num, 1);
     if (res <= 0) {
-        if (res == -1 && errno == EAGAIN)
-            return 0;
+        if (res == -1 && errno == EAGAIN) {
+            res = 0;
+            goto exit;
+        }
         LOG_D ("%p socks5 session udp fwd b recv", self);
-        return -1;
+        res = -1;
+        goto exit;
     }
 
     for (i = 0; i < res; i++) {
-        ip_addr_t saddr;
+        HevSocks5UDPMsg *msg = &msgv[i];
+        int ret;
+
+        ret = hev_socks5_session_udp_deliver (self, msg->addr, msg->buf,
+                                              msg->len);
+        if (ret < 0) {
+            res = -1;
+            goto exit;
+        }
+    }
+
+    res = 1;
+
+exit:
+    for (i = 0; i < num; i++)
+        hev_buffer_pool_free (buffer_pool, bufs[i]);
+
+    return res;
+}
+
+static int
+hev_socks5_session_udp_relay_b (HevSocks5SessionUDP *self, unsigned int num)
+{
+    size_t size = hev_buffer_pool_get_size (buffer_pool);
+    int res = 0;
+    void *buf;
+    int i;
+
+    buf = hev_buffer_pool_alloc (buffer_pool);
+    if (!buf) {
+        LOG_D ("%p socks5 session udp relay b alloc", self);
+        return -1;
+    }
+
+    for (i = 0; i < num; i++) {
+        res = hev_socks5_udp_relay_recv_node (&self->relay, buf, size);
+        if (res <= 0)
+            break;
+    }
+
+    hev_buffer_pool_free (buffer_pool, buf);
+
+    if (res < 0) {
+        LOG_D ("%p socks5 session udp relay b recv", self);
+        return -1;
+    }
+
+    return i ? 1 : 0;
+}
+
+static int
+hev_socks5_session_udp_direct_f (HevSocks5SessionUDP *self, unsigned int num)
+{
+    int i;
+
+    hev_socks5_session_udp_drop_stale (self);
+
+    for (i = 0; i < num; i++) {
+        HevSocks5UDPFrame *frame;
+        HevListNode *node;
+        struct pbuf *buf;
+        ssize_t s;
+
+        node = hev_list_first (&self->frame_list);
+        if (!node)
+            break;
+
+        frame = container_of (node, HevSocks5UDPFrame, node);
+        buf = frame->data;
+
+        s = send (self->direct_fd, buf->payload, buf->len, 0);
+        if (s < 0) {
+            if (errno == EAGAIN)
+                break;
+            LOG_D ("%p socks5 session udp direct f send", self);
+            return -1;
+        }
+
+        hev_socks5_session_udp_frame_del (self, frame);
+    }
+
+    return i ? 1 : 0;
+}
+
+static int
+hev_socks5_session_udp_direct_b (HevSocks5SessionUDP *self, unsigned int num)
+{
+    size_t size = hev_buffer_pool_get_size (buffer_pool);
+    int res = 0;
+    void *buf;
+    int i;
+
+    buf = hev_buffer_pool_alloc (buffer_pool);
+    if (!buf) {
+        LOG_D ("%p socks5 session udp direct b alloc", self);
+        return -1;
+    }
+
+    for (i = 0; i < num; i++) {
         struct pbuf *b;
-        uint16_t port;
+        ssize_t s;
         err_t err;
-        int ret;
 
-        if (self->addr && self->port) {
-            ip_2_ip4 (&saddr)->addr = self->addr;
-            port = self->port;
-        } else {
-            ret = hev_socks5_addr_into_lwip (msgv[i].addr, &saddr, &port);
-            if (ret < 0) {
-                LOG_D ("%p socks5 session udp fwd b addr", self);
-                return -1;
+        s = recv (self->direct_fd, buf, size, 0);
+        if (s < 0) {
+            if (errno != EAGAIN) {
+                LOG_D ("%p socks5 session udp direct b recv", self);
+                res = -1;
             }
+            break;
         }
 
-        b = pbuf_alloc_reference (msgv[i].buf, msgv[i].len, PBUF_REF);
+        b = pbuf_alloc_reference (buf, s, PBUF_REF);
         if (!b) {
-            LOG_D ("%p socks5 session udp fwd b buf", self);
-            return -1;
+            LOG_D ("%p socks5 session udp direct b buf", self);
+            res = -1;
+            break;
         }
 
         hev_task_mutex_lock (self->mutex);
-        err = udp_sendfrom (self->pcb, b, &saddr, port);
+        err = udp_sendfrom (self->pcb, b, &self->pcb->local_ip,
+                            self->pcb->local_port);
         hev_task_mutex_unlock (self->mutex);
 
         pbuf_free (b);
         if (err != ERR_OK) {
-            LOG_D ("%p socks5 session udp fwd b send", self);
-            return -1;
+            LOG_D ("%p socks5 session udp direct b send", self);
+            res = -1;
+            break;
         }
+
+        res = 1;
     }
 
-    return 1;
+    hev_buffer_pool_free (buffer_pool, buf);
+
+    return res;
 }
 
 static void
@@ -172,24 +380,36 @@ udp_recv_handler (void *arg, struct udp_pcb *pcb, struct pbuf *p,
 {
     HevSocks5SessionUDP *self = arg;
     HevSocks5UDPFrame *frame;
+    size_t total_limit;
+    size_t limit;
+    size_t len;
 
     if (!p) {
         hev_socks5_session_terminate (HEV_SOCKS5_SESSION (self));
         return;
     }
 
-    if (self->frames > UDP_POOL_SIZE) {
+    len = p->tot_len;
+    limit = hev_config_get_misc_udp_session_queue_size ();
+    total_limit = hev_config_get_misc_udp_total_queue_size ();
+    if (((self->frame_bytes + len) > limit) ||
+        (total_limit && ((stat_queued_bytes + len) > total_limit))) {
+        hev_socks5_session_udp_drop (self, len);
         pbuf_free (p);
         return;
     }
 
     frame = hev_malloc (sizeof (HevSocks5UDPFrame));
     if (!frame) {
+        hev_socks5_session_udp_drop (self, len);
         pbuf_free (p);
         return;
     }
 
     frame->data = p;
+    frame->stamp = 0;
+    if (hev_config_get_misc_udp_queue_target_delay ())
+        frame->stamp = get_time_msec ();
     memset (&frame->node, 0, sizeof (frame->node));
     hev_socks5_addr_from_lwip (&frame->addr, &pcb->local_ip, pcb->local_port);
 
@@ -199,6 +419,8 @@ udp_recv_handler (void *arg, struct udp_pcb *pcb, struct pbuf *p,
     }
 
     self->frames++;
+    self->frame_bytes += len;
+    stat_queued_bytes += len;
     hev_list_add_tail (&self->frame_list, &frame->node);
     hev_task_wakeup (self->data.task);
 }
@@ -247,9 +469,19 @@ static int
 hev_socks5_session_udp_set_upstream_addr (HevSocks5Client *base,
                                           HevSocks5Addr *addr)
 {
-    HevConfigServer *srv = hev_config_get_socks5_server ();
+    HevSocks5SessionUDP *self = HEV_SOCKS5_SESSION_UDP (base);
+    HevConfigServer *srv;
     HevSocks5ClientClass *ckptr;
 
+    srv = hev_socks5_session_get_upstream (base)->srv;
+
+    /* Shared associations are reached through the relay socket. */
+    if (self->shared) {
+        int fd = HEV_SOCKS5 (self)->fd;
+        return hev_socks5_udp_relay_set_addr (&self->relay, fd, addr,
+                                              srv->udp_addr);
+    }
+
     if (srv->udp_in_udp && srv->udp_addr[0]) {
         uint16_t port = hev_socks5_addr_get_port (addr);
         hev_socks5_addr_from_name (addr, srv->udp_addr, port);
@@ -259,29 +491,189 @@ hev_socks5_session_udp_set_upstream_addr (HevSocks5Client *base,
     return ckptr->set_upstream_addr (base, addr);
 }
 
+static void
+hev_socks5_session_udp_relay_handler (HevSocks5UDPRelayNode *node,
+                                     HevSocks5Addr *addr, void *buf,
+                                     size_t len)
+{
+    HevSocks5SessionUDP *self;
+    int res;
+
+    self = container_of (node, HevSocks5SessionUDP, relay);
+
+    hev_object_ref (HEV_OBJECT (self));
+    res = hev_socks5_session_udp_deliver (self, addr, buf, len);
+    if (res < 0)
+        hev_socks5_session_terminate (HEV_SOCKS5_SESSION (self));
+    else
+        hev_task_wakeup (self->data.task);
+    hev_object_unref (HEV_OBJECT (self));
+}
+
+static int
+hev_socks5_session_udp_associate (HevSocks5SessionUDP *self,
+                                  HevConfigServer *srv)
+{
+    int timeout;
+    int res;
+
+    LOG_D ("%p socks5 session udp associate", self);
+
+    /* BND.ADDR reaches the relay node through set_upstream_addr. */
+    if (!self->pooled) {
+        res = hev_socks5_client_handshake (HEV_SOCKS5_CLIENT (self),
+                                           srv->pipeline);
+        if (res < 0)
+            return -1;
+    }
+
+    self->relay.handler = hev_socks5_session_udp_relay_handler;
+    res = hev_socks5_udp_relay_add (&self->relay);
+    if (res < 0)
+        return -1;
+
+    timeout = hev_config_get_misc_udp_read_write_timeout ();
+    hev_socks5_set_timeout (HEV_SOCKS5 (self), timeout);
+
+    return 0;
+}
+
+static int
+hev_socks5_session_udp_connect (HevSocks5Session *base, HevConfigServer *srv)
+{
+    HevSocks5SessionUDP *self = HEV_SOCKS5_SESSION_UDP (base);
+    int res;
+    int fd;
+
+    if (self->data.direct) {
+        fd = hev_bypass_connect (&self->pcb->local_ip, self->pcb->local_port,
+                                 SOCK_DGRAM, task_io_yielder, self);
+        if (fd < 0)
+            return -1;
+
+        res = hev_task_add_fd (hev_task_self (), fd, POLLIN | POLLOUT);
+        if (res < 0) {
+            close (fd);
+            return -1;
+        }
+
+        LOG_D ("%p socks5 session udp direct %d", self, fd);
+        self->direct_fd = fd;
+        return 0;
+    }
+
+    if (self->shared) {
+        res = hev_socks5_udp_pool_get (self->data.upstream, &fd,
+                                       &self->relay.addr);
+        if (res == 0) {
+            LOG_D ("%p socks5 session udp pooled %d", self, fd);
+            self->pooled = 1;
+            return hev_socks5_client_connect_fd (HEV_SOCKS5_CLIENT (self), fd);
+        }
+    }
+
+    return hev_socks5_session_connect (base, srv);
+}
+
+static int
+hev_socks5_session_udp_handshake (HevSocks5Session *base, HevConfigServer *srv)
+{
+    HevSocks5SessionUDP *self = HEV_SOCKS5_SESSION_UDP (base);
+
+    if (self->data.direct) {
+        int timeout = hev_config_get_misc_udp_read_write_timeout ();
+        hev_socks5_set_timeout (HEV_SOCKS5 (self), timeout);
+        return 0;
+    }
+
+    if (self->shared)
+        return hev_socks5_session_udp_associate (self, srv);
+
+    return hev_socks5_client_handshake (HEV_SOCKS5_CLIENT (self),
+                                        srv->pipeline);
+}
+
+static void
+hev_socks5_session_udp_splice_direct (HevSocks5SessionUDP *self)
+{
+    int res_f = 1, res_b = 1;
+    int num;
+
+    num = hev_config_get_misc_udp_copy_buffer_nums ();
+
+    for (;;) {
+        HevTaskYieldType type;
+
+        if (res_f >= 0)
+            res_f = hev_socks5_session_udp_direct_f (self, num);
+        if (res_b >= 0)
+            res_b = hev_socks5_session_udp_direct_b (self, num);
+
+        if (res_f > 0 || res_b > 0)
+            type = HEV_TASK_YIELD;
+        else if ((res_f & res_b) == 0)
+            type = HEV_TASK_WAITIO;
+        else
+            break;
+
+        if (task_io_yielder (type, self))
+            break;
+    }
+
+    hev_task_del_fd (hev_task_self (), self->direct_fd);
+}
+
 static void
 hev_socks5_session_udp_splice (HevSocks5Session *base)
 {
     HevSocks5SessionUDP *self = HEV_SOCKS5_SESSION_UDP (base);
     HevTask *task = hev_task_self ();
     int res_f = 1, res_b = 1;
+    int ctrl = -1;
     int num;
     int fd;
 
     LOG_D ("%p socks5 session udp splice", self);
 
+    if (self->data.direct) {
+        hev_socks5_session_udp_splice_direct (self);
+        return;
+    }
+
+    if (HEV_SOCKS5 (self)->type == HEV_SOCKS5_TYPE_UDP_IN_UDP) {
+        HevListNode *node;
+
+        ctrl = HEV_SOCKS5 (self)->fd;
+        node = hev_socks5_session_get_node (base);
+        hev_task_del_fd (task, ctrl);
+        if (hev_socks5_tunnel_add_control (ctrl, node) < 0) {
+            LOG_D ("%p socks5 session udp control", self);
+            return;
+        }
+    }
+
     num = hev_config_get_misc_udp_copy_buffer_nums ();
-    fd = hev_socks5_udp_get_fd (HEV_SOCKS5_UDP (self));
-    if (hev_task_mod_fd (task, fd, POLLIN | POLLOUT) < 0)
-        hev_task_add_fd (task, fd, POLLIN | POLLOUT);
+    if (self->shared) {
+        fd = self->relay.fd;
+        if ((fd < 0) || (hev_task_add_fd (task, fd, POLLIN | POLLOUT) < 0))
+            res_b = -1;
+    } else {
+        fd = hev_socks5_udp_get_fd (HEV_SOCKS5_UDP (self));
+        if (hev_task_mod_fd (task, fd, POLLIN | POLLOUT) < 0)
+            hev_task_add_fd (task, fd, POLLIN | POLLOUT);
+    }
 
     for (;;) {
         HevTaskYieldType type;
 
         if (res_f >= 0)
             res_f = hev_socks5_session_udp_fwd_f (self, num);
-        if (res_b >= 0)
-            res_b = hev_socks5_session_udp_fwd_b (self, num);
+        if (res_b >= 0) {
+            if (self->shared)
+                res_b = hev_socks5_session_udp_relay_b (self, num);
+            else
+                res_b = hev_socks5_session_udp_fwd_b (self, num);
+        }
 
         if (res_f > 0 || res_b > 0)
             type = HEV_TASK_YIELD;
@@ -293,6 +685,15 @@ hev_socks5_session_udp_splice (HevSocks5Session *base)
         if (task_io_yielder (type, self))
             break;
     }
+
+    if (ctrl >= 0)
+        hev_socks5_tunnel_del_control (ctrl);
+
+    if (self->shared) {
+        if (self->relay.fd >= 0)
+            hev_task_del_fd (task, self->relay.fd);
+        hev_socks5_udp_relay_del (&self->relay);
+    }
 }
 
 static HevTask *
@@ -323,18 +724,41 @@ int
 hev_socks5_session_udp_construct (HevSocks5SessionUDP *self,
                                   struct udp_pcb *pcb, HevTaskMutex *mutex)
 {
-    HevConfigServer *srv = hev_config_get_socks5_server ();
+    HevSocks5Upstream *upstream;
+    HevConfigServer *srv;
+    HevSocks5Addr addr;
+    unsigned int hash;
+    int direct = 0;
     int type;
     int res;
 
+    /*
+     * Direct flows keep the first upstream for config, unaccounted. Mapped
+     * addresses stand for names only the server can resolve.
+     */
+    res = hev_socks5_addr_from_lwip (&addr, &pcb->local_ip, pcb->local_port);
+    if ((res == 0) && (addr.atype != HEV_SOCKS5_ADDR_TYPE_NAME))
+        direct = hev_bypass_match (&pcb->local_ip);
+    if (direct) {
+        upstream = hev_socks5_upstream_get (0);
+    } else {
+        hash = get_flow_hash (&pcb->remote_ip, pcb->remote_port,
+                              &pcb->local_ip, pcb->local_port, IP_PROTO_UDP);
+        upstream = hev_socks5_upstream_select (hash);
+    }
+    srv = upstream->srv;
+
     if (srv->udp_in_udp)
         type = HEV_SOCKS5_TYPE_UDP_IN_UDP;
     else
         type = HEV_SOCKS5_TYPE_UDP_IN_TCP;
 
     res = hev_socks5_client_udp_construct (&self->base, type);
-    if (res < 0)
+    if (res < 0) {
+        if (!direct)
+            hev_socks5_upstream_release (upstream);
         return -1;
+    }
 
     LOG_D ("%p socks5 session udp construct", self);
 
@@ -342,9 +766,14 @@ hev_socks5_session_udp_construct (HevSocks5SessionUDP *self,
 
     udp_recv (pcb, udp_recv_handler, self);
 
+    self->shared = !direct && srv->udp_in_udp && srv->udp_shared;
+    self->direct_fd = -1;
+    self->relay.fd = -1;
     self->pcb = pcb;
     self->mutex = mutex;
     self->data.self = self;
+    self->data.upstream = upstream;
+    self->data.direct = direct;
 
     return 0;
 }
@@ -357,16 +786,19 @@ hev_socks5_session_udp_destruct (HevObject *base)
 
     LOG_D ("%p socks5 session udp destruct", self);
 
-    node = hev_list_first (&self->frame_list);
-    while (node) {
+    if (self->drops)
+        LOG_D ("%p socks5 session udp drops %zu", self, self->drops);
+
+    while ((node = hev_list_first (&self->frame_list))) {
         HevSocks5UDPFrame *frame;
 
         frame = container_of (node, HevSocks5UDPFrame, node);
-        node = hev_list_node_next (node);
-        pbuf_free (frame->data);
-        hev_free (frame);
+        hev_socks5_session_udp_frame_del (self, frame);
     }
 
+    if (self->shared)
+        hev_socks5_udp_relay_del (&self->relay);
+
     hev_task_mutex_lock (self->mutex);
     if (self->pcb) {
         udp_recv (self->pcb, NULL, NULL);
@@ -374,6 +806,12 @@ hev_socks5_session_udp_destruct (HevObject *base)
     }
     hev_task_mutex_unlock (self->mutex);
 
+    if (self->direct_fd >= 0)
+        close (self->direct_fd);
+
+    if (!self->data.direct)
+        hev_socks5_upstream_release (self->data.upstream);
+
     HEV_SOCKS5_CLIENT_UDP_TYPE->destruct (base);
 }
 
@@ -388,6 +826,44 @@ hev_socks5_session_udp_iface (HevObject *base, void *type)
     return HEV_SOCKS5_CLIENT_UDP_TYPE->iface (base, type);
 }
 
+int
+hev_socks5_session_udp_init (void)
+{
+    int size, nums;
+
+    size = hev_config_get_misc_udp_buffer_size ();
+    nums = hev_config_get_misc_udp_copy_buffer_nums ();
+
+    buffer_pool = hev_buffer_pool_new (size, nums * 4);
+    if (!buffer_pool)
+        return -1;
+
+    return 0;
+}
+
+void
+hev_socks5_session_udp_fini (void)
+{
+    if (buffer_pool) {
+        hev_buffer_pool_destroy (buffer_pool);
+        buffer_pool = NULL;
+    }
+}
+
+void
+hev_socks5_session_udp_stats (size_t *queued_bytes, size_t *drop_packets,
+                              size_t *drop_bytes)
+{
+    if (queued_bytes)
+        *queued_bytes = stat_queued_bytes;
+
+    if (drop_packets)
+        *drop_packets = stat_drop_packets;
+
+    if (drop_bytes)
+        *drop_bytes = stat_drop_bytes;
+}
+
 HevObjectClass *
 hev_socks5_session_udp_class (void)
 {
@@ -415,6 +891,8 @@ hev_socks5_session_udp_class (void)
         ckptr->set_upstream_addr = hev_socks5_session_udp_set_upstream_addr;
 
         siptr = &kptr->session;
+        siptr->connector = hev_socks5_session_udp_connect;
+        siptr->handshaker = hev_socks5_session_udp_handshake;
         siptr->splicer = hev_socks5_session_udp_splice;
         siptr->get_task = hev_socks5_session_udp_get_task;
         siptr->set_task = hev_socks5_session_udp_set_task;
@@ -13,6 +13,7 @@
 #include <hev-socks5-client-udp.h>
 
 #include "hev-socks5-session.h"
+#include "hev-socks5-udp-relay.h"
 
 #define HEV_SOCKS5_SESSION_UDP(p) ((HevSocks5SessionUDP *)p)
 #define HEV_SOCKS5_SESSION_UDP_CLASS(p) ((HevSocks5SessionUDPClass *)p)
@@ -28,9 +29,15 @@ struct _HevSocks5SessionUDP
     HevSocks5SessionData data;
 
     HevList frame_list;
+    HevSocks5UDPRelayNode relay;
     struct udp_pcb *pcb;
     HevTaskMutex *mutex;
     int frames;
+    size_t frame_bytes;
+    size_t drops;
+    int shared;
+    int pooled;
+    int direct_fd;
     int addr;
     int port;
 };
@@ -50,4 +57,10 @@ int hev_socks5_session_udp_construct (HevSocks5SessionUDP *self,
 HevSocks5SessionUDP *hev_socks5_session_udp_new (struct udp_pcb *pcb,
                                                  HevTaskMutex *mutex);
 
+int hev_socks5_session_udp_init (void);
+void hev_socks5_session_udp_fini (void);
+
+void hev_socks5_session_udp_stats (size_t *queued_bytes, size_t *drop_packets,
+                                   size_t *drop_bytes);
+
 #endif /* __HEV_SOCKS5_SESSION_UDP_H__ */
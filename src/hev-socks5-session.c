@@ -9,9 +9,12 @@
 
 #include <string.h>
 
+#include <hev-socks5-misc.h>
+
 #include "hev-utils.h"
 #include "hev-logger.h"
 #include "hev-config.h"
+#include "hev-compiler.h"
 #include "hev-socks5-client.h"
 
 #include "hev-socks5-session.h"
@@ -25,10 +28,10 @@ hev_socks5_session_run (HevSocks5Session *self)
 
     LOG_D ("%p socks5 session run", self);
 
-    srv = hev_config_get_socks5_server ();
+    srv = hev_socks5_session_get_upstream (self)->srv;
+    iface = HEV_OBJECT_GET_IFACE (self, HEV_SOCKS5_SESSION_TYPE);
 
-    res = hev_socks5_client_connect (HEV_SOCKS5_CLIENT (self), srv->addr,
-                                     srv->port);
+    res = iface->connector (self, srv);
     if (res < 0) {
         LOG_I ("%p socks5 session connect", self);
         return;
@@ -40,16 +43,37 @@ hev_socks5_session_run (HevSocks5Session *self)
         LOG_D ("%p socks5 client auth %s:%s", self, srv->user, srv->pass);
     }
 
-    res = hev_socks5_client_handshake (HEV_SOCKS5_CLIENT (self), srv->pipeline);
+    res = iface->handshaker (self, srv);
     if (res < 0) {
         LOG_I ("%p socks5 session handshake", self);
         return;
     }
 
-    iface = HEV_OBJECT_GET_IFACE (self, HEV_SOCKS5_SESSION_TYPE);
+    if (!hev_socks5_session_get_direct (self))
+        hev_socks5_upstream_report (hev_socks5_session_get_upstream (self), 1);
+
     iface->splicer (self);
 }
 
+int
+hev_socks5_session_connect (HevSocks5Session *self, HevConfigServer *srv)
+{
+    HevSocks5Upstream *upstream;
+    int fd;
+
+    upstream = hev_socks5_session_get_upstream (self);
+    if (!upstream->addr_count)
+        return hev_socks5_client_connect (HEV_SOCKS5_CLIENT (self), srv->addr,
+                                          srv->port);
+
+    fd = hev_socks5_upstream_connect (upstream, hev_socks5_task_io_yielder,
+                                      self);
+    if (fd < 0)
+        return -1;
+
+    return hev_socks5_client_connect_fd (HEV_SOCKS5_CLIENT (self), fd);
+}
+
 void
 hev_socks5_session_terminate (HevSocks5Session *self)
 {
@@ -80,6 +104,26 @@ hev_socks5_session_get_node (HevSocks5Session *self)
     return iface->get_node (self);
 }
 
+HevSocks5Upstream *
+hev_socks5_session_get_upstream (HevSocks5Session *self)
+{
+    HevSocks5SessionData *sd;
+
+    sd = container_of (hev_socks5_session_get_node (self),
+                       HevSocks5SessionData, node);
+    return sd->upstream;
+}
+
+int
+hev_socks5_session_get_direct (HevSocks5Session *self)
+{
+    HevSocks5SessionData *sd;
+
+    sd = container_of (hev_socks5_session_get_node (self),
+                       HevSocks5SessionData, node);
+    return sd->direct;
+}
+
 int
 hev_socks5_session_bind (HevSocks5 *self, int fd, const struct sockaddr *dest)
 {
@@ -88,7 +132,11 @@ hev_socks5_session_bind (HevSocks5 *self, int fd, const struct sockaddr *dest)
 
     LOG_D ("%p socks5 session bind", self);
 
-    srv = hev_config_get_socks5_server ();
+    /* Direct sockets were bound with the bypass mark already. */
+    if (hev_socks5_session_get_direct (self))
+        return 0;
+
+    srv = hev_socks5_session_get_upstream (self)->srv;
     mark = srv->mark;
 
     if (mark) {
@@ -13,6 +13,8 @@
 #include <hev-task.h>
 
 #include "hev-list.h"
+#include "hev-config.h"
+#include "hev-socks5-upstream.h"
 
 #define HEV_SOCKS5_SESSION(p) ((HevSocks5Session *)p)
 #define HEV_SOCKS5_SESSION_IFACE(p) ((HevSocks5SessionIface *)p)
@@ -27,10 +29,14 @@ struct _HevSocks5SessionData
     HevListNode node;
     HevTask *task;
     HevSocks5Session *self;
+    HevSocks5Upstream *upstream;
+    int direct;
 };
 
 struct _HevSocks5SessionIface
 {
+    int (*connector) (HevSocks5Session *self, HevConfigServer *srv);
+    int (*handshaker) (HevSocks5Session *self, HevConfigServer *srv);
     void (*splicer) (HevSocks5Session *self);
     HevTask *(*get_task) (HevSocks5Session *self);
     void (*set_task) (HevSocks5Session *self, HevTask *task);
@@ -40,10 +46,13 @@ struct _HevSocks5SessionIface
 void *hev_socks5_session_iface (void);
 
 void hev_socks5_session_run (HevSocks5Session *self);
+int hev_socks5_session_connect (HevSocks5Session *self, HevConfigServer *srv);
 void hev_socks5_session_terminate (HevSocks5Session *self);
 
 void hev_socks5_session_set_task (HevSocks5Session *self, HevTask *task);
 HevListNode *hev_socks5_session_get_node (HevSocks5Session *self);
+HevSocks5Upstream *hev_socks5_session_get_upstream (HevSocks5Session *self);
+int hev_socks5_session_get_direct (HevSocks5Session *self);
 
 int hev_socks5_session_bind (HevSocks5 *self, int fd,
                              const struct sockaddr *dest);
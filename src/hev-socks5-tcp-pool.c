@@ -0,0 +1,356 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-tcp-pool.c
+ Author      : hev <r@hev.cc>
+ Copyright   : Copyright (c) 2025 hev
+ Description : Socks5 TCP Connection Pool
+ ============================================================================
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <hev-task.h>
+#include <hev-task-io.h>
+#include <hev-memory-allocator.h>
+
+#include "hev-utils.h"
+#include "hev-config.h"
+#include "hev-logger.h"
+#include "hev-config-const.h"
+#include "hev-socks5-handshake.h"
+
+#include "hev-socks5-tcp-pool.h"
+
+#define POOL_TICK_INTERVAL (1000)
+#define POOL_RETRY_INTERVAL (1000)
+#define POOL_IDLE_TIMEOUT (15000)
+
+typedef struct _HevSocks5TCPPoolEntry HevSocks5TCPPoolEntry;
+typedef struct _HevSocks5TCPPoolRate HevSocks5TCPPoolRate;
+
+struct _HevSocks5TCPPoolEntry
+{
+    HevSocks5Upstream *upstream;
+    unsigned long long stamp;
+    int fd;
+};
+
+struct _HevSocks5TCPPoolRate
+{
+    unsigned int arrivals;
+    unsigned int rate;
+    unsigned int count;
+};
+
+static int running;
+static HevTask *task;
+
+static HevSocks5TCPPoolEntry *entries;
+static int entry_size;
+static int entry_count;
+
+static HevSocks5TCPPoolRate rates[SOCKS5_SERVERS_MAX];
+
+static int
+hev_socks5_tcp_pool_index (HevSocks5Upstream *upstream)
+{
+    return upstream - hev_socks5_upstream_get (0);
+}
+
+/* Arrivals per tick, as a 1/16 fixed point EWMA rounded up. */
+static unsigned int
+hev_socks5_tcp_pool_target (HevSocks5Upstream *upstream)
+{
+    HevSocks5TCPPoolRate *rate;
+    unsigned int target;
+
+    rate = &rates[hev_socks5_tcp_pool_index (upstream)];
+    target = (rate->rate + 15) / 16;
+    if (target > upstream->srv->tcp_pool)
+        target = upstream->srv->tcp_pool;
+
+    return target;
+}
+
+static void
+hev_socks5_tcp_pool_close (HevSocks5TCPPoolEntry *entry)
+{
+    rates[hev_socks5_tcp_pool_index (entry->upstream)].count--;
+    hev_task_del_fd (task, entry->fd);
+    close (entry->fd);
+}
+
+static int
+hev_socks5_tcp_pool_alive (HevSocks5TCPPoolEntry *entry,
+                           unsigned long long now)
+{
+    ssize_t s;
+    char b;
+
+    if ((now - entry->stamp) >= POOL_IDLE_TIMEOUT)
+        return 0;
+
+    /* Nothing is expected before the request, so any byte is an error. */
+    s = recv (entry->fd, &b, sizeof (b), MSG_PEEK | MSG_DONTWAIT);
+    if (s >= 0)
+        return 0;
+    if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+        return 0;
+
+    return 1;
+}
+
+static void
+hev_socks5_tcp_pool_tick (void)
+{
+    int i, count;
+
+    count = hev_socks5_upstream_get_count ();
+    for (i = 0; i < count; i++) {
+        HevSocks5TCPPoolRate *rate = &rates[i];
+
+        rate->rate = (rate->rate * 3 + rate->arrivals * 16) / 4;
+        rate->arrivals = 0;
+    }
+}
+
+static void
+hev_socks5_tcp_pool_prune (void)
+{
+    unsigned long long now;
+    int i, j;
+
+    /* Oldest first, so surplus over the target is reaped oldest first. */
+    now = get_time_msec ();
+    for (i = 0, j = 0; i < entry_count; i++) {
+        HevSocks5TCPPoolEntry *entry = &entries[i];
+        HevSocks5TCPPoolRate *rate;
+
+        rate = &rates[hev_socks5_tcp_pool_index (entry->upstream)];
+        if (hev_socks5_tcp_pool_alive (entry, now) &&
+            (rate->count <= hev_socks5_tcp_pool_target (entry->upstream))) {
+            entries[j++] = *entry;
+            continue;
+        }
+
+        LOG_D ("socks5 tcp pool reap %d", entry->fd);
+        hev_socks5_tcp_pool_close (entry);
+    }
+
+    entry_count = j;
+}
+
+static HevSocks5Upstream *
+hev_socks5_tcp_pool_lacking (void)
+{
+    int i, count;
+
+    count = hev_socks5_upstream_get_count ();
+    for (i = 0; i < count; i++) {
+        HevSocks5Upstream *upstream = hev_socks5_upstream_get (i);
+
+        if (upstream->down)
+            continue;
+
+        if (rates[i].count < hev_socks5_tcp_pool_target (upstream))
+            return upstream;
+    }
+
+    return NULL;
+}
+
+static int
+hev_socks5_tcp_pool_fill (HevSocks5Upstream *upstream)
+{
+    HevConfigServer *srv = upstream->srv;
+    HevSocks5TCPPoolEntry *entry;
+    HevSocks5UpstreamWait wait;
+    int res;
+    int fd;
+
+    hev_socks5_upstream_wait_init (&wait, &running, NULL);
+
+    fd = hev_socks5_upstream_connect (upstream, hev_socks5_upstream_yielder,
+                                      &wait);
+    if (fd < 0) {
+        LOG_D ("socks5 tcp pool connect");
+        return -1;
+    }
+
+    hev_task_add_fd (task, fd, POLLIN | POLLOUT);
+    res = hev_socks5_handshake_auth (fd, srv->user, srv->pass,
+                                     hev_socks5_upstream_yielder, &wait);
+    if (res != 0) {
+        LOG_D ("socks5 tcp pool auth");
+        hev_task_del_fd (task, fd);
+        close (fd);
+        return -1;
+    }
+
+    /* Sessions may have claimed entries while we were yielding. */
+    entry = &entries[entry_count++];
+    entry->upstream = upstream;
+    entry->stamp = get_time_msec ();
+    entry->fd = fd;
+    rates[hev_socks5_tcp_pool_index (upstream)].count++;
+
+    LOG_D ("socks5 tcp pool fill %d", fd);
+
+    return 0;
+}
+
+static void
+hev_socks5_tcp_pool_task_entry (void *data)
+{
+    unsigned long long tick = get_time_msec ();
+    unsigned long long retry = 0;
+
+    LOG_D ("socks5 tcp pool task run");
+
+    while (running) {
+        HevSocks5Upstream *upstream;
+        unsigned long long now;
+
+        now = get_time_msec ();
+        if ((now - tick) >= POOL_TICK_INTERVAL) {
+            hev_socks5_tcp_pool_tick ();
+            tick = now;
+        }
+
+        hev_socks5_tcp_pool_prune ();
+
+        upstream = hev_socks5_tcp_pool_lacking ();
+        if (upstream && (entry_count < entry_size) && (now >= retry)) {
+            if (hev_socks5_tcp_pool_fill (upstream) < 0)
+                retry = get_time_msec () + POOL_RETRY_INTERVAL;
+            continue;
+        }
+
+        hev_task_sleep (POOL_TICK_INTERVAL);
+    }
+
+    while (entry_count)
+        hev_socks5_tcp_pool_close (&entries[--entry_count]);
+}
+
+int
+hev_socks5_tcp_pool_init (void)
+{
+    int stack_size;
+    int count;
+    int i;
+
+    LOG_D ("socks5 tcp pool init");
+
+    count = hev_socks5_upstream_get_count ();
+    for (i = 0; i < count; i++)
+        entry_size += hev_socks5_upstream_get (i)->srv->tcp_pool;
+
+    if (!entry_size)
+        return 0;
+
+    entries = hev_calloc (entry_size, sizeof (HevSocks5TCPPoolEntry));
+    if (!entries) {
+        LOG_E ("socks5 tcp pool entries");
+        goto exit;
+    }
+
+    stack_size = hev_config_get_misc_task_stack_size ();
+    task = hev_task_new (stack_size);
+    if (!task) {
+        LOG_E ("socks5 tcp pool task");
+        goto exit;
+    }
+
+    return 0;
+
+exit:
+    hev_socks5_tcp_pool_fini ();
+    return -1;
+}
+
+void
+hev_socks5_tcp_pool_fini (void)
+{
+    LOG_D ("socks5 tcp pool fini");
+
+    if (task) {
+        hev_task_unref (task);
+        task = NULL;
+    }
+
+    if (entries) {
+        hev_free (entries);
+        entries = NULL;
+    }
+    entry_size = 0;
+    entry_count = 0;
+
+    memset (rates, 0, sizeof (rates));
+}
+
+void
+hev_socks5_tcp_pool_run (void)
+{
+    if (!task)
+        return;
+
+    running = 1;
+    task = hev_task_ref (task);
+    hev_task_run (task, hev_socks5_tcp_pool_task_entry, NULL);
+}
+
+void
+hev_socks5_tcp_pool_stop (void)
+{
+    if (!task || !running)
+        return;
+
+    running = 0;
+    hev_task_wakeup (task);
+    hev_task_join (task);
+}
+
+int
+hev_socks5_tcp_pool_get (HevSocks5Upstream *upstream)
+{
+    unsigned long long now;
+    int index;
+    int i;
+
+    if (!running || !upstream->srv->tcp_pool)
+        return -1;
+
+    index = hev_socks5_tcp_pool_index (upstream);
+    rates[index].arrivals++;
+
+    now = get_time_msec ();
+    for (i = entry_count - 1; i >= 0; i--) {
+        HevSocks5TCPPoolEntry entry = entries[i];
+
+        if (entry.upstream != upstream)
+            continue;
+
+        memmove (&entries[i], &entries[i + 1],
+                 sizeof (HevSocks5TCPPoolEntry) * (entry_count - i - 1));
+        entry_count--;
+
+        if (!hev_socks5_tcp_pool_alive (&entry, now)) {
+            hev_socks5_tcp_pool_close (&entry);
+            continue;
+        }
+
+        rates[index].count--;
+        hev_task_del_fd (task, entry.fd);
+        hev_task_wakeup (task);
+
+        return entry.fd;
+    }
+
+    hev_task_wakeup (task);
+
+    return -1;
+}
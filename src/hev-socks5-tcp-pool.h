@@ -0,0 +1,28 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-tcp-pool.h
+ Author      : hev <r@hev.cc>
+ Copyright   : Copyright (c) 2025 hev
+ Description : Socks5 TCP Connection Pool
+ ============================================================================
+ */
+
+#ifndef __HEV_SOCKS5_TCP_POOL_H__
+#define __HEV_SOCKS5_TCP_POOL_H__
+
+#include "hev-socks5-upstream.h"
+
+int hev_socks5_tcp_pool_init (void);
+void hev_socks5_tcp_pool_fini (void);
+
+void hev_socks5_tcp_pool_run (void);
+void hev_socks5_tcp_pool_stop (void);
+
+/*
+ * Claim a connection to @upstream that already passed method negotiation
+ * and auth, so only the request is left. Every call counts as a session
+ * arrival for sizing the pool. Returns the fd, or -1 if none is ready.
+ */
+int hev_socks5_tcp_pool_get (HevSocks5Upstream *upstream);
+
+#endif /* __HEV_SOCKS5_TCP_POOL_H__ */
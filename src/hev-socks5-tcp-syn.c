@@ -0,0 +1,404 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-tcp-syn.c
+ Author      : hev <r@hev.cc>
+ Copyright   : Copyright (c) 2025 hev
+ Description : Socks5 TCP Connect on SYN
+ ============================================================================
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include <lwip/ip.h>
+#include <lwip/priv/tcp_priv.h>
+
+#include <hev-memory-allocator.h>
+
+#include "hev-utils.h"
+#include "hev-config.h"
+#include "hev-logger.h"
+#include "hev-compiler.h"
+#include "hev-socks5-handshake.h"
+#include "hev-socks5-negative-cache.h"
+
+#include "hev-socks5-tcp-syn.h"
+
+#define SYN_BUCKETS (256)
+#define SYN_MAX_ENTRIES (1024)
+#define SYN_CLAIM_TIMEOUT (5000)
+
+#define TCP_FLAG_SYN (0x02)
+#define TCP_FLAG_ACK (0x10)
+
+static int running;
+static int entry_count;
+static struct netif *netif;
+static HevTaskMutex *mutex;
+static HevList buckets[SYN_BUCKETS];
+
+static int
+hev_socks5_tcp_syn_addr_equal (const ip_addr_t *a, const ip_addr_t *b)
+{
+    if (a->type != b->type)
+        return 0;
+
+    if (IP_IS_V4 (a))
+        return ip_2_ip4 (a)->addr == ip_2_ip4 (b)->addr;
+
+    return !memcmp (ip_2_ip6 (a)->addr, ip_2_ip6 (b)->addr, 16);
+}
+
+static HevSocks5TCPSyn *
+hev_socks5_tcp_syn_lookup (const HevSocks5TCPSynKey *key)
+{
+    HevListNode *node;
+
+    node = hev_list_first (&buckets[key->hash % SYN_BUCKETS]);
+    for (; node; node = hev_list_node_next (node)) {
+        HevSocks5TCPSyn *self = container_of (node, HevSocks5TCPSyn, node);
+
+        if ((self->key.hash != key->hash) ||
+            (self->key.sport != key->sport) || (self->key.dport != key->dport))
+            continue;
+
+        if (hev_socks5_tcp_syn_addr_equal (&self->key.src, &key->src) &&
+            hev_socks5_tcp_syn_addr_equal (&self->key.dst, &key->dst))
+            return self;
+    }
+
+    return NULL;
+}
+
+static void
+hev_socks5_tcp_syn_unhash (HevSocks5TCPSyn *self)
+{
+    if (!self->hashed)
+        return;
+
+    hev_list_del (&buckets[self->key.hash % SYN_BUCKETS], &self->node);
+    self->hashed = 0;
+    entry_count--;
+}
+
+static void
+hev_socks5_tcp_syn_deliver (HevSocks5TCPSyn *self)
+{
+    struct pbuf *syn = self->syn;
+
+    self->syn = NULL;
+
+    hev_task_mutex_lock (mutex);
+    if (self->fd >= 0) {
+        /* Now lwIP answers with the SYN-ACK. */
+        if (netif->input (syn, netif) != ERR_OK)
+            pbuf_free (syn);
+    } else {
+        tcp_rst (NULL, 0, self->key.seqno + 1, &self->key.dst,
+                 &self->key.src, self->key.dport, self->key.sport);
+        pbuf_free (syn);
+    }
+    hev_task_mutex_unlock (mutex);
+}
+
+static int
+hev_socks5_tcp_syn_connect (HevSocks5TCPSyn *self)
+{
+    HevConfigServer *srv = self->upstream->srv;
+    HevSocks5UpstreamWait wait;
+    HevSocks5Addr addr;
+    int auth;
+    int rep;
+    int res;
+    int fd;
+    ssize_t s;
+
+    res = hev_socks5_addr_from_lwip (&addr, &self->key.dst, self->key.dport);
+    if (res < 0)
+        return -1;
+
+    hev_socks5_upstream_wait_init (&wait, &running, &self->released);
+
+    fd = hev_socks5_upstream_connect (self->upstream,
+                                      hev_socks5_upstream_yielder, &wait);
+    if (fd < 0)
+        return -1;
+
+    hev_task_add_fd (self->task, fd, POLLIN | POLLOUT);
+
+    /* Not the core client: rejections feed the negative cache by code. */
+    auth = srv->pipeline;
+    if (!auth) {
+        res = hev_socks5_handshake_auth (fd, srv->user, srv->pass,
+                                         hev_socks5_upstream_yielder, &wait);
+        if (res < 0)
+            goto exit;
+    }
+
+    s = hev_socks5_handshake_connect_early (fd, auth, srv->user, srv->pass,
+                                            &addr, NULL, 0, &rep,
+                                            hev_socks5_upstream_yielder,
+                                            &wait);
+    if (s < 0) {
+        if (rep > 0)
+            hev_socks5_negative_cache_add (self->upstream, &addr, rep);
+        goto exit;
+    }
+
+    hev_task_del_fd (self->task, fd);
+    hev_socks5_upstream_report (self->upstream, 1);
+
+    return fd;
+
+exit:
+    hev_task_del_fd (self->task, fd);
+    close (fd);
+    return -1;
+}
+
+static void
+hev_socks5_tcp_syn_task_entry (void *data)
+{
+    HevSocks5TCPSyn *self = data;
+    int remaining = SYN_CLAIM_TIMEOUT;
+
+    self->fd = hev_socks5_tcp_syn_connect (self);
+    self->done = 1;
+
+    LOG_D ("%p socks5 tcp syn connect %d", self, self->fd);
+
+    if (self->syn) {
+        hev_socks5_tcp_syn_deliver (self);
+        if (self->fd < 0)
+            remaining = 0;
+    }
+
+    if (self->waiter)
+        hev_task_wakeup (self->waiter);
+
+    /* Attached entries belong to their session until it releases them. */
+    while (!self->released) {
+        if (self->attached)
+            hev_task_yield (HEV_TASK_WAITIO);
+        else if (running && (remaining > 0))
+            remaining = hev_task_sleep (remaining);
+        else
+            break;
+    }
+
+    hev_socks5_tcp_syn_unhash (self);
+    if (self->syn)
+        pbuf_free (self->syn);
+    if (self->fd >= 0)
+        close (self->fd);
+    if (!self->attached)
+        hev_socks5_upstream_release (self->upstream);
+    hev_free (self);
+}
+
+int
+hev_socks5_tcp_syn_parse (struct pbuf *p, HevSocks5TCPSynKey *key)
+{
+    uint8_t buf[60];
+    int len, off;
+
+    len = pbuf_copy_partial (p, buf, sizeof (buf), 0);
+    if (len < 20)
+        return -1;
+
+    memset (key, 0, sizeof (HevSocks5TCPSynKey));
+
+    switch (buf[0] >> 4) {
+    case 4:
+        /* Fragments never carry a bare SYN worth racing for. */
+        if ((buf[9] != IP_PROTO_TCP) || (buf[6] & 0x3f) || buf[7])
+            return -1;
+        off = (buf[0] & 0x0f) * 4;
+        key->src.type = IPADDR_TYPE_V4;
+        key->dst.type = IPADDR_TYPE_V4;
+        memcpy (&ip_2_ip4 (&key->src)->addr, &buf[12], 4);
+        memcpy (&ip_2_ip4 (&key->dst)->addr, &buf[16], 4);
+        break;
+    case 6:
+        if ((len < 40) || (buf[6] != IP_PROTO_TCP))
+            return -1;
+        off = 40;
+        key->src.type = IPADDR_TYPE_V6;
+        key->dst.type = IPADDR_TYPE_V6;
+        memcpy (ip_2_ip6 (&key->src)->addr, &buf[8], 16);
+        memcpy (ip_2_ip6 (&key->dst)->addr, &buf[24], 16);
+        break;
+    default:
+        return -1;
+    }
+
+    len = pbuf_copy_partial (p, buf, 14, off);
+    if (len < 14)
+        return -1;
+
+    if ((buf[13] & (TCP_FLAG_SYN | TCP_FLAG_ACK)) != TCP_FLAG_SYN)
+        return -1;
+
+    key->sport = (buf[0] << 8) | buf[1];
+    key->dport = (buf[2] << 8) | buf[3];
+    memcpy (&key->seqno, &buf[4], 4);
+    key->seqno = ntohl (key->seqno);
+    key->hash = get_flow_hash (&key->src, key->sport, &key->dst, key->dport,
+                               IP_PROTO_TCP);
+
+    return 0;
+}
+
+int
+hev_socks5_tcp_syn_input (struct pbuf *p, const HevSocks5TCPSynKey *key)
+{
+    HevSocks5TCPSyn *self;
+    int stack_size;
+    int mode;
+
+    if (!running)
+        return 0;
+
+    /* Retransmitted SYNs of a held flow are answered once it is decided. */
+    self = hev_socks5_tcp_syn_lookup (key);
+    if (self) {
+        if (!self->syn)
+            return 0;
+        pbuf_free (p);
+        return 1;
+    }
+
+    if (entry_count >= SYN_MAX_ENTRIES)
+        return 0;
+
+    self = hev_malloc0 (sizeof (HevSocks5TCPSyn));
+    if (!self)
+        return 0;
+
+    stack_size = hev_config_get_misc_task_stack_size ();
+    self->task = hev_task_new (stack_size);
+    if (!self->task) {
+        hev_free (self);
+        return 0;
+    }
+
+    self->upstream = hev_socks5_upstream_select (key->hash);
+    self->key = *key;
+    self->fd = -1;
+
+    hev_list_add_tail (&buckets[key->hash % SYN_BUCKETS], &self->node);
+    self->hashed = 1;
+    entry_count++;
+
+    LOG_D ("%p socks5 tcp syn new", self);
+
+    mode = hev_config_get_misc_tcp_syn_connect ();
+    if (mode == HEV_CONFIG_TCP_SYN_CONNECT_HOLD)
+        self->syn = p;
+
+    hev_task_run (self->task, hev_socks5_tcp_syn_task_entry, self);
+
+    return !!self->syn;
+}
+
+HevSocks5TCPSyn *
+hev_socks5_tcp_syn_claim (struct tcp_pcb *pcb)
+{
+    HevSocks5TCPSynKey key;
+    HevSocks5TCPSyn *self;
+
+    if (!entry_count)
+        return NULL;
+
+    key.src = pcb->remote_ip;
+    key.dst = pcb->local_ip;
+    key.sport = pcb->remote_port;
+    key.dport = pcb->local_port;
+    key.hash = get_flow_hash (&key.src, key.sport, &key.dst, key.dport,
+                              IP_PROTO_TCP);
+    self = hev_socks5_tcp_syn_lookup (&key);
+    if (!self || self->attached)
+        return NULL;
+
+    /* A later connection may reuse the same four-tuple. */
+    hev_socks5_tcp_syn_unhash (self);
+    self->attached = 1;
+
+    return self;
+}
+
+int
+hev_socks5_tcp_syn_wait (HevSocks5TCPSyn *self, HevTaskIOYielder yielder,
+                         void *yielder_data)
+{
+    int fd;
+
+    while (!self->done) {
+        self->waiter = hev_task_self ();
+        if (yielder (HEV_TASK_WAITIO, yielder_data) < 0) {
+            self->waiter = NULL;
+            return -1;
+        }
+    }
+    self->waiter = NULL;
+
+    fd = self->fd;
+    self->fd = -1;
+
+    return fd;
+}
+
+void
+hev_socks5_tcp_syn_release (HevSocks5TCPSyn *self)
+{
+    self->released = 1;
+    hev_task_wakeup (self->task);
+}
+
+int
+hev_socks5_tcp_syn_init (struct netif *_netif, HevTaskMutex *_mutex)
+{
+    LOG_D ("socks5 tcp syn init");
+
+    if (hev_config_get_misc_tcp_syn_connect () ==
+        HEV_CONFIG_TCP_SYN_CONNECT_OFF)
+        return 0;
+
+    netif = _netif;
+    mutex = _mutex;
+    running = 1;
+
+    return 0;
+}
+
+void
+hev_socks5_tcp_syn_fini (void)
+{
+    LOG_D ("socks5 tcp syn fini");
+
+    running = 0;
+    netif = NULL;
+    mutex = NULL;
+}
+
+void
+hev_socks5_tcp_syn_stop (void)
+{
+    int i;
+
+    if (!running)
+        return;
+
+    running = 0;
+    for (i = 0; i < SYN_BUCKETS; i++) {
+        HevListNode *node = hev_list_first (&buckets[i]);
+
+        for (; node; node = hev_list_node_next (node)) {
+            HevSocks5TCPSyn *self;
+
+            self = container_of (node, HevSocks5TCPSyn, node);
+            hev_task_wakeup (self->task);
+        }
+    }
+}
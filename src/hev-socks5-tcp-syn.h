@@ -0,0 +1,82 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-tcp-syn.h
+ Author      : hev <r@hev.cc>
+ Copyright   : Copyright (c) 2025 hev
+ Description : Socks5 TCP Connect on SYN
+ ============================================================================
+ */
+
+#ifndef __HEV_SOCKS5_TCP_SYN_H__
+#define __HEV_SOCKS5_TCP_SYN_H__
+
+#include <lwip/tcp.h>
+#include <lwip/netif.h>
+
+#include <hev-task.h>
+#include <hev-task-io.h>
+#include <hev-task-mutex.h>
+
+#include "hev-list.h"
+#include "hev-socks5-upstream.h"
+
+typedef struct _HevSocks5TCPSyn HevSocks5TCPSyn;
+typedef struct _HevSocks5TCPSynKey HevSocks5TCPSynKey;
+
+struct _HevSocks5TCPSynKey
+{
+    ip_addr_t src;
+    ip_addr_t dst;
+    u16_t sport;
+    u16_t dport;
+    u32_t seqno;
+    unsigned int hash;
+};
+
+struct _HevSocks5TCPSyn
+{
+    HevListNode node;
+
+    HevSocks5Upstream *upstream;
+    HevTask *task;
+    HevTask *waiter;
+    struct pbuf *syn;
+    HevSocks5TCPSynKey key;
+
+    int fd;
+    int released;
+    unsigned char done;
+    unsigned char hashed;
+    unsigned char attached;
+};
+
+int hev_socks5_tcp_syn_init (struct netif *netif, HevTaskMutex *mutex);
+void hev_socks5_tcp_syn_fini (void);
+
+void hev_socks5_tcp_syn_stop (void);
+
+/*
+ * Fill @key from a packet read from the tunnel if it is a bare client SYN
+ * (SYN without ACK). Returns -1 for any other packet.
+ */
+int hev_socks5_tcp_syn_parse (struct pbuf *p, HevSocks5TCPSynKey *key);
+
+/*
+ * Handle the client SYN @p before lwIP does: start the upstream connect and
+ * CONNECT for its flow. Returns 1 if the packet was taken (held SYN in hold
+ * mode), else 0 and the caller feeds lwIP.
+ */
+int hev_socks5_tcp_syn_input (struct pbuf *p, const HevSocks5TCPSynKey *key);
+
+/*
+ * Attach the connect started for the flow of @pcb, if any. The upstream
+ * and its session accounting move to the caller.
+ */
+HevSocks5TCPSyn *hev_socks5_tcp_syn_claim (struct tcp_pcb *pcb);
+
+/* Wait for the CONNECT to finish and take its socket, or -1 on failure. */
+int hev_socks5_tcp_syn_wait (HevSocks5TCPSyn *self, HevTaskIOYielder yielder,
+                             void *yielder_data);
+void hev_socks5_tcp_syn_release (HevSocks5TCPSyn *self);
+
+#endif /* __HEV_SOCKS5_TCP_SYN_H__ */
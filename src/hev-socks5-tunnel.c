@@ -7,18 +7,28 @@
  ============================================================================
  */
 
+#include <poll.h>
 #include <errno.h>
 #include <signal.h>
 #include <string.h>
 #include <stdatomic.h>
 #include <sys/ioctl.h>
 
+#if defined(__linux__)
+#include <sys/epoll.h>
+#define CONTROL_EPOLL
+#elif defined(__APPLE__) || defined(__FreeBSD__)
+#include <sys/event.h>
+#define CONTROL_KQUEUE
+#endif
+
 #include <lwip/tcp.h>
 #include <lwip/udp.h>
 #include <lwip/nd6.h>
 #include <lwip/netif.h>
 #include <lwip/ip4_frag.h>
 #include <lwip/ip6_frag.h>
+#include <lwip/inet_chksum.h>
 #include <lwip/priv/tcp_priv.h>
 
 #include <hev-task.h>
@@ -28,17 +38,30 @@
 #include <hev-memory-allocator.h>
 
 #include "hev-exec.h"
+#include "hev-bypass.h"
 #include "hev-config.h"
 #include "hev-logger.h"
 #include "hev-tunnel.h"
 #include "hev-compiler.h"
 #include "hev-mapped-dns.h"
 #include "hev-config-const.h"
+#include "hev-dns-forwarder.h"
 #include "hev-socks5-session-tcp.h"
 #include "hev-socks5-session-udp.h"
+#include "hev-socks5-upstream.h"
+#include "hev-socks5-udp-pool.h"
+#include "hev-socks5-tcp-pool.h"
+#include "hev-socks5-tcp-syn.h"
+#include "hev-socks5-negative-cache.h"
+#include "hev-socks5-admission.h"
+#include "hev-socks5-udp-relay.h"
 
 #include "hev-socks5-tunnel.h"
 
+#ifndef POLLRDHUP
+#define POLLRDHUP 0
+#endif
+
 enum
 {
     SYNC_SEND = 1 << 0,
@@ -47,6 +70,30 @@ enum
     SYNC_STOP = 1 << 3,
 };
 
+/* Replies a DNS over TCP connection may have waiting for the client. */
+#define DNS_TCP_REPLIES (16)
+
+typedef struct _MappedDNSTCP MappedDNSTCP;
+
+/*
+ * A DNS over TCP connection to the mapped address. Queries wait in queue
+ * until whole, replies that don't fit the send buffer wait in replies,
+ * each behind its length, and go out as the client acknowledges data.
+ */
+struct _MappedDNSTCP
+{
+    HevListNode node;
+    HevDNSForwarderPeer peer;
+    struct tcp_pcb *pcb;
+    struct pbuf *queue;
+    uint8_t *replies[DNS_TCP_REPLIES];
+    int head;
+    int count;
+    int sent;
+    int busy;
+    int failed;
+};
+
 static int run;
 static atomic_int tsync;
 
@@ -63,12 +110,24 @@ static size_t stat_rx_bytes;
 static struct netif *netif;
 static struct tcp_pcb *tcp;
 static struct udp_pcb *udp;
+static struct pbuf *dns_reply;
 
 static HevTaskMutex mutex;
 static HevTask *task_event;
 static HevTask *task_lwip_io;
 static HevTask *task_lwip_timer;
+static HevTask *task_control;
 static HevList session_set;
+static HevList dns_tcp_set;
+
+#if defined(CONTROL_EPOLL) || defined(CONTROL_KQUEUE)
+static int control_queue = -1;
+#else
+static struct pollfd *control_fds;
+static HevListNode **control_nodes;
+static int control_count;
+static int control_size;
+#endif
 
 static int
 task_io_yielder (HevTaskYieldType type, void *data)
@@ -158,6 +217,108 @@ hev_socks5_tunnel_update_session (HevListNode *node)
     hev_list_add_tail (&session_set, node);
 }
 
+/*
+ * Control connections sit in their own kernel event queue, each carrying
+ * its session node, and only the queue is watched by the control task. A
+ * wakeup then touches just the sessions whose connection signalled.
+ */
+#if defined(CONTROL_EPOLL)
+
+int
+hev_socks5_tunnel_add_control (int fd, HevListNode *node)
+{
+    struct epoll_event ev = { 0 };
+
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = node;
+
+    return epoll_ctl (control_queue, EPOLL_CTL_ADD, fd, &ev);
+}
+
+void
+hev_socks5_tunnel_del_control (int fd)
+{
+    struct epoll_event ev = { 0 };
+
+    epoll_ctl (control_queue, EPOLL_CTL_DEL, fd, &ev);
+}
+
+#elif defined(CONTROL_KQUEUE)
+
+int
+hev_socks5_tunnel_add_control (int fd, HevListNode *node)
+{
+    struct kevent ev;
+
+    EV_SET (&ev, fd, EVFILT_READ, EV_ADD, 0, 0, node);
+
+    return kevent (control_queue, &ev, 1, NULL, 0, NULL);
+}
+
+void
+hev_socks5_tunnel_del_control (int fd)
+{
+    struct kevent ev;
+
+    EV_SET (&ev, fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+    kevent (control_queue, &ev, 1, NULL, 0, NULL);
+}
+
+#else
+
+int
+hev_socks5_tunnel_add_control (int fd, HevListNode *node)
+{
+    if (control_count == control_size) {
+        struct pollfd *fds;
+        HevListNode **nodes;
+        int size;
+
+        size = control_size ? control_size * 2 : 64;
+        fds = hev_realloc (control_fds, sizeof (struct pollfd) * size);
+        if (!fds)
+            return -1;
+        control_fds = fds;
+
+        nodes = hev_realloc (control_nodes, sizeof (HevListNode *) * size);
+        if (!nodes)
+            return -1;
+        control_nodes = nodes;
+
+        control_size = size;
+    }
+
+    if (hev_task_add_fd (task_control, fd, POLLIN | POLLRDHUP) < 0)
+        return -1;
+
+    control_fds[control_count].fd = fd;
+    control_fds[control_count].events = POLLIN | POLLRDHUP;
+    control_fds[control_count].revents = 0;
+    control_nodes[control_count] = node;
+    control_count++;
+
+    return 0;
+}
+
+void
+hev_socks5_tunnel_del_control (int fd)
+{
+    int i;
+
+    for (i = 0; i < control_count; i++) {
+        if (control_fds[i].fd != fd)
+            continue;
+
+        hev_task_del_fd (task_control, fd);
+        control_count--;
+        control_fds[i] = control_fds[control_count];
+        control_nodes[i] = control_nodes[control_count];
+        break;
+    }
+}
+
+#endif
+
 static void
 hev_socks5_session_task_entry (void *data)
 {
@@ -169,6 +330,332 @@ hev_socks5_session_task_entry (void *data)
     hev_object_unref (HEV_OBJECT (s));
 }
 
+static int
+mapped_dns_match (const ip_addr_t *addr, u16_t port)
+{
+    const unsigned char *addr6;
+
+    if (port != hev_config_get_mapdns_port ())
+        return 0;
+
+    if (IP_IS_V4 (addr))
+        return ip_2_ip4 (addr)->addr == hev_config_get_mapdns_address ();
+
+    addr6 = hev_config_get_mapdns_address6 ();
+    return addr6 && !memcmp (ip_2_ip6 (addr)->addr, addr6, 16);
+}
+
+static void
+mapped_dns_peer (HevDNSForwarderPeer *peer, const ip_addr_t *saddr,
+                 u16_t sport, const ip_addr_t *daddr, u16_t dport)
+{
+    if (IP_IS_V4 (saddr)) {
+        peer->ipv6 = 0;
+        memcpy (peer->saddr, &ip_2_ip4 (saddr)->addr, 4);
+        memcpy (peer->daddr, &ip_2_ip4 (daddr)->addr, 4);
+    } else {
+        peer->ipv6 = 1;
+        memcpy (peer->saddr, ip_2_ip6 (saddr)->addr, 16);
+        memcpy (peer->daddr, ip_2_ip6 (daddr)->addr, 16);
+    }
+
+    peer->sport = htons (sport);
+    peer->dport = htons (dport);
+    peer->tcp = 0;
+}
+
+/*
+ * Answer @req into @res, or hand it to the resolver when it has nothing to
+ * map. Without a resolver such queries are refused, an empty answer would
+ * tell the client the name has no records. Returns the reply length, 0 if
+ * the resolver took it, or -1.
+ */
+static int
+mapped_dns_reply (HevMappedDNS *dns, const HevDNSForwarderPeer *peer,
+                  void *req, int len, void *res, int size)
+{
+    if (hev_mapped_dns_maps (dns, req, len))
+        return hev_mapped_dns_handle (dns, req, len, res, size);
+
+    if (hev_dns_forwarder_query (peer, req, len) == 0)
+        return 0;
+
+    return hev_mapped_dns_error (req, len, res, size,
+                                 HEV_MAPPED_DNS_RCODE_REFUSED);
+}
+
+static MappedDNSTCP *
+mapped_dns_tcp_find (const HevDNSForwarderPeer *peer)
+{
+    HevListNode *node;
+
+    node = hev_list_first (&dns_tcp_set);
+    for (; node; node = hev_list_node_next (node)) {
+        MappedDNSTCP *conn = container_of (node, MappedDNSTCP, node);
+        HevDNSForwarderPeer *p = &conn->peer;
+
+        if ((p->ipv6 == peer->ipv6) && (p->sport == peer->sport) &&
+            (p->dport == peer->dport) &&
+            !memcmp (p->saddr, peer->saddr, sizeof (p->saddr)) &&
+            !memcmp (p->daddr, peer->daddr, sizeof (p->daddr)))
+            return conn;
+    }
+
+    return NULL;
+}
+
+static void
+mapped_dns_tcp_free (MappedDNSTCP *conn)
+{
+    int i;
+
+    for (i = 0; i < conn->count; i++)
+        hev_free (conn->replies[(conn->head + i) % DNS_TCP_REPLIES]);
+
+    if (conn->queue)
+        pbuf_free (conn->queue);
+
+    hev_list_del (&dns_tcp_set, &conn->node);
+    hev_free (conn);
+}
+
+static err_t
+mapped_dns_tcp_close (MappedDNSTCP *conn)
+{
+    struct tcp_pcb *pcb = conn->pcb;
+
+    tcp_arg (pcb, NULL);
+    tcp_recv (pcb, NULL);
+    tcp_sent (pcb, NULL);
+    tcp_err (pcb, NULL);
+    mapped_dns_tcp_free (conn);
+
+    if (tcp_close (pcb) == ERR_OK)
+        return ERR_OK;
+
+    tcp_abort (pcb);
+    return ERR_ABRT;
+}
+
+/*
+ * Write out queued replies as far as the send buffer takes them, a long
+ * one in pieces. -1 if the connection can't be written to.
+ */
+static int
+mapped_dns_tcp_drain (MappedDNSTCP *conn)
+{
+    struct tcp_pcb *pcb = conn->pcb;
+
+    while (conn->count) {
+        uint8_t *r = conn->replies[conn->head];
+        int len = 2 + ((r[0] << 8) | r[1]);
+        int n = len - conn->sent;
+        u8_t flags = TCP_WRITE_FLAG_COPY;
+        err_t err;
+
+        if (n > tcp_sndbuf (pcb))
+            n = tcp_sndbuf (pcb);
+        if (!n)
+            break;
+
+        if ((conn->sent + n) < len)
+            flags |= TCP_WRITE_FLAG_MORE;
+        err = tcp_write (pcb, &r[conn->sent], n, flags);
+        if (err == ERR_MEM)
+            break;
+        if (err != ERR_OK)
+            return -1;
+
+        conn->sent += n;
+        if (conn->sent < len)
+            break;
+
+        hev_free (r);
+        conn->head = (conn->head + 1) % DNS_TCP_REPLIES;
+        conn->count--;
+        conn->sent = 0;
+    }
+
+    return 0;
+}
+
+/*
+ * Send the reply in @buf behind its length, straight away if nothing is
+ * queued before it and it fits, else after the queued ones. -1 if it can
+ * neither be written nor queued.
+ */
+static int
+mapped_dns_tcp_send (MappedDNSTCP *conn, const void *buf, int len)
+{
+    struct tcp_pcb *pcb = conn->pcb;
+    uint8_t *r;
+
+    if (!conn->count && (tcp_sndbuf (pcb) >= (2 + len))) {
+        uint8_t hdr[2] = { len >> 8, len };
+        u8_t flags = TCP_WRITE_FLAG_COPY | TCP_WRITE_FLAG_MORE;
+        err_t err;
+
+        err = tcp_write (pcb, hdr, 2, flags);
+        if (err == ERR_OK) {
+            err = tcp_write (pcb, buf, len, TCP_WRITE_FLAG_COPY);
+            return (err == ERR_OK) ? 0 : -1;
+        }
+        if (err != ERR_MEM)
+            return -1;
+    }
+
+    if (conn->count == DNS_TCP_REPLIES)
+        return -1;
+
+    r = hev_malloc (2 + len);
+    if (!r)
+        return -1;
+
+    r[0] = len >> 8;
+    r[1] = len;
+    memcpy (&r[2], buf, len);
+    conn->replies[(conn->head + conn->count) % DNS_TCP_REPLIES] = r;
+    conn->count++;
+
+    return mapped_dns_tcp_drain (conn);
+}
+
+/*
+ * Answer every whole query waiting, each behind a 16-bit length, while no
+ * reply is queued. What is left waits for more data or for the client to
+ * acknowledge the replies. A query that can't be answered gets SERVFAIL,
+ * one too long to ever be read whole closes the connection.
+ */
+static err_t
+mapped_dns_tcp_process (MappedDNSTCP *conn)
+{
+    HevMappedDNS *dns = hev_mapped_dns_get ();
+    struct tcp_pcb *pcb = conn->pcb;
+    struct pbuf *b;
+    uint8_t *req;
+    uint8_t *r;
+    int size;
+
+    if (mapped_dns_tcp_drain (conn) < 0)
+        return mapped_dns_tcp_close (conn);
+
+    size = hev_config_get_tunnel_mtu () - IP_HLEN - TCP_HLEN;
+    if (size < UDP_BUF_SIZE)
+        size = UDP_BUF_SIZE;
+
+    /* The reply, then room for the query. */
+    b = pbuf_alloc (PBUF_RAW, size + size, PBUF_RAM);
+    if (!b) {
+        tcp_output (pcb);
+        return ERR_OK;
+    }
+
+    r = b->payload;
+    req = r + size;
+
+    /* A cached answer from the resolver is sent while the query is. */
+    conn->busy = 1;
+    while (!conn->count && conn->queue && (conn->queue->tot_len >= 2)) {
+        struct pbuf *queue = conn->queue;
+        int len;
+        int res;
+
+        pbuf_copy_partial (queue, req, 2, 0);
+        len = (req[0] << 8) | req[1];
+        if (len > size)
+            goto close;
+        if (queue->tot_len < (2 + len))
+            break;
+
+        pbuf_copy_partial (queue, req, len, 2);
+        res = mapped_dns_reply (dns, &conn->peer, req, len, r, size);
+        if (conn->failed)
+            goto close;
+        if (res < 0)
+            res = hev_mapped_dns_error (req, len, r, size,
+                                        HEV_MAPPED_DNS_RCODE_SERVFAIL);
+        if (res < 0)
+            goto close;
+        if ((res > 0) && (mapped_dns_tcp_send (conn, r, res) < 0))
+            goto close;
+
+        queue = pbuf_free_header (queue, 2);
+        conn->queue = pbuf_free_header (queue, len);
+        tcp_recved (pcb, 2);
+        tcp_recved (pcb, len);
+    }
+    conn->busy = 0;
+
+    pbuf_free (b);
+    tcp_output (pcb);
+
+    return ERR_OK;
+
+close:
+    LOG_D ("%p mapped dns tcp close", pcb);
+    pbuf_free (b);
+    return mapped_dns_tcp_close (conn);
+}
+
+static err_t
+mapped_dns_tcp_recv_handler (void *arg, struct tcp_pcb *pcb, struct pbuf *p,
+                             err_t err)
+{
+    MappedDNSTCP *conn = arg;
+
+    if (!p)
+        return mapped_dns_tcp_close (conn);
+
+    if (conn->queue)
+        pbuf_cat (conn->queue, p);
+    else
+        conn->queue = p;
+
+    return mapped_dns_tcp_process (conn);
+}
+
+static err_t
+mapped_dns_tcp_sent_handler (void *arg, struct tcp_pcb *pcb, u16_t len)
+{
+    return mapped_dns_tcp_process (arg);
+}
+
+static void
+mapped_dns_tcp_err_handler (void *arg, err_t err)
+{
+    mapped_dns_tcp_free (arg);
+}
+
+/*
+ * DNS over TCP to the mapped address is answered right here in the lwIP
+ * callbacks, pipelined queries included, with no session behind it.
+ */
+static err_t
+mapped_dns_tcp_accept (struct tcp_pcb *pcb)
+{
+    MappedDNSTCP *conn;
+
+    LOG_D ("%p mapped dns tcp accept", pcb);
+
+    conn = hev_malloc0 (sizeof (MappedDNSTCP));
+    if (!conn)
+        return ERR_MEM;
+
+    conn->pcb = pcb;
+    mapped_dns_peer (&conn->peer, &pcb->remote_ip, pcb->remote_port,
+                     &pcb->local_ip, pcb->local_port);
+    conn->peer.tcp = 1;
+    hev_list_add_tail (&dns_tcp_set, &conn->node);
+
+    tcp_arg (pcb, conn);
+    tcp_recv (pcb, mapped_dns_tcp_recv_handler);
+    tcp_sent (pcb, mapped_dns_tcp_sent_handler);
+    tcp_err (pcb, mapped_dns_tcp_err_handler);
+    hev_task_wakeup (task_lwip_timer);
+
+    return ERR_OK;
+}
+
 static err_t
 tcp_accept_handler (void *arg, struct tcp_pcb *pcb, err_t err)
 {
@@ -183,6 +670,10 @@ tcp_accept_handler (void *arg, struct tcp_pcb *pcb, err_t err)
     if (!run)
         return ERR_RST;
 
+    if (hev_mapped_dns_get () &&
+        mapped_dns_match (&pcb->local_ip, pcb->local_port))
+        return mapped_dns_tcp_accept (pcb);
+
     tcp = hev_socks5_session_tcp_new (pcb, &mutex);
     if (!tcp)
         return ERR_MEM;
@@ -208,17 +699,26 @@ dns_recv_handler (void *arg, struct udp_pcb *pcb, struct pbuf *p,
                   const ip_addr_t *addr, u16_t port)
 {
     HevMappedDNS *dns = arg;
+    HevDNSForwarderPeer peer;
     struct pbuf *b;
+    int size;
     int res;
 
     LOG_D ("%p mapped dns handle", dns);
 
-    b = pbuf_alloc (PBUF_TRANSPORT, UDP_BUF_SIZE, PBUF_RAM);
+    mapped_dns_peer (&peer, addr, port, &pcb->local_ip, pcb->local_port);
+
+    size = hev_config_get_tunnel_mtu () - IP_HLEN - UDP_HLEN;
+    if (size < UDP_BUF_SIZE)
+        size = UDP_BUF_SIZE;
+
+    b = pbuf_alloc (PBUF_TRANSPORT, size, PBUF_RAM);
     if (!b)
         goto exit;
 
-    res = hev_mapped_dns_handle (dns, p->payload, p->len, b->payload, b->len);
-    if (res < 0)
+    res = mapped_dns_reply (dns, &peer, p->payload, p->len, b->payload,
+                            b->len);
+    if (res <= 0)
         goto free;
 
     b->len = res;
@@ -249,13 +749,14 @@ udp_recv_handler (void *arg, struct udp_pcb *pcb, struct pbuf *p,
     }
 
     dns = hev_mapped_dns_get ();
-    if (dns && addr->type == IPADDR_TYPE_V4) {
-        int faddr = hev_config_get_mapdns_address ();
-        int fport = hev_config_get_mapdns_port ();
-        if (fport == port && faddr == ip_2_ip4 (addr)->addr) {
-            udp_recv (pcb, dns_recv_handler, dns);
-            return;
-        }
+    if (dns && mapped_dns_match (addr, port)) {
+        udp_recv (pcb, dns_recv_handler, dns);
+        return;
+    }
+
+    if (hev_socks5_admission_udp (addr) < 0) {
+        udp_remove (pcb);
+        return;
     }
 
     udp = hev_socks5_session_udp_new (pcb, &mutex);
@@ -301,76 +802,404 @@ event_task_entry (void *data)
         hev_socks5_session_terminate (sd->self);
     }
 
+    hev_task_wakeup (task_control);
+    hev_socks5_tcp_syn_stop ();
+    hev_socks5_tcp_pool_stop ();
+    hev_socks5_udp_pool_stop ();
+    hev_dns_forwarder_stop ();
+    hev_socks5_upstream_stop ();
+    hev_socks5_udp_relay_stop ();
+
     hev_task_join (task_lwip_io);
     hev_task_join (task_lwip_timer);
+    hev_task_join (task_control);
     hev_task_del_fd (task_event, event_fds[0]);
 }
 
+/*
+ * Wrap the DNS message already in dns_reply, after room for the IP and
+ * UDP headers, into a datagram back to @peer and write it to the TUN.
+ */
 static void
-lwip_io_task_entry (void *data)
+mapped_dns_output (const HevDNSForwarderPeer *peer, int size)
 {
-    const unsigned int mtu = hev_config_get_tunnel_mtu ();
-
-    LOG_D ("socks5 tunnel lwip task run");
-
-    hev_tunnel_add_task (tun_fd, task_lwip_io);
+    uint8_t *r = dns_reply->payload;
+    u16_t chksum;
+    uint8_t *u;
+    int rhlen;
+    int ulen;
+    int len;
+
+    rhlen = peer->ipv6 ? IP6_HLEN : IP_HLEN;
+    u = r + rhlen;
+
+    /* Swapped ports, the checksum is filled in below. */
+    ulen = UDP_HLEN + size;
+    memcpy (&u[0], &peer->dport, 2);
+    memcpy (&u[2], &peer->sport, 2);
+    u[4] = ulen >> 8;
+    u[5] = ulen;
+    memset (&u[6], 0, 2);
+
+    len = rhlen + ulen;
+    dns_reply->len = len;
+    dns_reply->tot_len = len;
+
+    if (peer->ipv6) {
+        ip6_addr_t src = { 0 };
+        ip6_addr_t dst = { 0 };
+
+        r[0] = 0x60;
+        memset (&r[1], 0, 3);
+        r[4] = ulen >> 8;
+        r[5] = ulen;
+        r[6] = IP_PROTO_UDP;
+        r[7] = 64;
+        memcpy (&r[8], peer->daddr, 16);
+        memcpy (&r[24], peer->saddr, 16);
+
+        /* UDP over IPv6 must carry a checksum. */
+        memcpy (src.addr, &r[8], 16);
+        memcpy (dst.addr, &r[24], 16);
+        pbuf_remove_header (dns_reply, IP6_HLEN);
+        chksum = ip6_chksum_pseudo (dns_reply, IP_PROTO_UDP, ulen, &src, &dst);
+        pbuf_add_header (dns_reply, IP6_HLEN);
+        if (!chksum)
+            chksum = 0xffff;
+        memcpy (&u[6], &chksum, 2);
+    } else {
+        /* No options, and no UDP checksum, which IPv4 allows. */
+        r[0] = 0x45;
+        r[1] = 0;
+        r[2] = len >> 8;
+        r[3] = len;
+        memset (&r[4], 0, 4);
+        r[8] = 64;
+        r[9] = IP_PROTO_UDP;
+        memset (&r[10], 0, 2);
+        memcpy (&r[12], peer->daddr, 4);
+        memcpy (&r[16], peer->saddr, 4);
+        chksum = inet_chksum (r, IP_HLEN);
+        memcpy (&r[10], &chksum, 2);
+    }
 
-    for (; run;) {
-        struct pbuf *buf;
+    netif_output_handler (netif, dns_reply);
+}
 
-        buf = hev_tunnel_read (tun_fd, mtu, task_io_yielder, NULL);
-        if (!buf)
-            continue;
+/*
+ * A reply from the resolver, with the tunnel mutex held. Replies from the
+ * cache come while the query is processed, which closes the connection
+ * itself if the reply can't be sent.
+ */
+static void
+mapped_dns_tcp_forward_handler (const HevDNSForwarderPeer *peer, void *buf,
+                                size_t len)
+{
+    MappedDNSTCP *conn;
 
-        stat_tx_packets++;
-        stat_tx_bytes += buf->tot_len;
+    conn = mapped_dns_tcp_find (peer);
+    if (!conn) {
+        LOG_D ("mapped dns tcp forward drop");
+        return;
+    }
 
-        hev_task_mutex_lock (&mutex);
-        if (netif->input (buf, netif) != ERR_OK)
-            pbuf_free (buf);
-        hev_task_mutex_unlock (&mutex);
+    if (mapped_dns_tcp_send (conn, buf, len) < 0) {
+        if (conn->busy)
+            conn->failed = 1;
+        else
+            mapped_dns_tcp_close (conn);
+        return;
     }
 
-    hev_tunnel_del_task (tun_fd, task_lwip_io);
+    if (!conn->busy)
+        tcp_output (conn->pcb);
 }
 
 static void
-lwip_timer_task_entry (void *data)
+mapped_dns_forward_handler (const HevDNSForwarderPeer *peer, void *buf,
+                            size_t len)
 {
-    unsigned int i;
-
-    LOG_D ("socks5 tunnel timer task run");
+    uint8_t *u;
 
-    for (i = 1; run; i++) {
-        hev_task_mutex_lock (&mutex);
-        tcp_tmr ();
+    if (peer->tcp) {
+        mapped_dns_tcp_forward_handler (peer, buf, len);
+        return;
+    }
 
-        if ((i & 3) == 0) {
-#if IP_REASSEMBLY
-            ip_reass_tmr ();
-#endif
-#if LWIP_IPV6
-            nd6_tmr ();
-#if LWIP_IPV6_REASS
-            ip6_reass_tmr ();
-#endif
-#endif
-        }
-        hev_task_mutex_unlock (&mutex);
+    if (!dns_reply)
+        return;
 
-        if (hev_list_first (&session_set))
-            hev_task_sleep (TCP_TMR_INTERVAL);
-        else
-            hev_task_yield (HEV_TASK_WAITIO);
-    }
+    u = (uint8_t *)dns_reply->payload + (peer->ipv6 ? IP6_HLEN : IP_HLEN);
+    memcpy (u + UDP_HLEN, buf, len);
+    mapped_dns_output (peer, len);
 }
 
+/*
+ * Answer mapped DNS queries straight off the TUN: no pcb, no pbuf per
+ * query, the reply is built in one reused buffer and written back. Only
+ * whole datagrams in one pbuf qualify, the rest still go through lwIP
+ * and dns_recv_handler.
+ */
 static int
-tunnel_init (int extern_tun_fd)
+mapped_dns_input (struct pbuf *p)
 {
-    const char *script_path, *name, *ipv4, *ipv6;
-    int multi_queue, res;
-    unsigned int mtu;
+    HevMappedDNS *dns = hev_mapped_dns_get ();
+    const unsigned char *address6;
+    HevDNSForwarderPeer peer;
+    uint8_t *q = p->payload;
+    uint8_t *u;
+    int address;
+    int size;
+    int hlen;
+    int qlen;
+    int len;
+    int res;
+
+    if (!dns || !dns_reply || p->next || (p->len < IP_HLEN))
+        return 0;
+
+    switch (q[0] >> 4) {
+    case 4:
+        if ((q[9] != IP_PROTO_UDP) || (q[6] & 0x3f) || q[7])
+            return 0;
+        hlen = (q[0] & 0x0f) * 4;
+        len = (q[2] << 8) | q[3];
+        address = hev_config_get_mapdns_address ();
+        if ((hlen < IP_HLEN) || memcmp (&q[16], &address, 4))
+            return 0;
+        peer.ipv6 = 0;
+        memcpy (peer.saddr, &q[12], 4);
+        memcpy (peer.daddr, &q[16], 4);
+        break;
+    case 6:
+        if ((p->len < IP6_HLEN) || (q[6] != IP_PROTO_UDP))
+            return 0;
+        hlen = IP6_HLEN;
+        len = IP6_HLEN + ((q[4] << 8) | q[5]);
+        address6 = hev_config_get_mapdns_address6 ();
+        if (!address6 || memcmp (&q[24], address6, 16))
+            return 0;
+        peer.ipv6 = 1;
+        memcpy (peer.saddr, &q[8], 16);
+        memcpy (peer.daddr, &q[24], 16);
+        break;
+    default:
+        return 0;
+    }
+
+    if ((len > p->len) || (len < (hlen + UDP_HLEN)) ||
+        (((q[hlen + 2] << 8) | q[hlen + 3]) != hev_config_get_mapdns_port ()))
+        return 0;
+
+    memcpy (&peer.sport, &q[hlen + 0], 2);
+    memcpy (&peer.dport, &q[hlen + 2], 2);
+    peer.tcp = 0;
+    q += hlen + UDP_HLEN;
+    qlen = len - hlen - UDP_HLEN;
+
+    size = peer.ipv6 ? IP6_HLEN : IP_HLEN;
+    u = (uint8_t *)dns_reply->payload + size;
+    size = hev_config_get_tunnel_mtu () - size - UDP_HLEN;
+    res = mapped_dns_reply (dns, &peer, q, qlen, u + UDP_HLEN, size);
+    if (res > 0)
+        mapped_dns_output (&peer, res);
+
+    pbuf_free (p);
+    return 1;
+}
+
+static int
+lwip_io_filter_needed (void)
+{
+    if (hev_config_get_misc_tcp_syn_connect () !=
+        HEV_CONFIG_TCP_SYN_CONNECT_OFF)
+        return 1;
+
+    if (hev_config_get_misc_negative_cache_ttl ())
+        return 1;
+
+    if (hev_mapped_dns_get ())
+        return 1;
+
+    return hev_socks5_admission_enabled ();
+}
+
+static int
+lwip_io_filter (struct pbuf *buf)
+{
+    HevSocks5TCPSynKey key;
+
+    if (mapped_dns_input (buf))
+        return 1;
+
+    if (hev_socks5_tcp_syn_parse (buf, &key) < 0)
+        return 0;
+
+    /* Answered locally, see mapped_dns_tcp_accept. */
+    if (hev_mapped_dns_get () && mapped_dns_match (&key.dst, key.dport))
+        return 0;
+
+    if (hev_socks5_negative_cache_input (buf, &key))
+        return 1;
+
+    if (hev_socks5_admission_input (buf, &key))
+        return 1;
+
+    /* Direct flows connect on accept, there is no socks5 request to race. */
+    if (hev_bypass_match (&key.dst))
+        return 0;
+
+    return hev_socks5_tcp_syn_input (buf, &key);
+}
+
+static void
+lwip_io_task_entry (void *data)
+{
+    const unsigned int mtu = hev_config_get_tunnel_mtu ();
+    const int filter = lwip_io_filter_needed ();
+
+    LOG_D ("socks5 tunnel lwip task run");
+
+    hev_tunnel_add_task (tun_fd, task_lwip_io);
+
+    for (; run;) {
+        struct pbuf *buf;
+
+        buf = hev_tunnel_read (tun_fd, mtu, task_io_yielder, NULL);
+        if (!buf)
+            continue;
+
+        stat_tx_packets++;
+        stat_tx_bytes += buf->tot_len;
+
+        if (filter && lwip_io_filter (buf))
+            continue;
+
+        hev_task_mutex_lock (&mutex);
+        if (netif->input (buf, netif) != ERR_OK)
+            pbuf_free (buf);
+        hev_task_mutex_unlock (&mutex);
+    }
+
+    hev_tunnel_del_task (tun_fd, task_lwip_io);
+}
+
+static void
+lwip_timer_task_entry (void *data)
+{
+    unsigned int i;
+
+    LOG_D ("socks5 tunnel timer task run");
+
+    for (i = 1; run; i++) {
+        hev_task_mutex_lock (&mutex);
+        tcp_tmr ();
+
+        if ((i & 3) == 0) {
+#if IP_REASSEMBLY
+            ip_reass_tmr ();
+#endif
+#if LWIP_IPV6
+            nd6_tmr ();
+#if LWIP_IPV6_REASS
+            ip6_reass_tmr ();
+#endif
+#endif
+        }
+        hev_task_mutex_unlock (&mutex);
+
+        if (hev_list_first (&session_set) || hev_list_first (&dns_tcp_set))
+            hev_task_sleep (TCP_TMR_INTERVAL);
+        else
+            hev_task_yield (HEV_TASK_WAITIO);
+    }
+}
+
+static int
+control_check (int fd)
+{
+    char buf[64];
+
+    for (;;) {
+        ssize_t s;
+
+        s = recv (fd, buf, sizeof (buf), 0);
+        if (s > 0)
+            continue;
+        if ((s < 0) && (errno == EAGAIN))
+            return 0;
+
+        return -1;
+    }
+}
+
+/* Terminate the session behind a control connection the server closed. */
+static void
+control_event (HevListNode *node)
+{
+    HevSocks5SessionData *sd;
+    int fd;
+
+    sd = container_of (node, HevSocks5SessionData, node);
+    fd = HEV_SOCKS5 (sd->self)->fd;
+    if (control_check (fd) == 0)
+        return;
+
+    /* Drop it now, a closed connection would signal on every wait. */
+    hev_socks5_tunnel_del_control (fd);
+    hev_socks5_session_terminate (sd->self);
+}
+
+static void
+control_task_entry (void *data)
+{
+    LOG_D ("socks5 tunnel control task run");
+
+    for (; run;) {
+#if defined(CONTROL_EPOLL)
+        struct epoll_event evs[64];
+#elif defined(CONTROL_KQUEUE)
+        const struct timespec ts = { 0 };
+        struct kevent evs[64];
+#endif
+        int i, res;
+
+        hev_task_yield (HEV_TASK_WAITIO);
+
+#if defined(CONTROL_EPOLL)
+        do {
+            res = epoll_wait (control_queue, evs, 64, 0);
+            for (i = 0; i < res; i++)
+                control_event (evs[i].data.ptr);
+        } while (res == 64);
+#elif defined(CONTROL_KQUEUE)
+        do {
+            res = kevent (control_queue, NULL, 0, evs, 64, &ts);
+            for (i = 0; i < res; i++)
+                control_event ((HevListNode *)evs[i].udata);
+        } while (res == 64);
+#else
+        res = poll (control_fds, control_count, 0);
+        if (res <= 0)
+            continue;
+
+        for (i = control_count - 1; i >= 0; i--) {
+            if (!control_fds[i].revents)
+                continue;
+
+            control_fds[i].revents = 0;
+            control_event (control_nodes[i]);
+        }
+#endif
+    }
+}
+
+static int
+tunnel_init (int extern_tun_fd)
+{
+    const char *script_path, *name, *ipv4, *ipv6;
+    int multi_queue, res;
+    unsigned int mtu;
 
     if (extern_tun_fd >= 0) {
         int nonblock = 1;
@@ -613,9 +1442,288 @@ lwip_timer_task_fini (void)
     }
 }
 
+static int
+udp_session_init (void)
+{
+    int res;
+
+    res = hev_socks5_session_udp_init ();
+    if (res < 0) {
+        LOG_E ("socks5 tunnel udp session");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+udp_session_fini (void)
+{
+    hev_socks5_session_udp_fini ();
+}
+
+static int
+upstream_init (void)
+{
+    int res;
+
+    res = hev_socks5_upstream_init ();
+    if (res < 0) {
+        LOG_E ("socks5 tunnel upstream");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+upstream_fini (void)
+{
+    hev_socks5_upstream_fini ();
+}
+
+static int
+udp_relay_init (void)
+{
+    HevConfigServer *srvs;
+    int count;
+    int res;
+    int i;
+
+    /* One relay socket serves every server, marked like the first user. */
+    srvs = hev_config_get_socks5_servers (&count);
+    for (i = 0; i < count; i++) {
+        if (srvs[i].udp_in_udp && srvs[i].udp_shared)
+            break;
+    }
+
+    if (i == count)
+        return 0;
+
+    res = hev_socks5_udp_relay_init (srvs[i].mark);
+    if (res < 0) {
+        LOG_E ("socks5 tunnel udp relay");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+udp_relay_fini (void)
+{
+    hev_socks5_udp_relay_fini ();
+}
+
+static int
+udp_pool_init (void)
+{
+    int res;
+
+    res = hev_socks5_udp_pool_init ();
+    if (res < 0) {
+        LOG_E ("socks5 tunnel udp pool");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+udp_pool_fini (void)
+{
+    hev_socks5_udp_pool_fini ();
+}
+
+static int
+tcp_pool_init (void)
+{
+    int res;
+
+    res = hev_socks5_tcp_pool_init ();
+    if (res < 0) {
+        LOG_E ("socks5 tunnel tcp pool");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+tcp_pool_fini (void)
+{
+    hev_socks5_tcp_pool_fini ();
+}
+
+static int
+tcp_syn_init (void)
+{
+    int res;
+
+    res = hev_socks5_tcp_syn_init (netif, &mutex);
+    if (res < 0) {
+        LOG_E ("socks5 tunnel tcp syn");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+tcp_syn_fini (void)
+{
+    hev_socks5_tcp_syn_fini ();
+}
+
+static int
+negative_cache_init (void)
+{
+    int res;
+
+    res = hev_socks5_negative_cache_init (&mutex);
+    if (res < 0) {
+        LOG_E ("socks5 tunnel negative cache");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+negative_cache_fini (void)
+{
+    hev_socks5_negative_cache_fini ();
+}
+
+static int
+admission_init (void)
+{
+    int res;
+
+    res = hev_socks5_admission_init (&mutex);
+    if (res < 0) {
+        LOG_E ("socks5 tunnel admission");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+admission_fini (void)
+{
+    hev_socks5_admission_fini ();
+}
+
+static int
+bypass_init (void)
+{
+    int res;
+
+    res = hev_bypass_init ();
+    if (res < 0) {
+        LOG_E ("socks5 tunnel bypass");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+bypass_fini (void)
+{
+    hev_bypass_fini ();
+}
+
+static int
+dns_forwarder_init (void)
+{
+    int size;
+    int res;
+
+    if (!hev_mapped_dns_get ())
+        return 0;
+
+    size = hev_config_get_tunnel_mtu () - IP6_HLEN - UDP_HLEN;
+    res = hev_dns_forwarder_init (mapped_dns_forward_handler, &mutex, size);
+    if (res < 0) {
+        LOG_E ("socks5 tunnel dns forwarder");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+dns_forwarder_fini (void)
+{
+    hev_dns_forwarder_fini ();
+}
+
+static int
+control_task_init (void)
+{
+    task_control = hev_task_new (-1);
+    if (!task_control) {
+        LOG_E ("socks5 tunnel task control");
+        return -1;
+    }
+
+#if defined(CONTROL_EPOLL) || defined(CONTROL_KQUEUE)
+#if defined(CONTROL_EPOLL)
+    control_queue = epoll_create1 (EPOLL_CLOEXEC);
+#else
+    control_queue = kqueue ();
+#endif
+    if (control_queue < 0) {
+        LOG_E ("socks5 tunnel control queue");
+        return -1;
+    }
+
+    if (hev_task_add_fd (task_control, control_queue, POLLIN) < 0) {
+        LOG_E ("socks5 tunnel control queue task");
+        return -1;
+    }
+#endif
+
+    return 0;
+}
+
+static void
+control_task_fini (void)
+{
+    if (task_control) {
+        hev_task_unref (task_control);
+        task_control = NULL;
+    }
+
+#if defined(CONTROL_EPOLL) || defined(CONTROL_KQUEUE)
+    if (control_queue >= 0) {
+        close (control_queue);
+        control_queue = -1;
+    }
+#else
+    if (control_fds) {
+        hev_free (control_fds);
+        control_fds = NULL;
+    }
+    if (control_nodes) {
+        hev_free (control_nodes);
+        control_nodes = NULL;
+    }
+
+    control_count = 0;
+    control_size = 0;
+#endif
+}
+
 static int
 mapped_dns_init (void)
 {
+    const unsigned char *network6;
+    const char *rules_file;
+    const char *cache_file;
+    const char *key = NULL;
     HevMappedDNS *dns;
     int cache_size;
     int network;
@@ -628,25 +1736,60 @@ mapped_dns_init (void)
     if (!cache_size)
         return 0;
 
-    dns = hev_mapped_dns_new (network, netmask, cache_size);
+    if (hev_config_get_mapdns_mode () == HEV_CONFIG_MAPDNS_MODE_HASH)
+        key = hev_config_get_mapdns_hash_key ();
+
+    dns = hev_mapped_dns_new (network, netmask, cache_size, key);
     if (!dns)
         return -1;
 
+    hev_mapped_dns_set_ttl (dns, hev_config_get_mapdns_ttl ());
+
+    network6 = hev_config_get_mapdns_network6 ();
+    if (network6)
+        hev_mapped_dns_set_net6 (dns, network6);
+
+    cache_file = hev_config_get_mapdns_cache_file ();
+    if (cache_file && (hev_mapped_dns_load (dns, cache_file) == 0))
+        LOG_I ("socks5 tunnel mapped dns restored");
+
     hev_mapped_dns_put (dns);
 
+    rules_file = hev_config_get_mapdns_rules_file ();
+    if (rules_file && (hev_mapped_dns_load_rules (rules_file) < 0))
+        return -1;
+
+    dns_reply = pbuf_alloc (PBUF_RAW, hev_config_get_tunnel_mtu (), PBUF_RAM);
+    if (!dns_reply) {
+        LOG_E ("socks5 tunnel mapped dns reply");
+        return -1;
+    }
+
     return 0;
 }
 
 static void
 mapped_dns_fini (void)
 {
+    const char *cache_file;
     HevMappedDNS *dns;
 
     dns = hev_mapped_dns_get ();
     if (dns) {
+        cache_file = hev_config_get_mapdns_cache_file ();
+        if (cache_file && (hev_mapped_dns_save (dns, cache_file) < 0))
+            LOG_W ("socks5 tunnel mapped dns save");
+
         hev_object_unref (HEV_OBJECT (dns));
         hev_mapped_dns_put (NULL);
     }
+
+    hev_mapped_dns_set_rules (NULL, 0);
+
+    if (dns_reply) {
+        pbuf_free (dns_reply);
+        dns_reply = NULL;
+    }
 }
 
 int
@@ -676,10 +1819,54 @@ hev_socks5_tunnel_init (int tun_fd)
     if (res < 0)
         goto exit;
 
+    res = control_task_init ();
+    if (res < 0)
+        goto exit;
+
+    res = udp_session_init ();
+    if (res < 0)
+        goto exit;
+
+    res = upstream_init ();
+    if (res < 0)
+        goto exit;
+
+    res = udp_relay_init ();
+    if (res < 0)
+        goto exit;
+
+    res = udp_pool_init ();
+    if (res < 0)
+        goto exit;
+
+    res = tcp_pool_init ();
+    if (res < 0)
+        goto exit;
+
+    res = tcp_syn_init ();
+    if (res < 0)
+        goto exit;
+
+    res = negative_cache_init ();
+    if (res < 0)
+        goto exit;
+
+    res = admission_init ();
+    if (res < 0)
+        goto exit;
+
+    res = bypass_init ();
+    if (res < 0)
+        goto exit;
+
     res = mapped_dns_init ();
     if (res < 0)
         goto exit;
 
+    res = dns_forwarder_init ();
+    if (res < 0)
+        goto exit;
+
     signal (SIGPIPE, SIG_IGN);
 
     hev_task_mutex_init (&mutex);
@@ -704,7 +1891,18 @@ retry:
         goto retry;
     }
 
+    dns_forwarder_fini ();
     mapped_dns_fini ();
+    bypass_fini ();
+    admission_fini ();
+    negative_cache_fini ();
+    tcp_syn_fini ();
+    tcp_pool_fini ();
+    udp_pool_fini ();
+    udp_relay_fini ();
+    upstream_fini ();
+    udp_session_fini ();
+    control_task_fini ();
     lwip_timer_task_fini ();
     lwip_io_task_fini ();
     event_task_fini ();
@@ -734,6 +1932,15 @@ hev_socks5_tunnel_run (void)
     task_lwip_timer = hev_task_ref (task_lwip_timer);
     hev_task_run (task_lwip_timer, lwip_timer_task_entry, NULL);
 
+    task_control = hev_task_ref (task_control);
+    hev_task_run (task_control, control_task_entry, NULL);
+
+    hev_socks5_upstream_run ();
+    hev_socks5_udp_relay_run ();
+    hev_socks5_udp_pool_run ();
+    hev_socks5_tcp_pool_run ();
+    hev_dns_forwarder_run ();
+
     run = 1;
     hev_task_system_run ();
 
@@ -783,3 +1990,71 @@ hev_socks5_tunnel_stats (size_t *tx_packets, size_t *tx_bytes,
     if (rx_bytes)
         *rx_bytes = stat_rx_bytes;
 }
+
+void
+hev_socks5_tunnel_udp_stats (size_t *queued_bytes, size_t *drop_packets,
+                             size_t *drop_bytes)
+{
+    LOG_D ("socks5 tunnel udp stats");
+
+    hev_socks5_session_udp_stats (queued_bytes, drop_packets, drop_bytes);
+}
+
+void
+hev_socks5_tunnel_udp_pool_stats (size_t *hits, size_t *misses,
+                                  size_t *saved_msec)
+{
+    LOG_D ("socks5 tunnel udp pool stats");
+
+    hev_socks5_udp_pool_stats (hits, misses, saved_msec);
+}
+
+int
+hev_socks5_tunnel_upstream_stats (int index, size_t *sessions,
+                                  size_t *latency)
+{
+    HevSocks5Upstream *upstream;
+
+    LOG_D ("socks5 tunnel upstream stats");
+
+    upstream = hev_socks5_upstream_get (index);
+    if (!upstream)
+        return -1;
+
+    *sessions = upstream->sessions;
+    *latency = upstream->latency;
+
+    return 0;
+}
+
+void
+hev_socks5_tunnel_negative_cache_stats (size_t *hits, size_t *entries)
+{
+    LOG_D ("socks5 tunnel negative cache stats");
+
+    hev_socks5_negative_cache_stats (hits, entries);
+}
+
+void
+hev_socks5_tunnel_admission_stats (size_t *tcp_rejects, size_t *udp_rejects)
+{
+    LOG_D ("socks5 tunnel admission stats");
+
+    hev_socks5_admission_stats (tcp_rejects, udp_rejects);
+}
+
+int
+hev_socks5_tunnel_set_bypass (const char **rules, int count)
+{
+    LOG_D ("socks5 tunnel set bypass");
+
+    return hev_bypass_set_rules (rules, count);
+}
+
+int
+hev_socks5_tunnel_set_mapdns_rules (const char **rules, int count)
+{
+    LOG_D ("socks5 tunnel set mapdns rules");
+
+    return hev_mapped_dns_set_rules (rules, count);
+}
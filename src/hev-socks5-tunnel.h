@@ -20,7 +20,21 @@ void hev_socks5_tunnel_stop (void);
 
 void hev_socks5_tunnel_stats (size_t *tx_packets, size_t *tx_bytes,
                               size_t *rx_packets, size_t *rx_bytes);
+void hev_socks5_tunnel_udp_stats (size_t *queued_bytes, size_t *drop_packets,
+                                  size_t *drop_bytes);
+void hev_socks5_tunnel_udp_pool_stats (size_t *hits, size_t *misses,
+                                       size_t *saved_msec);
+int hev_socks5_tunnel_upstream_stats (int index, size_t *sessions,
+                                      size_t *latency);
+void hev_socks5_tunnel_negative_cache_stats (size_t *hits, size_t *entries);
+void hev_socks5_tunnel_admission_stats (size_t *tcp_rejects,
+                                       size_t *udp_rejects);
+int hev_socks5_tunnel_set_bypass (const char **rules, int count);
+int hev_socks5_tunnel_set_mapdns_rules (const char **rules, int count);
 
 void hev_socks5_tunnel_update_session (HevListNode *node);
 
+int hev_socks5_tunnel_add_control (int fd, HevListNode *node);
+void hev_socks5_tunnel_del_control (int fd);
+
 #endif /* __HEV_SOCKS5_TUNNEL_H__ */
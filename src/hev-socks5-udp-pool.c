@@ -0,0 +1,409 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-udp-pool.c
+ Author      : hev <r@hev.cc>
+ Copyright   : Copyright (c) 2025 hev
+ Description : Socks5 UDP Associate Pool
+ ============================================================================
+ */
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <hev-task.h>
+#include <hev-task-io.h>
+#include <hev-memory-allocator.h>
+#include <hev-socks5-client-udp.h>
+
+#include "hev-utils.h"
+#include "hev-config.h"
+#include "hev-logger.h"
+#include "hev-config-const.h"
+#include "hev-socks5-handshake.h"
+#include "hev-socks5-upstream.h"
+#include "hev-socks5-udp-relay.h"
+
+#include "hev-socks5-udp-pool.h"
+
+#define POOL_CHECK_INTERVAL (1000)
+#define POOL_RETRY_INTERVAL (1000)
+
+typedef struct _HevSocks5UDPPoolEntry HevSocks5UDPPoolEntry;
+typedef struct _HevSocks5UDPPoolClient HevSocks5UDPPoolClient;
+
+struct _HevSocks5UDPPoolEntry
+{
+    HevSocks5Upstream *upstream;
+    int fd;
+    unsigned int cost;
+    unsigned long long stamp;
+    struct sockaddr_in6 addr;
+};
+
+struct _HevSocks5UDPPoolClient
+{
+    HevSocks5ClientUDP base;
+
+    HevConfigServer *srv;
+    HevSocks5UDPRelayNode node;
+};
+
+static int running;
+static HevTask *task;
+
+static HevSocks5UDPPoolEntry *entries;
+static int entry_size;
+static int entry_count;
+
+static size_t stat_hits;
+static size_t stat_misses;
+static size_t stat_saved;
+
+static void
+hev_socks5_udp_pool_close (HevSocks5UDPPoolEntry *entry)
+{
+    hev_task_del_fd (task, entry->fd);
+    close (entry->fd);
+}
+
+static int
+hev_socks5_udp_pool_alive (HevSocks5UDPPoolEntry *entry,
+                           unsigned long long now)
+{
+    unsigned long long max_age;
+    ssize_t s;
+    char b;
+
+    /* Stay well inside the server's idle timeout for associations. */
+    max_age = hev_config_get_misc_udp_read_write_timeout () / 2;
+    if ((now - entry->stamp) >= max_age)
+        return 0;
+
+    /* The control connection stays silent, so any byte is an error. */
+    s = recv (entry->fd, &b, sizeof (b), MSG_PEEK | MSG_DONTWAIT);
+    if (s >= 0)
+        return 0;
+    if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+        return 0;
+
+    return 1;
+}
+
+static void
+hev_socks5_udp_pool_prune (void)
+{
+    unsigned long long now;
+    int i, j;
+
+    now = get_time_msec ();
+    for (i = 0, j = 0; i < entry_count; i++) {
+        if (hev_socks5_udp_pool_alive (&entries[i], now)) {
+            entries[j++] = entries[i];
+            continue;
+        }
+
+        LOG_D ("socks5 udp pool expire %d", entries[i].fd);
+        hev_socks5_udp_pool_close (&entries[i]);
+    }
+
+    entry_count = j;
+}
+
+static int
+hev_socks5_udp_pool_client_set_upstream_addr (HevSocks5Client *base,
+                                              HevSocks5Addr *addr)
+{
+    HevSocks5UDPPoolClient *self = (HevSocks5UDPPoolClient *)base;
+
+    return hev_socks5_udp_relay_set_addr (&self->node, HEV_SOCKS5 (self)->fd,
+                                          addr, self->srv->udp_addr);
+}
+
+static HevObjectClass *
+hev_socks5_udp_pool_client_class (void)
+{
+    static HevSocks5ClientUDPClass klass;
+    HevSocks5ClientUDPClass *kptr = &klass;
+    HevObjectClass *okptr = HEV_OBJECT_CLASS (kptr);
+
+    if (!okptr->name) {
+        HevSocks5ClientClass *ckptr;
+        void *ptr;
+
+        ptr = HEV_SOCKS5_CLIENT_UDP_TYPE;
+        memcpy (kptr, ptr, sizeof (HevSocks5ClientUDPClass));
+
+        okptr->name = "HevSocks5UDPPoolClient";
+
+        ckptr = HEV_SOCKS5_CLIENT_CLASS (kptr);
+        ckptr->set_upstream_addr = hev_socks5_udp_pool_client_set_upstream_addr;
+    }
+
+    return okptr;
+}
+
+static HevSocks5UDPPoolClient *
+hev_socks5_udp_pool_client_new (HevConfigServer *srv)
+{
+    HevSocks5UDPPoolClient *self;
+    int res;
+
+    self = hev_malloc0 (sizeof (HevSocks5UDPPoolClient));
+    if (!self)
+        return NULL;
+
+    res = hev_socks5_client_udp_construct (&self->base,
+                                           HEV_SOCKS5_TYPE_UDP_IN_UDP);
+    if (res < 0) {
+        hev_free (self);
+        return NULL;
+    }
+
+    HEV_OBJECT (self)->klass = hev_socks5_udp_pool_client_class ();
+    self->srv = srv;
+
+    return self;
+}
+
+static int
+hev_socks5_udp_pool_fill (HevSocks5Upstream *upstream)
+{
+    HevConfigServer *srv = upstream->srv;
+    HevSocks5UDPPoolClient *client;
+    HevSocks5UDPPoolEntry *entry;
+    HevSocks5UpstreamWait wait;
+    unsigned long long start;
+    int res;
+    int fd;
+
+    client = hev_socks5_udp_pool_client_new (srv);
+    if (!client)
+        return -1;
+
+    start = get_time_msec ();
+    hev_socks5_upstream_wait_init (&wait, &running, NULL);
+
+    fd = hev_socks5_upstream_connect (upstream, hev_socks5_upstream_yielder,
+                                      &wait);
+    if (fd < 0) {
+        LOG_D ("socks5 udp pool connect");
+        hev_object_unref (HEV_OBJECT (client));
+        return -1;
+    }
+
+    /* BND.ADDR lands in client->node through set_upstream_addr. */
+    res = hev_socks5_handshake_client (HEV_SOCKS5_CLIENT (client), fd, srv);
+    if (res < 0) {
+        LOG_D ("socks5 udp pool handshake");
+        goto exit;
+    }
+
+    /* Sessions may have claimed entries while we were yielding. */
+    entry = &entries[entry_count++];
+    entry->upstream = upstream;
+    entry->fd = fd;
+    entry->addr = client->node.addr;
+    entry->stamp = get_time_msec ();
+    entry->cost = entry->stamp - start;
+
+    LOG_D ("socks5 udp pool fill %d %ums", fd, entry->cost);
+
+    hev_object_unref (HEV_OBJECT (client));
+    return 0;
+
+exit:
+    hev_object_unref (HEV_OBJECT (client));
+    hev_task_del_fd (task, fd);
+    close (fd);
+    return -1;
+}
+
+static int
+hev_socks5_udp_pool_enabled (HevConfigServer *srv)
+{
+    return srv->udp_in_udp && srv->udp_shared && srv->udp_pool;
+}
+
+static HevSocks5Upstream *
+hev_socks5_udp_pool_lacking (void)
+{
+    int counts[SOCKS5_SERVERS_MAX] = { 0 };
+    int i, count;
+
+    count = hev_socks5_upstream_get_count ();
+    for (i = 0; i < entry_count; i++) {
+        HevSocks5Upstream *upstream = entries[i].upstream;
+        counts[upstream - hev_socks5_upstream_get (0)]++;
+    }
+
+    for (i = 0; i < count; i++) {
+        HevSocks5Upstream *upstream = hev_socks5_upstream_get (i);
+        HevConfigServer *srv = upstream->srv;
+
+        if (upstream->down)
+            continue;
+
+        if (hev_socks5_udp_pool_enabled (srv) && (counts[i] < srv->udp_pool))
+            return upstream;
+    }
+
+    return NULL;
+}
+
+static void
+hev_socks5_udp_pool_task_entry (void *data)
+{
+    unsigned long long retry = 0;
+
+    LOG_D ("socks5 udp pool task run");
+
+    while (running) {
+        HevSocks5Upstream *upstream;
+
+        hev_socks5_udp_pool_prune ();
+
+        upstream = hev_socks5_udp_pool_lacking ();
+        if (upstream && (get_time_msec () >= retry)) {
+            if (hev_socks5_udp_pool_fill (upstream) < 0)
+                retry = get_time_msec () + POOL_RETRY_INTERVAL;
+            continue;
+        }
+
+        hev_task_sleep (POOL_CHECK_INTERVAL);
+    }
+
+    while (entry_count)
+        hev_socks5_udp_pool_close (&entries[--entry_count]);
+}
+
+int
+hev_socks5_udp_pool_init (void)
+{
+    int stack_size;
+    int count;
+    int i;
+
+    LOG_D ("socks5 udp pool init");
+
+    count = hev_socks5_upstream_get_count ();
+    for (i = 0; i < count; i++) {
+        HevConfigServer *srv = hev_socks5_upstream_get (i)->srv;
+
+        if (hev_socks5_udp_pool_enabled (srv))
+            entry_size += srv->udp_pool;
+    }
+
+    if (!entry_size)
+        return 0;
+    entries = hev_calloc (entry_size, sizeof (HevSocks5UDPPoolEntry));
+    if (!entries) {
+        LOG_E ("socks5 udp pool entries");
+        goto exit;
+    }
+
+    stack_size = hev_config_get_misc_task_stack_size ();
+    task = hev_task_new (stack_size);
+    if (!task) {
+        LOG_E ("socks5 udp pool task");
+        goto exit;
+    }
+
+    return 0;
+
+exit:
+    hev_socks5_udp_pool_fini ();
+    return -1;
+}
+
+void
+hev_socks5_udp_pool_fini (void)
+{
+    LOG_D ("socks5 udp pool fini");
+
+    if (task) {
+        hev_task_unref (task);
+        task = NULL;
+    }
+
+    if (entries) {
+        hev_free (entries);
+        entries = NULL;
+    }
+    entry_size = 0;
+    entry_count = 0;
+
+    stat_hits = 0;
+    stat_misses = 0;
+    stat_saved = 0;
+}
+
+void
+hev_socks5_udp_pool_run (void)
+{
+    if (!task)
+        return;
+
+    running = 1;
+    task = hev_task_ref (task);
+    hev_task_run (task, hev_socks5_udp_pool_task_entry, NULL);
+}
+
+void
+hev_socks5_udp_pool_stop (void)
+{
+    if (!task || !running)
+        return;
+
+    running = 0;
+    hev_task_wakeup (task);
+    hev_task_join (task);
+}
+
+int
+hev_socks5_udp_pool_get (HevSocks5Upstream *upstream, int *fd,
+                         struct sockaddr_in6 *addr)
+{
+    unsigned long long now;
+    int i;
+
+    if (!running)
+        return -1;
+
+    now = get_time_msec ();
+    for (i = entry_count - 1; i >= 0; i--) {
+        HevSocks5UDPPoolEntry entry = entries[i];
+
+        if (entry.upstream != upstream)
+            continue;
+
+        entries[i] = entries[--entry_count];
+        if (!hev_socks5_udp_pool_alive (&entry, now)) {
+            hev_socks5_udp_pool_close (&entry);
+            continue;
+        }
+
+        hev_task_del_fd (task, entry.fd);
+        *fd = entry.fd;
+        *addr = entry.addr;
+
+        stat_hits++;
+        stat_saved += entry.cost;
+        hev_task_wakeup (task);
+
+        return 0;
+    }
+
+    stat_misses++;
+    hev_task_wakeup (task);
+
+    return -1;
+}
+
+void
+hev_socks5_udp_pool_stats (size_t *hits, size_t *misses, size_t *saved_msec)
+{
+    *hits = stat_hits;
+    *misses = stat_misses;
+    *saved_msec = stat_saved;
+}
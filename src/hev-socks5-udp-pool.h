@@ -0,0 +1,34 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-udp-pool.h
+ Author      : hev <r@hev.cc>
+ Copyright   : Copyright (c) 2025 hev
+ Description : Socks5 UDP Associate Pool
+ ============================================================================
+ */
+
+#ifndef __HEV_SOCKS5_UDP_POOL_H__
+#define __HEV_SOCKS5_UDP_POOL_H__
+
+#include <stddef.h>
+#include <netinet/in.h>
+
+#include "hev-socks5-upstream.h"
+
+int hev_socks5_udp_pool_init (void);
+void hev_socks5_udp_pool_fini (void);
+
+void hev_socks5_udp_pool_run (void);
+void hev_socks5_udp_pool_stop (void);
+
+/*
+ * Claim a ready association to @upstream: the control connection in @fd and
+ * the relay endpoint in @addr. Returns -1 if none is ready.
+ */
+int hev_socks5_udp_pool_get (HevSocks5Upstream *upstream, int *fd,
+                             struct sockaddr_in6 *addr);
+
+void hev_socks5_udp_pool_stats (size_t *hits, size_t *misses,
+                                size_t *saved_msec);
+
+#endif /* __HEV_SOCKS5_UDP_POOL_H__ */
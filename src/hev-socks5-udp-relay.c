@@ -0,0 +1,618 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-udp-relay.c
+ Author      : hev <r@hev.cc>
+ Copyright   : Copyright (c) 2025 hev
+ Description : Socks5 UDP Relay
+ ============================================================================
+ */
+
+#define _GNU_SOURCE
+#include <poll.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include <hev-task.h>
+#include <hev-task-io.h>
+#include <hev-task-io-socket.h>
+#include <hev-memory-allocator.h>
+#include <hev-socks5-misc.h>
+
+#include "hev-utils.h"
+#include "hev-config.h"
+#include "hev-logger.h"
+#include "hev-config-const.h"
+
+#include "hev-socks5-udp-relay.h"
+
+#define RELAY_BATCH (64)
+
+static int relay_fd = -1;
+static unsigned int relay_mark;
+static int running;
+static HevTask *task;
+
+static uint8_t *buffers;
+static size_t buffer_size;
+static size_t lens[RELAY_BATCH];
+static struct sockaddr_in6 addrs[RELAY_BATCH];
+#if defined(__linux__)
+static struct mmsghdr msgs[RELAY_BATCH];
+static struct iovec iovs[RELAY_BATCH];
+#endif
+
+static HevSocks5UDPRelayNode *writers;
+static HevSocks5UDPRelayNode **table;
+static unsigned int table_size;
+static unsigned int table_count;
+
+static unsigned int
+hev_socks5_udp_relay_hash (const struct sockaddr_in6 *addr)
+{
+    const uint32_t *p = (const uint32_t *)&addr->sin6_addr;
+    uint32_t h;
+
+    h = p[0] ^ p[1] ^ p[2] ^ p[3] ^ addr->sin6_port;
+    h *= 0x9e3779b1;
+
+    return h ^ (h >> 16);
+}
+
+static int
+hev_socks5_udp_relay_equal (const struct sockaddr_in6 *a,
+                            const struct sockaddr_in6 *b)
+{
+    if (a->sin6_port != b->sin6_port)
+        return 0;
+
+    return !memcmp (&a->sin6_addr, &b->sin6_addr, sizeof (a->sin6_addr));
+}
+
+static HevSocks5UDPRelayNode *
+hev_socks5_udp_relay_find (const struct sockaddr_in6 *addr)
+{
+    HevSocks5UDPRelayNode *node;
+    unsigned int idx;
+
+    idx = hev_socks5_udp_relay_hash (addr) & (table_size - 1);
+    for (node = table[idx]; node; node = node->next) {
+        if (hev_socks5_udp_relay_equal (&node->addr, addr))
+            return node;
+    }
+
+    return NULL;
+}
+
+static int
+hev_socks5_udp_relay_grow (void)
+{
+    HevSocks5UDPRelayNode **new_table;
+    unsigned int new_size;
+    unsigned int i;
+
+    new_size = table_size * 2;
+    new_table = hev_calloc (new_size, sizeof (HevSocks5UDPRelayNode *));
+    if (!new_table)
+        return -1;
+
+    for (i = 0; i < table_size; i++) {
+        HevSocks5UDPRelayNode *node = table[i];
+
+        while (node) {
+            HevSocks5UDPRelayNode *next = node->next;
+            unsigned int idx;
+
+            idx = hev_socks5_udp_relay_hash (&node->addr) & (new_size - 1);
+            node->next = new_table[idx];
+            new_table[idx] = node;
+            node = next;
+        }
+    }
+
+    hev_free (table);
+    table = new_table;
+    table_size = new_size;
+
+    return 0;
+}
+
+static int
+hev_socks5_udp_relay_recv (void)
+{
+#if defined(__linux__)
+    int i, res;
+
+    for (i = 0; i < RELAY_BATCH; i++) {
+        iovs[i].iov_base = buffers + buffer_size * i;
+        iovs[i].iov_len = buffer_size;
+        msgs[i].msg_hdr.msg_name = &addrs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof (addrs[i]);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_control = NULL;
+        msgs[i].msg_hdr.msg_controllen = 0;
+        msgs[i].msg_hdr.msg_flags = 0;
+    }
+
+    res = recvmmsg (relay_fd, msgs, RELAY_BATCH, 0, NULL);
+    for (i = 0; i < res; i++)
+        lens[i] = msgs[i].msg_len;
+
+    return res;
+#else
+    socklen_t alen = sizeof (addrs[0]);
+    ssize_t s;
+
+    s = recvfrom (relay_fd, buffers, buffer_size, 0,
+                  (struct sockaddr *)&addrs[0], &alen);
+    if (s < 0)
+        return -1;
+
+    lens[0] = s;
+    return 1;
+#endif
+}
+
+static void
+hev_socks5_udp_relay_dispatch (const struct sockaddr_in6 *addr, uint8_t *buf,
+                               size_t len)
+{
+    HevSocks5UDPRelayNode *node;
+    int alen;
+
+    node = hev_socks5_udp_relay_find (addr);
+    if (!node)
+        return;
+
+    /* RSV (2) | FRAG (1) | ADDR */
+    if ((len < 4) || buf[2])
+        return;
+
+    alen = hev_socks5_addr_len ((HevSocks5Addr *)&buf[3]);
+    if (!alen || ((3 + alen) > len))
+        return;
+
+    node->handler (node, (HevSocks5Addr *)&buf[3], &buf[3 + alen],
+                   len - 3 - alen);
+}
+
+/*
+ * Sessions that found the shared socket full wait here, the relay task
+ * then also watches for POLLOUT and wakes them all once it is writable.
+ */
+static void
+hev_socks5_udp_relay_wait (HevSocks5UDPRelayNode *node)
+{
+    if (node->writer)
+        return;
+
+    if (!writers)
+        hev_task_mod_fd (task, relay_fd, POLLIN | POLLOUT);
+
+    node->writer = hev_task_self ();
+    node->wnext = writers;
+    writers = node;
+}
+
+static void
+hev_socks5_udp_relay_wake (void)
+{
+    struct pollfd pfd = { .fd = relay_fd, .events = POLLOUT };
+
+    if ((poll (&pfd, 1, 0) <= 0) || !(pfd.revents & POLLOUT))
+        return;
+
+    while (writers) {
+        HevSocks5UDPRelayNode *node = writers;
+
+        writers = node->wnext;
+        hev_task_wakeup (node->writer);
+        node->writer = NULL;
+        node->wnext = NULL;
+    }
+
+    hev_task_mod_fd (task, relay_fd, POLLIN);
+}
+
+static void
+hev_socks5_udp_relay_task_entry (void *data)
+{
+    LOG_D ("socks5 udp relay task run");
+
+    hev_task_add_fd (task, relay_fd, POLLIN);
+
+    while (running) {
+        int i, res;
+
+        if (writers)
+            hev_socks5_udp_relay_wake ();
+
+        res = hev_socks5_udp_relay_recv ();
+        if (res <= 0) {
+            if ((res < 0) && (errno != EAGAIN))
+                LOG_D ("socks5 udp relay recv");
+            hev_task_yield (HEV_TASK_WAITIO);
+            continue;
+        }
+
+        for (i = 0; i < res; i++) {
+            uint8_t *buf = buffers + buffer_size * i;
+            hev_socks5_udp_relay_dispatch (&addrs[i], buf, lens[i]);
+        }
+    }
+
+    hev_task_del_fd (task, relay_fd);
+}
+
+static int
+hev_socks5_udp_relay_socket (void)
+{
+    struct sockaddr_in6 addr = { 0 };
+    int zero = 0;
+    int res;
+    int fd;
+
+    fd = hev_task_io_socket_socket (AF_INET6, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        LOG_E ("socks5 udp relay socket");
+        return -1;
+    }
+
+    setsockopt (fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof (zero));
+
+    if (relay_mark) {
+        res = set_sock_mark (fd, relay_mark);
+        if (res < 0) {
+            LOG_E ("socks5 udp relay mark");
+            goto exit;
+        }
+    }
+
+    res = hev_config_get_misc_udp_recv_buffer_size ();
+    setsockopt (fd, SOL_SOCKET, SO_RCVBUF, &res, sizeof (res));
+
+    addr.sin6_family = AF_INET6;
+    res = bind (fd, (struct sockaddr *)&addr, sizeof (addr));
+    if (res < 0) {
+        LOG_E ("socks5 udp relay bind");
+        goto exit;
+    }
+
+    return fd;
+
+exit:
+    close (fd);
+    return -1;
+}
+
+int
+hev_socks5_udp_relay_init (unsigned int mark)
+{
+    int stack_size;
+
+    LOG_D ("socks5 udp relay init");
+
+    relay_mark = mark;
+    relay_fd = hev_socks5_udp_relay_socket ();
+    if (relay_fd < 0)
+        goto exit;
+
+    buffer_size = hev_config_get_misc_udp_buffer_size ();
+    buffers = hev_malloc (buffer_size * RELAY_BATCH);
+    if (!buffers) {
+        LOG_E ("socks5 udp relay buffers");
+        goto exit;
+    }
+
+    table_size = 256;
+    table = hev_calloc (table_size, sizeof (HevSocks5UDPRelayNode *));
+    if (!table) {
+        LOG_E ("socks5 udp relay table");
+        goto exit;
+    }
+
+    stack_size = hev_config_get_misc_task_stack_size ();
+    task = hev_task_new (stack_size);
+    if (!task) {
+        LOG_E ("socks5 udp relay task");
+        goto exit;
+    }
+
+    return 0;
+
+exit:
+    hev_socks5_udp_relay_fini ();
+    return -1;
+}
+
+void
+hev_socks5_udp_relay_fini (void)
+{
+    LOG_D ("socks5 udp relay fini");
+
+    if (task) {
+        hev_task_unref (task);
+        task = NULL;
+    }
+
+    if (table) {
+        hev_free (table);
+        table = NULL;
+    }
+    table_size = 0;
+    table_count = 0;
+
+    if (buffers) {
+        hev_free (buffers);
+        buffers = NULL;
+    }
+
+    if (relay_fd >= 0) {
+        close (relay_fd);
+        relay_fd = -1;
+    }
+}
+
+void
+hev_socks5_udp_relay_run (void)
+{
+    if (!task)
+        return;
+
+    running = 1;
+    task = hev_task_ref (task);
+    hev_task_run (task, hev_socks5_udp_relay_task_entry, NULL);
+}
+
+void
+hev_socks5_udp_relay_stop (void)
+{
+    if (!task || !running)
+        return;
+
+    running = 0;
+    hev_task_wakeup (task);
+    hev_task_join (task);
+}
+
+int
+hev_socks5_udp_relay_set_addr (HevSocks5UDPRelayNode *node, int fd,
+                               const HevSocks5Addr *baddr,
+                               const char *udp_addr)
+{
+    struct sockaddr_in6 *saddr = &node->addr;
+    static const uint8_t zero[16];
+    int any;
+
+    memset (saddr, 0, sizeof (*saddr));
+    saddr->sin6_family = AF_INET6;
+
+    switch (baddr->atype) {
+    case HEV_SOCKS5_ADDR_TYPE_IPV4:
+        saddr->sin6_addr.s6_addr[10] = 0xff;
+        saddr->sin6_addr.s6_addr[11] = 0xff;
+        memcpy (&saddr->sin6_addr.s6_addr[12], baddr->ipv4.addr, 4);
+        saddr->sin6_port = baddr->ipv4.port;
+        any = !memcmp (baddr->ipv4.addr, zero, 4);
+        break;
+    case HEV_SOCKS5_ADDR_TYPE_IPV6:
+        memcpy (&saddr->sin6_addr, baddr->ipv6.addr, 16);
+        saddr->sin6_port = baddr->ipv6.port;
+        any = !memcmp (baddr->ipv6.addr, zero, 16);
+        break;
+    default:
+        return -1;
+    }
+
+    if (udp_addr && udp_addr[0]) {
+        struct in_addr addr4;
+
+        if (inet_pton (AF_INET6, udp_addr, &saddr->sin6_addr) == 1)
+            return 0;
+        if (inet_pton (AF_INET, udp_addr, &addr4) != 1)
+            return -1;
+
+        memset (&saddr->sin6_addr, 0, 10);
+        saddr->sin6_addr.s6_addr[10] = 0xff;
+        saddr->sin6_addr.s6_addr[11] = 0xff;
+        memcpy (&saddr->sin6_addr.s6_addr[12], &addr4, 4);
+    } else if (any) {
+        struct sockaddr_storage peer;
+        socklen_t len = sizeof (peer);
+
+        if (getpeername (fd, (struct sockaddr *)&peer, &len) < 0)
+            return -1;
+
+        if (peer.ss_family == AF_INET6) {
+            struct sockaddr_in6 *p6 = (struct sockaddr_in6 *)&peer;
+            memcpy (&saddr->sin6_addr, &p6->sin6_addr, 16);
+        } else if (peer.ss_family == AF_INET) {
+            struct sockaddr_in *p4 = (struct sockaddr_in *)&peer;
+            /* BND.ADDR may have been "::", map the address afresh. */
+            memset (&saddr->sin6_addr, 0, 10);
+            saddr->sin6_addr.s6_addr[10] = 0xff;
+            saddr->sin6_addr.s6_addr[11] = 0xff;
+            memcpy (&saddr->sin6_addr.s6_addr[12], &p4->sin_addr, 4);
+        } else {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int
+hev_socks5_udp_relay_add (HevSocks5UDPRelayNode *node)
+{
+    unsigned int idx;
+
+    if (!table)
+        return -1;
+
+    /*
+     * Some servers hand every association the same relay port, their
+     * replies can't be told apart on the shared socket, so the session
+     * gets a socket of its own connected to the relay.
+     */
+    if (hev_socks5_udp_relay_find (&node->addr)) {
+        int fd;
+
+        LOG_D ("socks5 udp relay address in use");
+
+        fd = hev_socks5_udp_relay_socket ();
+        if (fd < 0)
+            return -1;
+
+        if (connect (fd, (struct sockaddr *)&node->addr,
+                     sizeof (node->addr)) < 0) {
+            close (fd);
+            return -1;
+        }
+
+        node->fd = fd;
+        return 0;
+    }
+
+    if ((table_count >= table_size) && (hev_socks5_udp_relay_grow () < 0))
+        return -1;
+
+    idx = hev_socks5_udp_relay_hash (&node->addr) & (table_size - 1);
+    node->next = table[idx];
+    table[idx] = node;
+    table_count++;
+
+    return 0;
+}
+
+void
+hev_socks5_udp_relay_del (HevSocks5UDPRelayNode *node)
+{
+    HevSocks5UDPRelayNode **prev;
+    unsigned int idx;
+
+    if (node->fd >= 0) {
+        close (node->fd);
+        node->fd = -1;
+        return;
+    }
+
+    if (!table)
+        return;
+
+    if (node->writer) {
+        for (prev = &writers; *prev; prev = &(*prev)->wnext) {
+            if (*prev == node) {
+                *prev = node->wnext;
+                break;
+            }
+        }
+        node->writer = NULL;
+        node->wnext = NULL;
+    }
+
+    idx = hev_socks5_udp_relay_hash (&node->addr) & (table_size - 1);
+    for (prev = &table[idx]; *prev; prev = &(*prev)->next) {
+        if (*prev == node) {
+            *prev = node->next;
+            node->next = NULL;
+            table_count--;
+            break;
+        }
+    }
+}
+
+int
+hev_socks5_udp_relay_sendmmsg (HevSocks5UDPRelayNode *node,
+                               HevSocks5UDPMsg *msgv, unsigned int num)
+{
+    uint8_t hdrs[num][UDP_HDR_SIZE];
+    struct iovec iov[num][2];
+    struct msghdr mhdr = { 0 };
+    int fd = relay_fd;
+    int i, res;
+#if defined(__linux__)
+    struct mmsghdr mmsg[num];
+#endif
+
+    if (node->fd >= 0) {
+        fd = node->fd;
+    } else {
+        mhdr.msg_name = &node->addr;
+        mhdr.msg_namelen = sizeof (node->addr);
+    }
+    mhdr.msg_iovlen = 2;
+
+    for (i = 0; i < num; i++) {
+        int alen = hev_socks5_addr_len (msgv[i].addr);
+
+        hdrs[i][0] = 0;
+        hdrs[i][1] = 0;
+        hdrs[i][2] = 0;
+        memcpy (&hdrs[i][3], msgv[i].addr, alen);
+
+        iov[i][0].iov_base = hdrs[i];
+        iov[i][0].iov_len = 3 + alen;
+        iov[i][1].iov_base = msgv[i].buf;
+        iov[i][1].iov_len = msgv[i].len;
+
+#if defined(__linux__)
+        mmsg[i].msg_hdr = mhdr;
+        mmsg[i].msg_hdr.msg_iov = iov[i];
+        mmsg[i].msg_len = 0;
+#endif
+    }
+
+#if defined(__linux__)
+    res = sendmmsg (fd, mmsg, num, 0);
+#else
+    for (i = 0; i < num; i++) {
+        mhdr.msg_iov = iov[i];
+        if (sendmsg (fd, &mhdr, 0) < 0)
+            break;
+    }
+    res = i ? i : -1;
+#endif
+    if (res < 0) {
+        if (errno != EAGAIN)
+            return -1;
+
+        if (node->fd < 0)
+            hev_socks5_udp_relay_wait (node);
+        return 0;
+    }
+
+    return res;
+}
+
+int
+hev_socks5_udp_relay_recv_node (HevSocks5UDPRelayNode *node, void *buf,
+                                size_t size)
+{
+    uint8_t *data = buf;
+    ssize_t len;
+    int alen;
+
+    len = recv (node->fd, buf, size, 0);
+    if (len < 0) {
+        if (errno == EAGAIN)
+            return 0;
+        return -1;
+    }
+
+    /* RSV (2) | FRAG (1) | ADDR */
+    if ((len < 4) || data[2])
+        return 1;
+
+    alen = hev_socks5_addr_len ((HevSocks5Addr *)&data[3]);
+    if (!alen || ((3 + alen) > len))
+        return 1;
+
+    node->handler (node, (HevSocks5Addr *)&data[3], &data[3 + alen],
+                   len - 3 - alen);
+
+    return 1;
+}
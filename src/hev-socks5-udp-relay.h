@@ -0,0 +1,60 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-udp-relay.h
+ Author      : hev <r@hev.cc>
+ Copyright   : Copyright (c) 2025 hev
+ Description : Socks5 UDP Relay
+ ============================================================================
+ */
+
+#ifndef __HEV_SOCKS5_UDP_RELAY_H__
+#define __HEV_SOCKS5_UDP_RELAY_H__
+
+#include <netinet/in.h>
+
+#include <hev-task.h>
+#include <hev-socks5-udp.h>
+
+typedef struct _HevSocks5UDPRelayNode HevSocks5UDPRelayNode;
+typedef void (*HevSocks5UDPRelayHandler) (HevSocks5UDPRelayNode *node,
+                                          HevSocks5Addr *addr, void *buf,
+                                          size_t len);
+
+struct _HevSocks5UDPRelayNode
+{
+    HevSocks5UDPRelayNode *next;
+    HevSocks5UDPRelayNode *wnext;
+    HevSocks5UDPRelayHandler handler;
+    HevTask *writer;
+    struct sockaddr_in6 addr;
+    int fd;
+};
+
+int hev_socks5_udp_relay_init (unsigned int mark);
+void hev_socks5_udp_relay_fini (void);
+
+void hev_socks5_udp_relay_run (void);
+void hev_socks5_udp_relay_stop (void);
+
+int hev_socks5_udp_relay_set_addr (HevSocks5UDPRelayNode *node, int fd,
+                                   const HevSocks5Addr *baddr,
+                                   const char *udp_addr);
+
+/*
+ * Register @node on the shared socket. If another node already uses its
+ * relay address, @node gets a dedicated socket in @fd instead, the caller
+ * then polls it and reads through hev_socks5_udp_relay_recv_node.
+ */
+int hev_socks5_udp_relay_add (HevSocks5UDPRelayNode *node);
+void hev_socks5_udp_relay_del (HevSocks5UDPRelayNode *node);
+
+/*
+ * Send @msgv to the relay of @node. Returns 0 if the socket is full, the
+ * calling task is then woken once it can take more.
+ */
+int hev_socks5_udp_relay_sendmmsg (HevSocks5UDPRelayNode *node,
+                                   HevSocks5UDPMsg *msgv, unsigned int num);
+int hev_socks5_udp_relay_recv_node (HevSocks5UDPRelayNode *node, void *buf,
+                                    size_t size);
+
+#endif /* __HEV_SOCKS5_UDP_RELAY_H__ */
@@ -0,0 +1,756 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-upstream.c
+ Author      : hev <r@hev.cc>
+ Copyright   : Copyright (c) 2025 hev
+ Description : Socks5 Upstream
+ ============================================================================
+ */
+
+#include <poll.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include <hev-task-dns.h>
+#include <hev-task-io-socket.h>
+#include <hev-memory-allocator.h>
+
+#include "hev-utils.h"
+#include "hev-logger.h"
+#include "hev-socks5-handshake.h"
+
+#include "hev-socks5-upstream.h"
+
+#define RESOLVE_RETRY_INTERVAL (5000)
+#define HEALTH_BACKOFF_MIN (1000)
+#define HEALTH_BACKOFF_MAX (60000)
+#define CONNECT_ATTEMPT_DELAY (250)
+#define NEVER (~0ULL)
+
+static int running;
+static unsigned int next;
+
+static HevSocks5Upstream *upstreams;
+static int upstream_count;
+
+static void
+hev_socks5_upstream_map (struct sockaddr_in6 *dst, const struct sockaddr *src)
+{
+    memset (dst, 0, sizeof (*dst));
+    dst->sin6_family = AF_INET6;
+
+    if (src->sa_family == AF_INET) {
+        const struct sockaddr_in *sa = (const struct sockaddr_in *)src;
+        uint8_t *p = (uint8_t *)&dst->sin6_addr;
+
+        p[10] = 0xff;
+        p[11] = 0xff;
+        memcpy (&p[12], &sa->sin_addr, 4);
+        dst->sin6_port = sa->sin_port;
+    } else {
+        const struct sockaddr_in6 *sa = (const struct sockaddr_in6 *)src;
+
+        dst->sin6_addr = sa->sin6_addr;
+        dst->sin6_port = sa->sin6_port;
+        dst->sin6_scope_id = sa->sin6_scope_id;
+    }
+}
+
+static int
+hev_socks5_upstream_parse (HevSocks5Upstream *self)
+{
+    HevConfigServer *srv = self->srv;
+    struct sockaddr_in6 sa6 = { 0 };
+    struct sockaddr_in sa = { 0 };
+
+    if (inet_pton (AF_INET, srv->addr, &sa.sin_addr) == 1) {
+        sa.sin_family = AF_INET;
+        sa.sin_port = htons (srv->port);
+        hev_socks5_upstream_map (&self->addrs[0], (struct sockaddr *)&sa);
+        return 0;
+    }
+
+    if (inet_pton (AF_INET6, srv->addr, &sa6.sin6_addr) == 1) {
+        sa6.sin6_family = AF_INET6;
+        sa6.sin6_port = htons (srv->port);
+        hev_socks5_upstream_map (&self->addrs[0], (struct sockaddr *)&sa6);
+        return 0;
+    }
+
+    return -1;
+}
+
+static int
+hev_socks5_upstream_resolve (HevSocks5Upstream *self)
+{
+    HevConfigServer *srv = self->srv;
+    struct addrinfo hints = { 0 };
+    struct addrinfo *ai;
+    struct addrinfo *p;
+    char port[16];
+    int count = 0;
+    int res;
+
+    snprintf (port, sizeof (port), "%u", srv->port);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    res = hev_task_dns_getaddrinfo (srv->addr, port, &hints, &ai);
+    if (res != 0) {
+        LOG_W ("%p socks5 upstream resolve %s", self, srv->addr);
+        return -1;
+    }
+
+    for (p = ai; p && (count < HEV_SOCKS5_UPSTREAM_MAX_ADDRS); p = p->ai_next) {
+        if ((p->ai_family != AF_INET) && (p->ai_family != AF_INET6))
+            continue;
+        hev_socks5_upstream_map (&self->addrs[count++], p->ai_addr);
+    }
+
+    hev_task_dns_freeaddrinfo (ai);
+
+    if (!count)
+        return -1;
+
+    self->addr_count = count;
+    LOG_D ("%p socks5 upstream resolve %s %d", self, srv->addr, count);
+
+    return 0;
+}
+
+static int
+hev_socks5_upstream_probe (HevSocks5Upstream *self)
+{
+    HevTask *task = hev_task_self ();
+    HevSocks5UpstreamWait wait;
+    int res;
+    int fd;
+
+    hev_socks5_upstream_wait_init (&wait, &running, NULL);
+
+    fd = hev_socks5_upstream_connect (self, hev_socks5_upstream_yielder,
+                                      &wait);
+    if (fd < 0)
+        return -1;
+
+    hev_task_add_fd (task, fd, POLLIN | POLLOUT);
+    res = hev_socks5_handshake_greet (fd, !!self->srv->user,
+                                      hev_socks5_upstream_yielder, &wait);
+    hev_task_del_fd (task, fd);
+    close (fd);
+
+    hev_socks5_upstream_report (self, res == 0);
+
+    return res;
+}
+
+static void
+hev_socks5_upstream_task_entry (void *data)
+{
+    HevSocks5Upstream *self = data;
+    HevConfigServer *srv = self->srv;
+    unsigned long long resolve_at = 0;
+
+    LOG_D ("%p socks5 upstream task run", self);
+
+    if (!srv->health_interval)
+        self->probe_at = NEVER;
+    if (self->addr_count)
+        resolve_at = NEVER;
+
+    while (running) {
+        unsigned long long now = get_time_msec ();
+        unsigned long long wake;
+
+        if (now >= resolve_at) {
+            if (hev_socks5_upstream_resolve (self) < 0)
+                resolve_at = now + RESOLVE_RETRY_INTERVAL;
+            else if (srv->addr_ttl)
+                resolve_at = now + srv->addr_ttl * 1000ULL;
+            else
+                resolve_at = NEVER;
+            continue;
+        }
+
+        if (now >= self->probe_at) {
+            if (hev_socks5_upstream_probe (self) < 0)
+                LOG_D ("%p socks5 upstream probe", self);
+            /* A report may have rescheduled the probe already. */
+            if (self->probe_at <= now)
+                self->probe_at = get_time_msec () +
+                                 srv->health_interval * 1000ULL;
+            continue;
+        }
+
+        /* Keep the previous addresses until a refresh succeeds. */
+        wake = (resolve_at < self->probe_at) ? resolve_at : self->probe_at;
+        if (wake == NEVER)
+            hev_task_yield (HEV_TASK_WAITIO);
+        else
+            hev_task_sleep (wake - now);
+    }
+}
+
+int
+hev_socks5_upstream_init (void)
+{
+    HevConfigServer *srvs;
+    int stack_size;
+    int count;
+    int i;
+
+    LOG_D ("socks5 upstream init");
+
+    srvs = hev_config_get_socks5_servers (&count);
+    upstreams = hev_calloc (count, sizeof (HevSocks5Upstream));
+    if (!upstreams) {
+        LOG_E ("socks5 upstream alloc");
+        return -1;
+    }
+    upstream_count = count;
+
+    stack_size = hev_config_get_misc_task_stack_size ();
+    for (i = 0; i < count; i++) {
+        HevSocks5Upstream *self = &upstreams[i];
+
+        self->srv = &srvs[i];
+        self->backoff = HEALTH_BACKOFF_MIN;
+        if (hev_socks5_upstream_parse (self) == 0) {
+            self->addr_count = 1;
+            if (!self->srv->health_interval)
+                continue;
+        }
+
+        self->task = hev_task_new (stack_size);
+        if (!self->task) {
+            LOG_E ("socks5 upstream task");
+            goto exit;
+        }
+    }
+
+    return 0;
+
+exit:
+    hev_socks5_upstream_fini ();
+    return -1;
+}
+
+void
+hev_socks5_upstream_fini (void)
+{
+    int i;
+
+    LOG_D ("socks5 upstream fini");
+
+    for (i = 0; i < upstream_count; i++) {
+        HevSocks5Upstream *self = &upstreams[i];
+
+        if (self->task)
+            hev_task_unref (self->task);
+    }
+
+    if (upstreams) {
+        hev_free (upstreams);
+        upstreams = NULL;
+    }
+    upstream_count = 0;
+    next = 0;
+}
+
+void
+hev_socks5_upstream_run (void)
+{
+    int i;
+
+    running = 1;
+    for (i = 0; i < upstream_count; i++) {
+        HevSocks5Upstream *self = &upstreams[i];
+
+        if (!self->task)
+            continue;
+
+        self->task = hev_task_ref (self->task);
+        hev_task_run (self->task, hev_socks5_upstream_task_entry, self);
+    }
+}
+
+void
+hev_socks5_upstream_stop (void)
+{
+    int i;
+
+    if (!running)
+        return;
+
+    running = 0;
+    for (i = 0; i < upstream_count; i++) {
+        HevSocks5Upstream *self = &upstreams[i];
+
+        if (!self->task)
+            continue;
+
+        hev_task_wakeup (self->task);
+        hev_task_join (self->task);
+    }
+}
+
+int
+hev_socks5_upstream_get_count (void)
+{
+    return upstream_count;
+}
+
+HevSocks5Upstream *
+hev_socks5_upstream_get (int index)
+{
+    if ((index < 0) || (index >= upstream_count))
+        return NULL;
+
+    return &upstreams[index];
+}
+
+HevSocks5Upstream *
+hev_socks5_upstream_get_only (void)
+{
+    HevSocks5Upstream *only = NULL;
+    int i;
+
+    for (i = 0; i < upstream_count; i++) {
+        if (upstreams[i].down)
+            continue;
+        if (only)
+            return NULL;
+        only = &upstreams[i];
+    }
+
+    return only;
+}
+
+static HevSocks5Upstream *
+hev_socks5_upstream_select_min (int latency)
+{
+    HevSocks5Upstream *best = NULL;
+    unsigned long long best_score = 0;
+    int i;
+
+    /* Start after the last pick so ties rotate instead of piling up. */
+    for (i = 0; i < upstream_count; i++) {
+        HevSocks5Upstream *self = &upstreams[(next + i) % upstream_count];
+        unsigned long long score = self->sessions + 1;
+
+        if (self->down)
+            continue;
+
+        if (latency)
+            score *= self->latency + 1;
+
+        if (!best || (score < best_score)) {
+            best = self;
+            best_score = score;
+        }
+    }
+
+    if (best)
+        next = (best - upstreams) + 1;
+
+    return best;
+}
+
+static HevSocks5Upstream *
+hev_socks5_upstream_select_from (unsigned int start)
+{
+    int i;
+
+    for (i = 0; i < upstream_count; i++) {
+        HevSocks5Upstream *self = &upstreams[(start + i) % upstream_count];
+
+        if (!self->down)
+            return self;
+    }
+
+    return NULL;
+}
+
+HevSocks5Upstream *
+hev_socks5_upstream_select (uint32_t hash)
+{
+    HevSocks5Upstream *self;
+
+    switch (hev_config_get_socks5_balance ()) {
+    case HEV_CONFIG_BALANCE_LEAST_SESSIONS:
+        self = hev_socks5_upstream_select_min (0);
+        break;
+    case HEV_CONFIG_BALANCE_LATENCY:
+        self = hev_socks5_upstream_select_min (1);
+        break;
+    case HEV_CONFIG_BALANCE_FLOW_HASH:
+        self = hev_socks5_upstream_select_from (hash % upstream_count);
+        break;
+    default:
+        self = hev_socks5_upstream_select_from (next++ % upstream_count);
+    }
+
+    /* All down: keep trying by round-robin rather than refusing sessions. */
+    if (!self)
+        self = &upstreams[next++ % upstream_count];
+
+    self->sessions++;
+
+    return self;
+}
+
+void
+hev_socks5_upstream_release (HevSocks5Upstream *self)
+{
+    self->sessions--;
+}
+
+void
+hev_socks5_upstream_report (HevSocks5Upstream *self, int ok)
+{
+    HevConfigServer *srv = self->srv;
+
+    if (ok) {
+        if (self->down)
+            LOG_I ("%p socks5 upstream %s up", self, srv->addr);
+        self->down = 0;
+        self->failures = 0;
+        self->backoff = HEALTH_BACKOFF_MIN;
+        return;
+    }
+
+    /* Without probes nothing could bring a down upstream back. */
+    if (!srv->health_interval)
+        return;
+
+    self->failures++;
+    if (self->failures < srv->health_failures)
+        return;
+
+    if (!self->down)
+        LOG_W ("%p socks5 upstream %s down", self, srv->addr);
+    self->down = 1;
+
+    /* Re-probe a down upstream with exponential backoff. */
+    self->probe_at = get_time_msec () + self->backoff;
+    self->backoff *= 2;
+    if (self->backoff > HEALTH_BACKOFF_MAX)
+        self->backoff = HEALTH_BACKOFF_MAX;
+
+    if (self->task && running)
+        hev_task_wakeup (self->task);
+}
+
+static void
+hev_socks5_upstream_sample (HevSocks5Upstream *self, unsigned int latency)
+{
+    /* EWMA with a weight of 1/8 for the new sample. */
+    if (self->latency)
+        self->latency = (self->latency * 7 + latency) / 8;
+    else
+        self->latency = latency;
+}
+
+static int
+hev_socks5_upstream_family (const struct sockaddr_in6 *addr)
+{
+    if (IN6_IS_ADDR_V4MAPPED (&addr->sin6_addr))
+        return AF_INET;
+
+    return AF_INET6;
+}
+
+static int
+hev_socks5_upstream_order (HevSocks5Upstream *self,
+                           struct sockaddr_in6 *addrs)
+{
+    int count = self->addr_count;
+    int family = self->family;
+    int i, j, n = 0;
+
+    if (!count)
+        return 0;
+
+    if (!family)
+        family = hev_socks5_upstream_family (&self->addrs[0]);
+
+    /* RFC 8305 section 4: alternate families, preferred family first. */
+    for (i = 0, j = 0; n < count;) {
+        for (; i < count; i++) {
+            if (hev_socks5_upstream_family (&self->addrs[i]) == family)
+                break;
+        }
+        if (i < count)
+            addrs[n++] = self->addrs[i++];
+
+        for (; j < count; j++) {
+            if (hev_socks5_upstream_family (&self->addrs[j]) != family)
+                break;
+        }
+        if (j < count)
+            addrs[n++] = self->addrs[j++];
+    }
+
+    return n;
+}
+
+static int
+hev_socks5_upstream_socket (HevSocks5Upstream *self, int fastopen)
+{
+    HevConfigServer *srv = self->srv;
+    int zero = 0;
+    int res;
+    int fd;
+
+    fd = hev_task_io_socket_socket (AF_INET6, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+
+    setsockopt (fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof (zero));
+
+    if (srv->mark) {
+        res = set_sock_mark (fd, srv->mark);
+        if (res < 0) {
+            close (fd);
+            return -1;
+        }
+    }
+
+    set_sock_tcp_fastopen (fd, fastopen);
+
+    return fd;
+}
+
+static int
+hev_socks5_upstream_attempt (HevSocks5Upstream *self,
+                             const struct sockaddr_in6 *addr, int fastopen,
+                             int *done)
+{
+    int res;
+    int fd;
+
+    fd = hev_socks5_upstream_socket (self, fastopen);
+    if (fd < 0)
+        return -1;
+
+    res = connect (fd, (struct sockaddr *)addr, sizeof (*addr));
+    if (res == 0) {
+        *done = 1;
+        return fd;
+    }
+
+    if (errno != EINPROGRESS) {
+        close (fd);
+        return -1;
+    }
+
+    *done = 0;
+    return fd;
+}
+
+static int
+hev_socks5_upstream_check (int fd)
+{
+    struct pollfd pfd = { fd, POLLOUT, 0 };
+    socklen_t len = sizeof (int);
+    int err = 0;
+
+    if (poll (&pfd, 1, 0) <= 0)
+        return 0;
+
+    getsockopt (fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    if (err)
+        return -1;
+
+    return 1;
+}
+
+int
+hev_socks5_upstream_connect (HevSocks5Upstream *self,
+                             HevTaskIOYielder yielder, void *yielder_data)
+{
+    struct sockaddr_in6 addrs[HEV_SOCKS5_UPSTREAM_MAX_ADDRS];
+    int fds[HEV_SOCKS5_UPSTREAM_MAX_ADDRS];
+    HevTask *task = hev_task_self ();
+    unsigned long long start, deadline, next_at;
+    int started = 0, pending = 0;
+    int aborted = 0;
+    int fastopen;
+    int count;
+    int win = -1;
+    int i;
+
+    count = hev_socks5_upstream_order (self, addrs);
+    if (!count)
+        return -1;
+
+    /*
+     * A fast open connect returns at once without sending a SYN, it would
+     * win every race and says nothing about latency, so only a lone
+     * address uses it.
+     */
+    fastopen = self->srv->fastopen && (count == 1);
+
+    start = get_time_msec ();
+    deadline = start + hev_config_get_misc_connect_timeout ();
+    next_at = start;
+
+    /* Our own yielder carries the deadline of the whole exchange. */
+    if (yielder == hev_socks5_upstream_yielder) {
+        HevSocks5UpstreamWait *wait = yielder_data;
+
+        if (wait->deadline < deadline)
+            deadline = wait->deadline;
+    }
+
+    for (;;) {
+        unsigned long long now = get_time_msec ();
+        unsigned long long wake;
+        int res;
+
+        if (now >= deadline)
+            break;
+
+        /* Start the next attempt when the delay passed or one failed. */
+        if ((started < count) && (now >= next_at)) {
+            int done;
+            int fd;
+
+            fd = hev_socks5_upstream_attempt (self, &addrs[started], fastopen,
+                                              &done);
+            fds[started] = fd;
+            if (fd < 0) {
+                next_at = now;
+                started++;
+                continue;
+            }
+
+            hev_task_add_fd (task, fd, POLLIN | POLLOUT);
+            if (done) {
+                win = started++;
+                break;
+            }
+
+            next_at = now + CONNECT_ATTEMPT_DELAY;
+            pending++;
+            started++;
+            continue;
+        }
+
+        for (i = 0; i < started; i++) {
+            if (fds[i] < 0)
+                continue;
+
+            res = hev_socks5_upstream_check (fds[i]);
+            if (res > 0) {
+                win = i;
+                break;
+            }
+
+            if (res < 0) {
+                hev_task_del_fd (task, fds[i]);
+                close (fds[i]);
+                fds[i] = -1;
+                next_at = now;
+                pending--;
+            }
+        }
+
+        if (win >= 0)
+            break;
+
+        if (!pending && (started == count))
+            break;
+
+        if ((started < count) && (now >= next_at))
+            continue;
+
+        /*
+         * Sleep until the next attempt is due, or once all are started
+         * wait for one of them to become writable.
+         */
+        res = 0;
+        if ((started < count) || !yielder) {
+            wake = deadline;
+            if ((started < count) && (next_at < wake))
+                wake = next_at;
+            hev_task_sleep (wake - now);
+
+            if (yielder)
+                res = yielder (HEV_TASK_YIELD, yielder_data);
+        } else {
+            res = yielder (HEV_TASK_WAITIO, yielder_data);
+        }
+
+        /* A yielder timing out at the deadline is a failed race. */
+        if (res < 0) {
+            aborted = get_time_msec () < deadline;
+            break;
+        }
+    }
+
+    for (i = 0; i < started; i++) {
+        if (fds[i] < 0)
+            continue;
+
+        hev_task_del_fd (task, fds[i]);
+        if (i != win)
+            close (fds[i]);
+    }
+
+    if (win < 0) {
+        /* The caller giving up says nothing about the server. */
+        if (!aborted)
+            hev_socks5_upstream_report (self, 0);
+        return -1;
+    }
+
+    self->family = hev_socks5_upstream_family (&addrs[win]);
+    if (!fastopen)
+        hev_socks5_upstream_sample (self, get_time_msec () - start);
+
+    return fds[win];
+}
+
+void
+hev_socks5_upstream_wait_init (HevSocks5UpstreamWait *wait,
+                               const int *running, const int *cancel)
+{
+    wait->deadline = get_time_msec () + hev_config_get_misc_connect_timeout ();
+    wait->running = running;
+    wait->cancel = cancel;
+}
+
+static int
+hev_socks5_upstream_wait_done (HevSocks5UpstreamWait *wait)
+{
+    return !*wait->running || (wait->cancel && *wait->cancel);
+}
+
+int
+hev_socks5_upstream_yielder (HevTaskYieldType type, void *data)
+{
+    HevSocks5UpstreamWait *wait = data;
+
+    if (hev_socks5_upstream_wait_done (wait))
+        return -1;
+
+    if (type == HEV_TASK_YIELD) {
+        hev_task_yield (HEV_TASK_YIELD);
+    } else {
+        unsigned long long now = get_time_msec ();
+
+        /* One deadline for the whole exchange, not a timeout per wait. */
+        if (now >= wait->deadline)
+            return -1;
+        if (hev_task_sleep (wait->deadline - now) <= 0)
+            return -1;
+    }
+
+    return hev_socks5_upstream_wait_done (wait) ? -1 : 0;
+}
@@ -0,0 +1,101 @@
+/*
+ ============================================================================
+ Name        : hev-socks5-upstream.h
+ Author      : hev <r@hev.cc>
+ Copyright   : Copyright (c) 2025 hev
+ Description : Socks5 Upstream
+ ============================================================================
+ */
+
+#ifndef __HEV_SOCKS5_UPSTREAM_H__
+#define __HEV_SOCKS5_UPSTREAM_H__
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include <hev-task.h>
+#include <hev-task-io.h>
+
+#include "hev-config.h"
+
+#define HEV_SOCKS5_UPSTREAM_MAX_ADDRS (8)
+
+typedef struct _HevSocks5Upstream HevSocks5Upstream;
+
+struct _HevSocks5Upstream
+{
+    HevConfigServer *srv;
+    HevTask *task;
+
+    unsigned int sessions;
+    unsigned int latency;
+    int family;
+
+    unsigned int down;
+    unsigned int failures;
+    unsigned int backoff;
+    unsigned long long probe_at;
+
+    int addr_count;
+    struct sockaddr_in6 addrs[HEV_SOCKS5_UPSTREAM_MAX_ADDRS];
+};
+
+int hev_socks5_upstream_init (void);
+void hev_socks5_upstream_fini (void);
+
+void hev_socks5_upstream_run (void);
+void hev_socks5_upstream_stop (void);
+
+int hev_socks5_upstream_get_count (void);
+HevSocks5Upstream *hev_socks5_upstream_get (int index);
+
+/* The upstream that is up if it is the only one, else NULL. */
+HevSocks5Upstream *hev_socks5_upstream_get_only (void);
+
+/*
+ * Pick an upstream for a new session by the configured balance policy and
+ * account the session to it. @hash identifies the flow for flow-hash.
+ */
+HevSocks5Upstream *hev_socks5_upstream_select (uint32_t hash);
+void hev_socks5_upstream_release (HevSocks5Upstream *self);
+
+/*
+ * Feed the health state: @ok resets the failure count, failures mark the
+ * upstream down once health-check-failures is reached.
+ */
+void hev_socks5_upstream_report (HevSocks5Upstream *self, int ok);
+
+/*
+ * Connect a TCP socket, bound with the mark and fastopen settings of the
+ * upstream, to the cached addresses. Attempts race Happy Eyeballs style
+ * (RFC 8305): families alternate starting with the last winning one, and a
+ * new attempt starts every 250 ms or as soon as one fails. The whole race
+ * is bounded by connect-timeout; @yielder is polled between waits to
+ * abort. A failed race counts against the upstream, an aborted one does
+ * not. The returned socket is not registered with any task.
+ */
+int hev_socks5_upstream_connect (HevSocks5Upstream *self,
+                                 HevTaskIOYielder yielder, void *yielder_data);
+
+/*
+ * Yielder state for background tasks that connect and talk to an upstream.
+ * Waits never run past @deadline, and the exchange aborts once *@running
+ * drops to zero or *@cancel, if given, turns non-zero.
+ */
+typedef struct _HevSocks5UpstreamWait HevSocks5UpstreamWait;
+
+struct _HevSocks5UpstreamWait
+{
+    unsigned long long deadline;
+    const int *running;
+    const int *cancel;
+};
+
+/* Start a wait bounded by connect-timeout from now. */
+void hev_socks5_upstream_wait_init (HevSocks5UpstreamWait *wait,
+                                    const int *running, const int *cancel);
+
+/* A HevTaskIOYielder taking the HevSocks5UpstreamWait as its data. */
+int hev_socks5_upstream_yielder (HevTaskYieldType type, void *data);
+
+#endif /* __HEV_SOCKS5_UPSTREAM_H__ */
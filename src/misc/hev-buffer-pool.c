@@ -0,0 +1,84 @@
+/*
+ ============================================================================
+ Name        : hev-buffer-pool.c
+ Author      : hev <r@hev.cc>
+ Copyright   : Copyright (c) 2025 hev
+ Description : Buffer pool
+ ============================================================================
+ */
+
+#include <hev-memory-allocator.h>
+
+#include "hev-buffer-pool.h"
+
+struct _HevBufferPool
+{
+    void *free;
+    size_t size;
+    int count;
+    int max;
+};
+
+HevBufferPool *
+hev_buffer_pool_new (size_t size, int max)
+{
+    HevBufferPool *self;
+
+    self = hev_malloc0 (sizeof (HevBufferPool));
+    if (!self)
+        return NULL;
+
+    if (size < sizeof (void *))
+        size = sizeof (void *);
+
+    self->size = size;
+    self->max = max;
+
+    return self;
+}
+
+void
+hev_buffer_pool_destroy (HevBufferPool *self)
+{
+    while (self->free) {
+        void **buf = self->free;
+
+        self->free = *buf;
+        hev_free (buf);
+    }
+
+    hev_free (self);
+}
+
+size_t
+hev_buffer_pool_get_size (HevBufferPool *self)
+{
+    return self->size;
+}
+
+void *
+hev_buffer_pool_alloc (HevBufferPool *self)
+{
+    void **buf = self->free;
+
+    if (!buf)
+        return hev_malloc (self->size);
+
+    self->free = *buf;
+    self->count--;
+
+    return buf;
+}
+
+void
+hev_buffer_pool_free (HevBufferPool *self, void *buf)
+{
+    if (self->count >= self->max) {
+        hev_free (buf);
+        return;
+    }
+
+    *(void **)buf = self->free;
+    self->free = buf;
+    self->count++;
+}
@@ -0,0 +1,25 @@
+/*
+ ============================================================================
+ Name        : hev-buffer-pool.h
+ Author      : hev <r@hev.cc>
+ Copyright   : Copyright (c) 2025 hev
+ Description : Buffer pool
+ ============================================================================
+ */
+
+#ifndef __HEV_BUFFER_POOL_H__
+#define __HEV_BUFFER_POOL_H__
+
+#include <stddef.h>
+
+typedef struct _HevBufferPool HevBufferPool;
+
+HevBufferPool *hev_buffer_pool_new (size_t size, int max);
+void hev_buffer_pool_destroy (HevBufferPool *self);
+
+size_t hev_buffer_pool_get_size (HevBufferPool *self);
+
+void *hev_buffer_pool_alloc (HevBufferPool *self);
+void hev_buffer_pool_free (HevBufferPool *self, void *buf);
+
+#endif /* __HEV_BUFFER_POOL_H__ */
@@ -0,0 +1,326 @@
+/*
+ ============================================================================
+ Name        : hev-domain-trie.c
+ Author      : hev <r@hev.cc>
+ Copyright   : Copyright (c) 2025 hev
+ Description : Domain trie
+ ============================================================================
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <hev-memory-allocator.h>
+
+#include "hev-domain-trie.h"
+
+#define FNV_BASIS (2166136261u)
+#define FNV_PRIME (16777619u)
+
+typedef struct _HevDomainTrieNode HevDomainTrieNode;
+typedef struct _HevDomainTrieSlot HevDomainTrieSlot;
+
+/*
+ * A node is one label under its parent, the rightmost label hangs off the
+ * root at index 0. Nodes link by index and their labels sit lowercased in
+ * one arena, so the trie is a handful of flat blocks.
+ */
+struct _HevDomainTrieNode
+{
+    uint32_t parent;
+    uint32_t label;
+    uint32_t len;
+    int32_t exact;
+    int32_t below;
+};
+
+/*
+ * Children are found through one table keyed on the parent and the label,
+ * so a busy parent such as "com" costs one probe per label, not a scan.
+ * Open addressing with linear probing, node 0 marks an empty slot.
+ */
+struct _HevDomainTrieSlot
+{
+    uint32_t hash;
+    uint32_t node;
+};
+
+struct _HevDomainTrie
+{
+    HevDomainTrieNode *nodes;
+    HevDomainTrieSlot *slots;
+    char *labels;
+    uint32_t count;
+    uint32_t size;
+    uint32_t slot_mask;
+    uint32_t labels_len;
+    uint32_t labels_size;
+};
+
+static inline int
+hev_domain_trie_lower (int c)
+{
+    if ((c >= 'A') && (c <= 'Z'))
+        return c + ('a' - 'A');
+
+    return c;
+}
+
+static uint32_t
+hev_domain_trie_hash (uint32_t parent, const char *label, int len)
+{
+    uint32_t hash = (FNV_BASIS ^ parent) * FNV_PRIME;
+    int i;
+
+    for (i = 0; i < len; i++) {
+        hash ^= (uint8_t)hev_domain_trie_lower (label[i]);
+        hash *= FNV_PRIME;
+    }
+
+    return hash;
+}
+
+static int
+hev_domain_trie_equal (HevDomainTrie *self, HevDomainTrieNode *node,
+                       const char *label, int len)
+{
+    const char *s = &self->labels[node->label];
+    int i;
+
+    if (node->len != len)
+        return 0;
+
+    for (i = 0; i < len; i++)
+        if (s[i] != hev_domain_trie_lower (label[i]))
+            return 0;
+
+    return 1;
+}
+
+static uint32_t
+hev_domain_trie_child (HevDomainTrie *self, uint32_t parent,
+                       const char *label, int len)
+{
+    uint32_t hash = hev_domain_trie_hash (parent, label, len);
+    uint32_t i;
+
+    for (i = hash & self->slot_mask;; i = (i + 1) & self->slot_mask) {
+        HevDomainTrieSlot *slot = &self->slots[i];
+        HevDomainTrieNode *node;
+
+        if (!slot->node)
+            return 0;
+        if (slot->hash != hash)
+            continue;
+
+        node = &self->nodes[slot->node];
+        if ((node->parent == parent) &&
+            hev_domain_trie_equal (self, node, label, len))
+            return slot->node;
+    }
+}
+
+static int
+hev_domain_trie_grow (HevDomainTrie *self)
+{
+    HevDomainTrieSlot *slots;
+    uint32_t mask;
+    uint32_t i;
+
+    mask = self->slot_mask * 2 + 1;
+    slots = hev_calloc (mask + 1, sizeof (HevDomainTrieSlot));
+    if (!slots)
+        return -1;
+
+    for (i = 0; i <= self->slot_mask; i++) {
+        HevDomainTrieSlot *slot = &self->slots[i];
+        uint32_t j;
+
+        if (!slot->node)
+            continue;
+
+        for (j = slot->hash & mask; slots[j].node; j = (j + 1) & mask)
+            ;
+        slots[j] = *slot;
+    }
+
+    hev_free (self->slots);
+    self->slots = slots;
+    self->slot_mask = mask;
+
+    return 0;
+}
+
+static uint32_t
+hev_domain_trie_node_new (HevDomainTrie *self, uint32_t parent,
+                          const char *label, int len)
+{
+    HevDomainTrieNode *node;
+    uint32_t hash;
+    uint32_t i;
+
+    if (self->count == self->size) {
+        HevDomainTrieNode *nodes;
+        uint32_t size;
+
+        size = self->size ? self->size * 2 : 64;
+        nodes = hev_realloc (self->nodes, sizeof (HevDomainTrieNode) * size);
+        if (!nodes)
+            return 0;
+
+        self->nodes = nodes;
+        self->size = size;
+    }
+
+    if ((self->labels_len + len) > self->labels_size) {
+        uint32_t size;
+        char *labels;
+
+        size = self->labels_size ? self->labels_size : 256;
+        while (size < (self->labels_len + len))
+            size *= 2;
+
+        labels = hev_realloc (self->labels, size);
+        if (!labels)
+            return 0;
+
+        self->labels = labels;
+        self->labels_size = size;
+    }
+
+    /* Keep the child table at most half full. */
+    if ((self->count * 2) > self->slot_mask)
+        if (hev_domain_trie_grow (self) < 0)
+            return 0;
+
+    node = &self->nodes[self->count];
+    node->parent = parent;
+    node->label = self->labels_len;
+    node->len = len;
+    node->exact = -1;
+    node->below = -1;
+
+    for (i = 0; i < len; i++)
+        self->labels[self->labels_len++] = hev_domain_trie_lower (label[i]);
+
+    hash = hev_domain_trie_hash (parent, label, len);
+    for (i = hash & self->slot_mask; self->slots[i].node;
+         i = (i + 1) & self->slot_mask)
+        ;
+    self->slots[i].hash = hash;
+    self->slots[i].node = self->count;
+
+    return self->count++;
+}
+
+HevDomainTrie *
+hev_domain_trie_new (void)
+{
+    HevDomainTrie *self;
+
+    self = hev_malloc0 (sizeof (HevDomainTrie));
+    if (!self)
+        return NULL;
+
+    self->slot_mask = 63;
+    self->slots = hev_calloc (self->slot_mask + 1, sizeof (HevDomainTrieSlot));
+    self->nodes = hev_malloc (sizeof (HevDomainTrieNode) * 64);
+    if (!self->slots || !self->nodes) {
+        hev_domain_trie_destroy (self);
+        return NULL;
+    }
+
+    self->size = 64;
+    self->count = 1;
+    self->nodes[0].parent = 0;
+    self->nodes[0].label = 0;
+    self->nodes[0].len = 0;
+    self->nodes[0].exact = -1;
+    self->nodes[0].below = -1;
+
+    return self;
+}
+
+void
+hev_domain_trie_destroy (HevDomainTrie *self)
+{
+    hev_free (self->nodes);
+    hev_free (self->slots);
+    hev_free (self->labels);
+    hev_free (self);
+}
+
+int
+hev_domain_trie_insert (HevDomainTrie *self, const char *name, int len,
+                        int value, int flags)
+{
+    uint32_t index = 0;
+    int end = len;
+
+    if ((end > 0) && (name[end - 1] == '.'))
+        end--;
+
+    while (end > 0) {
+        uint32_t next;
+        int start;
+
+        for (start = end; (start > 0) && (name[start - 1] != '.'); start--)
+            ;
+        if (start == end)
+            return -1;
+
+        next = hev_domain_trie_child (self, index, &name[start], end - start);
+        if (!next) {
+            next = hev_domain_trie_node_new (self, index, &name[start],
+                                             end - start);
+            if (!next)
+                return -1;
+        }
+
+        index = next;
+        end = start - 1;
+    }
+
+    if (flags & HEV_DOMAIN_TRIE_EXACT)
+        self->nodes[index].exact = value;
+    if (flags & HEV_DOMAIN_TRIE_BELOW)
+        self->nodes[index].below = value;
+
+    return 0;
+}
+
+int
+hev_domain_trie_lookup (HevDomainTrie *self, const char *name, int len)
+{
+    HevDomainTrieNode *nodes = self->nodes;
+    int value = nodes[0].below;
+    uint32_t index = 0;
+    int end = len;
+
+    if ((end > 0) && (name[end - 1] == '.'))
+        end--;
+
+    while (end > 0) {
+        int start;
+
+        for (start = end; (start > 0) && (name[start - 1] != '.'); start--)
+            ;
+
+        index = hev_domain_trie_child (self, index, &name[start], end - start);
+        if (!index)
+            break;
+
+        if (!start) {
+            if (nodes[index].exact >= 0)
+                value = nodes[index].exact;
+            break;
+        }
+
+        if (nodes[index].below >= 0)
+            value = nodes[index].below;
+
+        end = start - 1;
+    }
+
+    return value;
+}
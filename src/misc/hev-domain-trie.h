@@ -0,0 +1,40 @@
+/*
+ ============================================================================
+ Name        : hev-domain-trie.h
+ Author      : hev <r@hev.cc>
+ Copyright   : Copyright (c) 2025 hev
+ Description : Domain trie
+ ============================================================================
+ */
+
+#ifndef __HEV_DOMAIN_TRIE_H__
+#define __HEV_DOMAIN_TRIE_H__
+
+typedef struct _HevDomainTrie HevDomainTrie;
+
+enum
+{
+    HEV_DOMAIN_TRIE_EXACT = 1 << 0,
+    HEV_DOMAIN_TRIE_BELOW = 1 << 1,
+};
+
+HevDomainTrie *hev_domain_trie_new (void);
+void hev_domain_trie_destroy (HevDomainTrie *self);
+
+/*
+ * Map the dotted @name of @len bytes to @value, which must not be
+ * negative. @flags picks whether it covers the name itself, the names
+ * below it, or both. An empty name is the root, so BELOW on it covers
+ * every name. Names compare case insensitively, a later insert of the
+ * same name and flag replaces the value.
+ */
+int hev_domain_trie_insert (HevDomainTrie *self, const char *name, int len,
+                            int value, int flags);
+
+/*
+ * Match @name label by label from the right. Returns the value of the
+ * most specific entry covering it, or -1 if none does.
+ */
+int hev_domain_trie_lookup (HevDomainTrie *self, const char *name, int len);
+
+#endif /* __HEV_DOMAIN_TRIE_H__ */
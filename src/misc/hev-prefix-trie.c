@@ -0,0 +1,138 @@
+/*
+ ============================================================================
+ Name        : hev-prefix-trie.c
+ Author      : hev <r@hev.cc>
+ Copyright   : Copyright (c) 2025 hev
+ Description : Prefix trie
+ ============================================================================
+ */
+
+#include <stdint.h>
+
+#include <hev-memory-allocator.h>
+
+#include "hev-prefix-trie.h"
+
+typedef struct _HevPrefixTrieNode HevPrefixTrieNode;
+
+/*
+ * Nodes live in one array and link by index, so a lookup walks a compact
+ * block instead of chasing heap pointers. Index 0 is the root, which no
+ * node links to, so 0 doubles as the empty child.
+ */
+struct _HevPrefixTrieNode
+{
+    uint32_t child[2];
+    int32_t value;
+};
+
+struct _HevPrefixTrie
+{
+    HevPrefixTrieNode *nodes;
+    uint32_t count;
+    uint32_t size;
+};
+
+static inline int
+hev_prefix_trie_bit (const uint8_t *key, int i)
+{
+    return (key[i >> 3] >> (7 - (i & 7))) & 1;
+}
+
+static uint32_t
+hev_prefix_trie_node_new (HevPrefixTrie *self)
+{
+    HevPrefixTrieNode *node;
+
+    if (self->count == self->size) {
+        HevPrefixTrieNode *nodes;
+        uint32_t size;
+
+        size = self->size ? self->size * 2 : 64;
+        nodes = hev_realloc (self->nodes, sizeof (HevPrefixTrieNode) * size);
+        if (!nodes)
+            return 0;
+
+        self->nodes = nodes;
+        self->size = size;
+    }
+
+    node = &self->nodes[self->count];
+    node->child[0] = 0;
+    node->child[1] = 0;
+    node->value = -1;
+
+    return self->count++;
+}
+
+HevPrefixTrie *
+hev_prefix_trie_new (void)
+{
+    HevPrefixTrie *self;
+
+    self = hev_malloc0 (sizeof (HevPrefixTrie));
+    if (!self)
+        return NULL;
+
+    hev_prefix_trie_node_new (self);
+    if (!self->count) {
+        hev_free (self);
+        return NULL;
+    }
+
+    return self;
+}
+
+void
+hev_prefix_trie_destroy (HevPrefixTrie *self)
+{
+    hev_free (self->nodes);
+    hev_free (self);
+}
+
+int
+hev_prefix_trie_insert (HevPrefixTrie *self, const void *key, int bits,
+                        int value)
+{
+    uint32_t index = 0;
+    int i;
+
+    for (i = 0; i < bits; i++) {
+        int bit = hev_prefix_trie_bit (key, i);
+        uint32_t next;
+
+        next = self->nodes[index].child[bit];
+        if (!next) {
+            next = hev_prefix_trie_node_new (self);
+            if (!next)
+                return -1;
+            self->nodes[index].child[bit] = next;
+        }
+
+        index = next;
+    }
+
+    self->nodes[index].value = value;
+
+    return 0;
+}
+
+int
+hev_prefix_trie_lookup (HevPrefixTrie *self, const void *key, int bits)
+{
+    HevPrefixTrieNode *nodes = self->nodes;
+    int value = nodes[0].value;
+    uint32_t index = 0;
+    int i;
+
+    for (i = 0; i < bits; i++) {
+        index = nodes[index].child[hev_prefix_trie_bit (key, i)];
+        if (!index)
+            break;
+
+        if (nodes[index].value >= 0)
+            value = nodes[index].value;
+    }
+
+    return value;
+}
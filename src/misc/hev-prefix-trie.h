@@ -0,0 +1,31 @@
+/*
+ ============================================================================
+ Name        : hev-prefix-trie.h
+ Author      : hev <r@hev.cc>
+ Copyright   : Copyright (c) 2025 hev
+ Description : Prefix trie
+ ============================================================================
+ */
+
+#ifndef __HEV_PREFIX_TRIE_H__
+#define __HEV_PREFIX_TRIE_H__
+
+typedef struct _HevPrefixTrie HevPrefixTrie;
+
+HevPrefixTrie *hev_prefix_trie_new (void);
+void hev_prefix_trie_destroy (HevPrefixTrie *self);
+
+/*
+ * Map the first @bits bits of @key (network order) to @value, which must
+ * not be negative. A later insert of the same prefix replaces the value.
+ */
+int hev_prefix_trie_insert (HevPrefixTrie *self, const void *key, int bits,
+                            int value);
+
+/*
+ * Longest prefix match of @key over at most @bits bits. Returns the value
+ * of the longest matching prefix, or -1 if none matches.
+ */
+int hev_prefix_trie_lookup (HevPrefixTrie *self, const void *key, int bits);
+
+#endif /* __HEV_PREFIX_TRIE_H__ */
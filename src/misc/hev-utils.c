@@ -10,6 +10,7 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <sys/resource.h>
 
@@ -98,24 +99,69 @@ set_sock_tcp_fastopen (int fd, int enable)
 #endif
 }
 
+unsigned long long
+get_time_msec (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static unsigned int
+hash_ip_addr (unsigned int h, const ip_addr_t *ip)
+{
+    int i;
+
+    if (IP_IS_V6 (ip)) {
+        for (i = 0; i < 4; i++)
+            h = (h ^ ip_2_ip6 (ip)->addr[i]) * 0x01000193;
+    } else {
+        h = (h ^ ip_2_ip4 (ip)->addr) * 0x01000193;
+    }
+
+    return h;
+}
+
+unsigned int
+get_flow_hash (const ip_addr_t *src, u16_t sport, const ip_addr_t *dst,
+               u16_t dport, u8_t proto)
+{
+    unsigned int h = 0x811c9dc5;
+
+    h = hash_ip_addr (h, src);
+    h = hash_ip_addr (h, dst);
+    h = (h ^ ((sport << 16) | dport)) * 0x01000193;
+    h = (h ^ proto) * 0x01000193;
+
+    return h ^ (h >> 15);
+}
+
 int
 hev_socks5_addr_from_lwip (HevSocks5Addr *addr, const ip_addr_t *ip, u16_t port)
 {
     switch (ip->type) {
     case IPADDR_TYPE_V4: {
         HevMappedDNS *dns = hev_mapped_dns_get ();
-        const char *name = NULL;
-        if (dns)
-            name = hev_mapped_dns_lookup (dns, ntohl (ip_2_ip4 (ip)->addr));
-        if (name)
+        int ipv4 = ntohl (ip_2_ip4 (ip)->addr);
+        char name[256];
+        if (dns && (hev_mapped_dns_lookup (dns, ipv4, name, 256) > 0))
             hev_socks5_addr_from_name (addr, name, htons (port));
         else
             hev_socks5_addr_from_ipv4 (addr, ip, htons (port));
         return 0;
     }
-    case IPADDR_TYPE_V6:
-        hev_socks5_addr_from_ipv6 (addr, ip, htons (port));
+    case IPADDR_TYPE_V6: {
+        HevMappedDNS *dns = hev_mapped_dns_get ();
+        const void *ipv6 = ip_2_ip6 (ip)->addr;
+        char name[256];
+        if (dns && (hev_mapped_dns_lookup6 (dns, ipv6, name, 256) > 0))
+            hev_socks5_addr_from_name (addr, name, htons (port));
+        else
+            hev_socks5_addr_from_ipv6 (addr, ip, htons (port));
         return 0;
+    }
     default:
         return -1;
     }
@@ -17,6 +17,9 @@ void run_as_daemon (const char *pid_file);
 int set_limit_nofile (int limit_nofile);
 int set_sock_mark (int fd, unsigned int mark);
 void set_sock_tcp_fastopen (int fd, int enable);
+unsigned long long get_time_msec (void);
+unsigned int get_flow_hash (const ip_addr_t *src, u16_t sport,
+                            const ip_addr_t *dst, u16_t dport, u8_t proto);
 
 int hev_socks5_addr_from_lwip (HevSocks5Addr *addr, const ip_addr_t *ip,
                                u16_t port);